@@ -0,0 +1,283 @@
+#include "bgp_compact.hpp"
+#include "const.hpp"
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+namespace {
+
+constexpr size_t BGP_HDR_LEN = 19;
+constexpr uint8_t BGP_ROUTE_REFRESH = 5;
+constexpr uint8_t ATTR_FLAG_EXTLEN = 0x10;
+constexpr uint8_t ATTR_MP_REACH_NLRI = 14;
+constexpr uint8_t ATTR_MP_UNREACH_NLRI = 15;
+constexpr uint16_t AFI_IPV4 = 1;
+constexpr uint16_t AFI_IPV6 = 2;
+constexpr uint8_t SAFI_UNICAST = 1;
+constexpr uint8_t SAFI_MULTICAST = 2;
+constexpr size_t OPEN_FIXED_LEN = 10;
+constexpr uint8_t OPT_PARAM_CAPABILITIES = 2;
+constexpr uint8_t OPT_PARAM_EXTENDED = 255;
+constexpr uint8_t CAP_ADD_PATH = 69;
+
+struct Session {
+    bool ok = true;
+    bool seen_open = false;
+    bool seen_keepalive = false;
+    // prefix or End-of-RIB key -> last message that mentions it
+    std::unordered_map<std::string, size_t> last;
+};
+
+inline uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+inline size_t left(const uint8_t *p, const uint8_t *end)
+{
+    return (size_t)(end - p);
+}
+
+// AFI/SAFI, 3 bytes: the End-of-RIB key, the prefix follows in prefix keys
+std::string family_key(uint16_t afi, uint8_t safi)
+{
+    std::string key(3, '\0');
+    key[0] = (char)(afi >> 8);
+    key[1] = (char)afi;
+    key[2] = (char)safi;
+    return key;
+}
+
+// keys of the prefixes in [p, end), false unless they parse exactly
+bool parse_prefixes(uint16_t afi, uint8_t safi, const uint8_t *p, const uint8_t *end,
+    std::vector<std::string> &keys)
+{
+    unsigned max_bits = afi == AFI_IPV4 ? 32 : afi == AFI_IPV6 ? 128 : 0;
+    if (max_bits == 0 || (safi != SAFI_UNICAST && safi != SAFI_MULTICAST)) {
+        // labels, route distinguishers... not worth guessing
+        return false;
+    }
+    while (p < end) {
+        unsigned bits = *p;
+        size_t nbytes = (bits + 7) / 8;
+        if (bits > max_bits || left(p, end) < 1 + nbytes) {
+            return false;
+        }
+        std::string key = family_key(afi, safi);
+        key.append((const char *)p, 1 + nbytes);
+        keys.push_back(std::move(key));
+        p += 1 + nbytes;
+    }
+    return true;
+}
+
+/**
+ * false unless an OPEN body parses and announces no capability that changes
+ * how NLRI is encoded: ADD-PATH prefixes every prefix with a path id.
+ * Other capabilities leave the NLRI alone (labels and route distinguishers
+ * come with their own SAFIs, which parse_prefixes() turns down).
+ */
+bool parse_open(const uint8_t *p, const uint8_t *end)
+{
+    if (left(p, end) < OPEN_FIXED_LEN) {
+        return false;
+    }
+    size_t params_len = p[9];
+    p += OPEN_FIXED_LEN;
+    // RFC 9072: 255, 255 and a 2-byte length, parameters with 2-byte lengths
+    bool extended = params_len == OPT_PARAM_EXTENDED && left(p, end) >= 1 && p[0] == OPT_PARAM_EXTENDED;
+    if (extended) {
+        if (left(p, end) < 3) {
+            return false;
+        }
+        params_len = get16(p + 1);
+        p += 3;
+    }
+    if (left(p, end) < params_len) {
+        return false;
+    }
+    const uint8_t *params_end = p + params_len;
+    size_t param_hdr_len = extended ? 3 : 2;
+    while (p < params_end) {
+        if (left(p, params_end) < param_hdr_len) {
+            return false;
+        }
+        uint8_t type = p[0];
+        size_t len = extended ? get16(p + 1) : p[1];
+        const uint8_t *v = p + param_hdr_len;
+        if (left(v, params_end) < len) {
+            return false;
+        }
+        if (type == OPT_PARAM_CAPABILITIES) {
+            for (const uint8_t *c = v; c < v + len;) {
+                if (left(c, v + len) < 2 || left(c + 2, v + len) < c[1]) {
+                    return false;
+                }
+                if (c[0] == CAP_ADD_PATH) {
+                    return false;
+                }
+                c += 2 + c[1];
+            }
+        }
+        p = v + len;
+    }
+    return true;
+}
+
+// keys an UPDATE body mentions, its AFI/SAFI if it's an End-of-RIB marker
+bool parse_update(const uint8_t *p, const uint8_t *end, std::vector<std::string> &keys)
+{
+    size_t n_keys = keys.size();
+    if (left(p, end) < 2) {
+        return false;
+    }
+    size_t withdrawn_len = get16(p);
+    p += 2;
+    if (left(p, end) < withdrawn_len + 2) {
+        return false;
+    }
+    if (!parse_prefixes(AFI_IPV4, SAFI_UNICAST, p, p + withdrawn_len, keys)) {
+        return false;
+    }
+    p += withdrawn_len;
+    size_t attr_len = get16(p);
+    p += 2;
+    if (left(p, end) < attr_len) {
+        return false;
+    }
+    const uint8_t *attr_end = p + attr_len;
+    uint16_t eor_afi = AFI_IPV4;
+    uint8_t eor_safi = SAFI_UNICAST;
+    while (p < attr_end) {
+        if (left(p, attr_end) < 3) {
+            return false;
+        }
+        uint8_t flags = p[0];
+        uint8_t type = p[1];
+        size_t hdr_len = (flags & ATTR_FLAG_EXTLEN) ? 4 : 3;
+        if (left(p, attr_end) < hdr_len) {
+            return false;
+        }
+        size_t len = (flags & ATTR_FLAG_EXTLEN) ? get16(p + 2) : p[2];
+        const uint8_t *v = p + hdr_len;
+        if (left(v, attr_end) < len) {
+            return false;
+        }
+        if (type == ATTR_MP_REACH_NLRI) {
+            // AFI, SAFI, next hop length, next hop, reserved, NLRI
+            if (len < 5 || len < 5u + v[3]) {
+                return false;
+            }
+            if (!parse_prefixes(get16(v), v[2], v + 5 + v[3], v + len, keys)) {
+                return false;
+            }
+        } else if (type == ATTR_MP_UNREACH_NLRI) {
+            // AFI, SAFI, withdrawn routes
+            if (len < 3) {
+                return false;
+            }
+            eor_afi = get16(v);
+            eor_safi = v[2];
+            if (!parse_prefixes(eor_afi, eor_safi, v + 3, v + len, keys)) {
+                return false;
+            }
+        }
+        p = v + len;
+    }
+    if (!parse_prefixes(AFI_IPV4, SAFI_UNICAST, attr_end, end, keys)) {
+        return false;
+    }
+    if (keys.size() == n_keys) {
+        keys.push_back(family_key(eor_afi, eor_safi));
+    }
+    return true;
+}
+
+} // namespace
+
+std::vector<char> bgp_compact(const std::vector<BgpHistoryMsg> &history)
+{
+    std::vector<char> keep(history.size(), false);
+    std::unordered_map<int, Session> sessions;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < history.size(); ++i) {
+        Session &s = sessions[history[i].src_id];
+        if (!s.ok) {
+            continue;
+        }
+        const uint8_t *p = history[i].bgp;
+        const uint8_t *end = p + history[i].len;
+        bool ok = true;
+        bool has_open = false;
+        bool only_keepalives = true;
+        bool has_refresh = false;
+        keys.clear();
+        while (ok && p < end) {
+            if (left(p, end) < BGP_HDR_LEN) {
+                ok = false;
+                break;
+            }
+            for (size_t k = 0; k < 16; ++k) {
+                ok = ok && p[k] == 0xff;
+            }
+            size_t len = get16(p + 16);
+            uint8_t type = p[18];
+            if (!ok || len < BGP_HDR_LEN || left(p, end) < len) {
+                ok = false;
+                break;
+            }
+            switch (type) {
+            case BGP_OPEN:
+                has_open = true;
+                only_keepalives = false;
+                ok = parse_open(p + BGP_HDR_LEN, p + len);
+                break;
+            case BGP_UPDATE:
+                only_keepalives = false;
+                ok = parse_update(p + BGP_HDR_LEN, p + len, keys);
+                break;
+            case BGP_KEEPALIVE:
+                break;
+            case BGP_ROUTE_REFRESH:
+                only_keepalives = false;
+                has_refresh = true;
+                break;
+            default:
+                // a NOTIFICATION resets the session, replay it as it was
+                ok = false;
+                break;
+            }
+            p += len;
+        }
+        if (!ok) {
+            s.ok = false;
+            continue;
+        }
+        if (has_open && !s.seen_open) {
+            s.seen_open = true;
+            keep[i] = true;
+        }
+        if (only_keepalives && !s.seen_keepalive) {
+            s.seen_keepalive = true;
+            keep[i] = true;
+        }
+        if (has_refresh) {
+            keep[i] = true;
+        }
+        for (auto &key : keys) {
+            s.last[std::move(key)] = i;
+        }
+    }
+    for (auto &[src_id, s] : sessions) {
+        for (auto &[key, i] : s.last) {
+            keep[i] = true;
+        }
+    }
+    for (size_t i = 0; i < history.size(); ++i) {
+        if (!sessions[history[i].src_id].ok) {
+            keep[i] = true;
+        }
+    }
+    return keep;
+}
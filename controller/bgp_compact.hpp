@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/**
+ * BGP-aware compaction of the message history of a node.
+ *
+ * A restarted daemon only needs the state its peers left it in: per
+ * session (src_id), the first OPEN, the first KEEPALIVE and, per prefix,
+ * the last UPDATE that announced or withdrew it. Prefixes are keyed by
+ * AFI/SAFI, so MP_REACH_NLRI/MP_UNREACH_NLRI count as well as plain IPv4
+ * NLRI; End-of-RIB markers are kept per AFI/SAFI the same way.
+ *
+ * Messages are kept or dropped whole and keep their order, nothing is
+ * re-encoded. A session whose history can't be parsed exactly (BGP
+ * messages split across payloads, NOTIFICATIONs, ADD-PATH or labeled
+ * families) is kept as it is.
+ */
+struct BgpHistoryMsg {
+    int src_id;
+    const uint8_t *bgp; // BGP messages following the real_pld_t
+    size_t len;
+};
+
+// keep[i] tells whether history[i] is still needed after a restart
+std::vector<char> bgp_compact(const std::vector<BgpHistoryMsg> &history);
@@ -1,16 +1,25 @@
 #include "channel.hpp"
 #include "const.hpp"
 #include "replay_manager.hpp"
+#include "cmd_queue.hpp"
+#include "ready_queue.hpp"
 
 #include <atomic>
 #include <mutex>
 #include <cassert>
 #include <unordered_set>
+#include <climits>
+
+extern "C" {
+#include <sys/uio.h>
+}
 
 extern volatile std::atomic<int> stage;
+extern Doorbell main_doorbell;
 
 std::mutex Channel::port_mng_mutex;
 std::atomic<int> Channel::n_channel = 0;
+bool Channel::shm_transport = false;
 std::unordered_map<int, uint16_t> Channel::next_port;
 std::unordered_map<std::pair<int,int>, uint16_t, pair_hash> Channel::port_store;
 
@@ -40,54 +49,217 @@ Channel::Channel(int fd, int epfd, int self_id, int peer_id, uint32_t events, Ch
         epfd_(epfd),
         self_id_(self_id),
         peer_id_(peer_id),
-        events_(events),
+        worker_(tid),
+        events_(events | EPOLLET),
         established_(false),
+        out_blocked_(false),
         rb_in_(RINGBUFFER_IN_SIZ),
+        mux_(nullptr),
+        shm_on_(false),
+        shm_offset_(0),
+#ifdef ZEROCOPY_SEND
+        out_offset_(0)
+#else
         rb_out_(RINGBUFFER_OUT_SIZ)
+#endif
+#ifdef IO_URING
+        , uring_(nullptr),
+        uring_ops_(0),
+        send_inflight_(false),
+        send_listed_(false)
+#endif
 {
+    if (epfd_ < 0) {
+        // driven by UringLoop
+        return;
+    }
     struct epoll_event ev = (struct epoll_event) {
-        .events = events,
-        .data = (union epoll_data) {.fd = fd}
+        .events = events_,
+        .data = (union epoll_data) {.ptr = this}
     };
     int r = epoll_ctl(epfd_, EPOLL_CTL_ADD, fd_, &ev);
     LOG("epoll_ctl EPOLL_CTL_ADD r=%d, errno=%d, fd=%d, tid=%d\n", r, errno, fd_, tid);
     dbg_assert(r == 0, "EPOLL_CTL_ADD fd_=%d failed", fd_);
 }
 
-void Channel::sendmsg(std::shared_ptr<Message> &msg) {
-    if (!(events_ & EPOLLOUT)) {
-        events_ |= EPOLLOUT;
-        struct epoll_event evt = (struct epoll_event) {
-            .events = events_,
-            .data = (union epoll_data) {.fd = fd_}
-        };
-        epoll_ctl(epfd_, EPOLL_CTL_MOD, fd_, &evt);
+void Channel::sendmsg(MessagePtr &msg) {
+    if (mux_) {
+        // in order with the other sessions of the node
+        mux_->sendmsg(msg);
+        return;
     }
+#ifdef IO_URING
+    if (uring_) {
+        pending_out_msgs_.push_back(msg);
+        uring_->want_send(this);
+        return;
+    }
+#endif
     real_hdr_t *hdr = (real_hdr_t *)msg->data();
     real_hdr_t orig_hdr = *hdr;
+#ifndef ZEROCOPY_SEND
     while (orig_hdr.msg_len > (int)rb_out_.capacity()) {
         rb_out_.expand();
     }
     assert(orig_hdr.msg_len <= (int)rb_out_.capacity());
+#endif
     LOG("[%3d, %3d] sendmsg(): msg_type=%s, len=%d, seq=%ld\n",
         self_id_, peer_id_, msg_type_name[orig_hdr.msg_type], orig_hdr.msg_len, orig_hdr.seq);
-    pending_out_msgs_.push(msg);
+    pending_out_msgs_.push_back(msg);
+    if (out_blocked_ || (shm_ && !shm_on_)) {
+        // queued behind a backlog, the next EPOLLOUT edge (or doorbell) flushes
+        // it, or behind the shm offer, the shim's REAL_SYNACK does
+        return;
+    }
+    flush_pending();
+}
+
+void Channel::flush_pending() {
+    if (shm_) {
+        // no EPOLLOUT, the shim rings once it made room
+        out_blocked_ = !flush_shm();
+        return;
+    }
+    // optimistic inline write, EPOLLOUT is only needed once the socket is full
+    if (!flush_out()) {
+        out_blocked_ = true;
+        arm_pollout();
+    }
+}
+
+/**
+ * Channels are edge-triggered. EPOLLOUT is added the first time a write
+ * hits EAGAIN and then stays armed: an edge only fires when the socket
+ * turns writable again, so it costs nothing while there is no backlog.
+ */
+void Channel::arm_pollout() {
+    if (events_ & EPOLLOUT) {
+        return;
+    }
+    events_ |= EPOLLOUT;
+    struct epoll_event ev = (struct epoll_event) {
+        .events = events_,
+        .data = (union epoll_data) {.ptr = this}
+    };
+    epoll_ctl(epfd_, EPOLL_CTL_MOD, fd_, &ev);
 }
 
-std::vector<std::shared_ptr<Message>> Channel::pollin() {
+void Channel::pollin(std::vector<MessagePtr> &incoming_msgs) {
     LOG("[%3d, %3d] pollin\n", self_id_, peer_id_);
 
-    std::vector<std::shared_ptr<Message>> incoming_msgs;
-    auto n_read = rb_in_.readFromFd(fd_);
-    LOG("read %ld bytes into ring buffer\n", n_read);
+    incoming_msgs.clear();
+    if (shm_ && !shm_on_ && shm_->readable()) {
+        // the shim took the offer: its REAL_SYNACK is in the pipe and the
+        // socket only carries doorbells from now on
+        shm_on_ = true;
+    }
+    if (shm_on_) {
+        pollin_shm(incoming_msgs);
+        return;
+    }
+    // edge-triggered, drain the socket until it would block
+    ssize_t n_read;
+    do {
+        n_read = rb_in_.readFromFd(fd_);
+        LOG("read %ld bytes into ring buffer\n", n_read);
+        parse_incoming(incoming_msgs);
+    } while (n_read > 0);
+    if (shm_ && shm_->readable()) {
+        // the REAL_SYNACK went into the pipe while the socket was read, what
+        // was read is its doorbell
+        dbg_assert(incoming_msgs.empty(), "[%3d, %3d] messages on the socket of a shm session", self_id_, peer_id_);
+        rb_in_.consume(rb_in_.availableRead());
+        shm_on_ = true;
+        pollin_shm(incoming_msgs);
+    }
+}
+
+/**
+ * Copies whatever the shim put in the pipe into rb_in_, parsed as if it
+ * came from the socket, until the pipe stays empty with rx_waiting set.
+ * A backlog waiting for room in the other pipe is retried here too, the
+ * shim's doorbell means either.
+ */
+void Channel::pollin_shm(std::vector<MessagePtr> &incoming_msgs) {
+    shm_->drain_doorbells();
+    do {
+        size_t len;
+        const char *data;
+        while ((data = shm_->front(&len)) != nullptr) {
+            if (rb_in_.availableWrite() == 0) {
+                rb_in_.expand();
+            }
+            size_t n = rb_in_.write(data, len);
+            shm_->consume(n);
+            LOG("[%3d, %3d] %ld bytes from the pipe\n", self_id_, peer_id_, n);
+            parse_incoming(incoming_msgs);
+        }
+    } while (!shm_->arm_rx());
+    if (out_blocked_) {
+        out_blocked_ = !flush_shm();
+        if (!out_blocked_) {
+            g_ready_nodes.mark(self_id_);
+        }
+    }
+}
 
+// same as flush_out(), into the pipe
+bool Channel::flush_shm() {
+    bool blocked = false;
+    while (!pending_out_msgs_.empty()) {
+        MessagePtr &msg = pending_out_msgs_.front();
+        shm_offset_ += shm_->put((char *)msg->data() + shm_offset_, msg->len() - shm_offset_);
+        if (shm_offset_ < msg->len()) {
+            if (shm_->arm_tx()) {
+                blocked = true;
+                break;
+            }
+            // the shim made room meanwhile
+            continue;
+        }
+        pending_out_msgs_.pop_front();
+        shm_offset_ = 0;
+    }
+    shm_->wake_rx();
+    return !blocked;
+}
+
+// nullptr if the session stays on the socket
+std::unique_ptr<ShmSession> Channel::offer_shm() {
+    if (!shm_transport || mux_) {
+        return nullptr;
+    }
+#ifdef IO_URING
+    if (uring_) {
+        // completions carry socket bytes only
+        return nullptr;
+    }
+#endif
+    return ShmSession::create(self_id_, peer_id_, fd_);
+}
+
+#ifdef IO_URING
+void Channel::feed(const void *buf, size_t len, std::vector<MessagePtr> &incoming_msgs) {
+    LOG("[%3d, %3d] feed %ld bytes\n", self_id_, peer_id_, len);
+
+    incoming_msgs.clear();
+    while (rb_in_.availableWrite() < len) {
+        rb_in_.expand();
+    }
+    bool r = rb_in_.put(buf, len);
+    assert(r);
+    parse_incoming(incoming_msgs);
+}
+#endif
+
+void Channel::parse_incoming(std::vector<MessagePtr> &incoming_msgs) {
     while (rb_in_.availableRead()) {
-        real_hdr_t hdr;
-        bool r = rb_in_.peek(&hdr, hdrsiz);
-        if (!r) {
+        real_hdr_t scratch;
+        auto *hdr = (const real_hdr_t *)rb_in_.span(hdrsiz, &scratch);
+        if (!hdr) {
             break;
         }
-        size_t msglen = hdr.msg_len;
+        size_t msglen = hdr->msg_len;
         while (msglen > rb_in_.capacity()) {
             rb_in_.expand();
         }
@@ -95,13 +267,12 @@ std::vector<std::shared_ptr<Message>> Channel::pollin() {
             break;
         }
         assert(msglen <= rb_in_.capacity());
-        auto msg = std::make_shared<Message>(msglen);
+        auto msg = MessagePool::make(msglen);
         msg->alloc_tail(msglen);
-        r = rb_in_.get(msg->data(), msglen);
+        bool r = rb_in_.get(msg->data(), msglen);
         assert(r);
         incoming_msgs.push_back(std::move(msg));
     }
-    return incoming_msgs;
 }
 
 void Channel::on_connect_ok()
@@ -110,50 +281,139 @@ void Channel::on_connect_ok()
         "expected CONN_INPROGRESS, actual state: %d", state_);
     state_ = CHANNEL_ESTABLISHED;
 
-    auto resp_msg = std::make_shared<Message>(synsiz);
+    auto resp_msg = MessagePool::make(synsiz);
     real_syn_t *syn = (real_syn_t *)resp_msg->alloc_tail(synsiz);
     syn->hdr.msg_type = REAL_SYN;
     syn->hdr.msg_len = synsiz;
     syn->cli_id = peer_id_;
     syn->svr_id = self_id_;
     syn->cli_port = this->alloc_port();
+    auto shm = offer_shm();
+    syn->flags = (shm ? REAL_SYN_SHM : 0) | (g_replay_mnger.window() > 0 ? REAL_SYN_ACKS : 0);
     this->sendmsg(resp_msg);
+    if (shm) {
+        // what follows waits for the shim's answer, the SYN must be out
+        dbg_assert(!out_blocked_, "[%3d, %3d] REAL_SYN blocked", self_id_, peer_id_);
+        shm_ = std::move(shm);
+    }
+    // replays on this channel may go ahead
+    g_ready_nodes.mark(self_id_);
 }
 
-void Channel::pollout() {
-    LOG("[%3d, %3d] pollout\n", self_id_, peer_id_);
-    dbg_assert(!pending_out_msgs_.empty(), "no pending msg in pollout()");
+#ifdef ZEROCOPY_SEND
+int Channel::fill_iov(struct iovec *iov, int max_iov) {
+    int iovcnt = 0;
+    for (auto &msg : pending_out_msgs_) {
+        if (iovcnt == max_iov) {
+            break;
+        }
+        int skip = iovcnt == 0 ? out_offset_ : 0;
+        iov[iovcnt].iov_base = (char *)msg->data() + skip;
+        iov[iovcnt].iov_len = msg->len() - skip;
+        iovcnt++;
+    }
+    return iovcnt;
+}
 
-    // move messages into ring buffer
-    while (!pending_out_msgs_.empty()) {
-        std::shared_ptr<Message> curr_msg = pending_out_msgs_.front();
-        if (curr_msg->len() <= (int)rb_out_.availableWrite()) {
-            bool r = rb_out_.put(curr_msg->data(), curr_msg->len());
-            assert(r);
-        } else {
-            LOG("break\n");
+// drop fully written messages, remember the offset into a partial one
+void Channel::consume_sent(const struct iovec *iov, int iovcnt, size_t n_bytes) {
+    for (int i = 0; i < iovcnt && n_bytes > 0; ++i) {
+        if (n_bytes < iov[i].iov_len) {
+            out_offset_ += n_bytes;
             break;
         }
-        LOG("add message len %d\n", (int)curr_msg->len());
-        pending_out_msgs_.pop();
+        n_bytes -= iov[i].iov_len;
+        pending_out_msgs_.pop_front();
+        out_offset_ = 0;
+    }
+}
+
+/**
+ * Gather the pending messages straight into one writev(), without
+ * staging them in a ring buffer. The messages stay alive in
+ * pending_out_msgs_ (and usually in the replay history) until the
+ * kernel has taken all their bytes.
+ */
+bool Channel::writev_pending() {
+    struct iovec iov[IOV_MAX];
+    int iovcnt = fill_iov(iov, IOV_MAX);
+    ssize_t n_bytes = writev(fd_, iov, iovcnt);
+    if (n_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    }
+    dbg_assert(n_bytes > 0, "writev: n_bytes = %ld, iovcnt = %d\n", n_bytes, iovcnt);
+    LOG("writev %ld bytes from %d messages\n", n_bytes, iovcnt);
+    consume_sent(iov, iovcnt, n_bytes);
+    return true;
+}
+
+bool Channel::flush_out() {
+    while (!pending_out_msgs_.empty()) {
+        if (!writev_pending()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef IO_URING
+// completion of the writev issued by UringLoop from uring_iov_
+void Channel::on_sent(int res) {
+    LOG("[%3d, %3d] uring writev %d bytes from %ld messages\n",
+        self_id_, peer_id_, res, uring_iov_.size());
+    if (res > 0) {
+        consume_sent(uring_iov_.data(), uring_iov_.size(), res);
+    }
+    if (!pending_out_msgs_.empty()) {
+        uring_->want_send(this);
+    } else {
+        g_ready_nodes.mark(self_id_);
     }
+}
+#endif
 
-    /* actually sending message */
-    int n_bytes = rb_out_.writeToFd(fd_);
-    dbg_assert(n_bytes > 0, "writev: n_bytes = %d, availableRead = %d\n", n_bytes, (int)rb_out_.availableRead());
-    rb_out_.consume(n_bytes);
-    if (!pending_out_msgs_.empty() || rb_out_.availableRead()) {
+#else
+bool Channel::flush_out() {
+    while (true) {
+        // move messages into ring buffer
+        while (!pending_out_msgs_.empty()) {
+            MessagePtr &curr_msg = pending_out_msgs_.front();
+            if (curr_msg->len() <= (int)rb_out_.availableWrite()) {
+                bool r = rb_out_.put(curr_msg->data(), curr_msg->len());
+                assert(r);
+            } else {
+                LOG("break\n");
+                break;
+            }
+            LOG("add message len %d\n", (int)curr_msg->len());
+            pending_out_msgs_.pop_front();
+        }
+        if (!rb_out_.availableRead()) {
+            return true;
+        }
+
+        /* actually sending message */
+        int n_bytes = rb_out_.writeToFd(fd_);
+        if (n_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false;
+        }
+        dbg_assert(n_bytes > 0, "writev: n_bytes = %d, availableRead = %d\n", n_bytes, (int)rb_out_.availableRead());
+        rb_out_.consume(n_bytes);
+    }
+}
+#endif
+
+void Channel::pollout() {
+    LOG("[%3d, %3d] pollout\n", self_id_, peer_id_);
+    if (!out_blocked_ || shm_) {
+        // edge without backlog, e.g. connect() completion, or a backlog
+        // waiting for the shim's doorbell
         return;
     }
-    // no message to send, disable EPOLLOUT
-    // LOG("Disabling EPOLLOUT()\n");
-    events_ &= ~EPOLLOUT;
-    struct epoll_event ev = (struct epoll_event) {
-        .events = events_,
-        .data = (union epoll_data) {.fd = fd_}
-    };
-    epoll_ctl(epfd_, EPOLL_CTL_MOD, fd_, &ev);
-    // LOG("Leaving pollout()\n");
+    out_blocked_ = !flush_out();
+    if (!out_blocked_) {
+        g_ready_nodes.mark(self_id_);
+    }
 }
 
 bool Channel::pollerr(int event) {
@@ -164,21 +424,41 @@ bool Channel::pollerr(int event) {
 
 Channel::~Channel()
 {
-    int r = epoll_ctl(epfd_, EPOLL_CTL_DEL, fd_, NULL);
-    LOG("epoll_ctl EPOLL_CTL_DEL r=%d, errno=%d, fd=%d, tid=%d\n", r, errno, fd_, tid);
-    if (r != 0) {
-        LOG("epoll del failed: %s\n", strerror(errno));
+    if (epfd_ >= 0) {
+        int r = epoll_ctl(epfd_, EPOLL_CTL_DEL, fd_, NULL);
+        LOG("epoll_ctl EPOLL_CTL_DEL r=%d, errno=%d, fd=%d, tid=%d\n", r, errno, fd_, tid);
+        if (r != 0) {
+            LOG("epoll del failed: %s\n", strerror(errno));
+        }
+    }
+    if (mux_) {
+        auto it = mux_->sessions_.find(peer_id_);
+        if (it != mux_->sessions_.end() && it->second == this) {
+            mux_->sessions_.erase(it);
+        }
+    } else {
+        close(this->fd_);
     }
-    close(this->fd_);
     if (established_) {
         // TODO: can this happen in STAGE_BUILDUP?
         assert(stage != STAGE_RESTORE && stage != STAGE_CONVERGE);
         int nchannel_old = n_channel--;
         int nchannel_new = nchannel_old - 1;
         LOG("n_channel %d => %d\n", nchannel_old, nchannel_new);
+        // stage_transition() waits for n_channel in STAGE_TEARDOWN
+        main_doorbell.ring();
     }
 }
 
+void Channel::attach_mux(Channel *mux)
+{
+    dbg_assert(mux->is_mux() && mux->self_id() == self_id_ && fd_ < 0,
+        "[%3d, %3d] attached to a channel that isn't its mux", self_id_, peer_id_);
+    mux_ = mux;
+    mux->sessions_[peer_id_] = this;
+    LOG("[%3d, %3d] session of mux fd=%d\n", self_id_, peer_id_, mux->fd());
+}
+
 void Channel::on_bgp_established()
 {
     dbg_assert(state_ == CHANNEL_ESTABLISHED,
@@ -190,19 +470,47 @@ void Channel::on_bgp_established()
     int nchannel_new = nchannel_old + 1;
     LOG("[%3d, %3d] fd=%d register, n_channel %d => %d\n", self_id_, peer_id_, fd_, nchannel_old, nchannel_new);
     established_ = true;
+    main_doorbell.ring();
 }
 
-void Channel::on_receive_syn() {
+void Channel::on_receive_syn(const real_syn_t *syn) {
     dbg_assert(state_ == ACCEPTED,
         "expected ACCEPTED, actual state: %d", state_);
     state_ = CHANNEL_ESTABLISHED;
     /* send SYNACK */
-    auto resp_msg = std::make_shared<Message>(synacksiz);
+    auto resp_msg = MessagePool::make(synacksiz);
     real_synack_t *synack = (real_synack_t *)resp_msg->alloc_tail(synacksiz);
     synack->hdr.msg_type = REAL_SYNACK;
     synack->hdr.msg_len = synacksiz;
     synack->hdr.seq = 0;
     synack->cli_port = this->alloc_port();
+    synack->svr_id = peer_id_;
+    auto shm = (syn->flags & REAL_SYN_SHM) ? offer_shm() : nullptr;
+    synack->flags = (shm ? REAL_SYN_SHM : 0) | (g_replay_mnger.window() > 0 ? REAL_SYN_ACKS : 0);
 
     this->sendmsg(resp_msg);
+    if (shm) {
+        // the shim switches once it read the SYNACK, so do we
+        dbg_assert(!out_blocked_, "[%3d, %3d] REAL_SYNACK blocked", self_id_, peer_id_);
+        shm_ = std::move(shm);
+        shm_on_ = true;
+        LOG("[%3d, %3d] shm transport\n", self_id_, peer_id_);
+    }
+    g_ready_nodes.mark(self_id_);
+}
+
+// the shim's answer to the shm offer in our REAL_SYN
+void Channel::on_receive_synack(const real_synack_t *synack) {
+    dbg_assert(shm_ != nullptr, "[%3d, %3d] REAL_SYNACK without a shm offer", self_id_, peer_id_);
+    if (synack->flags & REAL_SYN_SHM) {
+        dbg_assert(shm_on_, "[%3d, %3d] shm accepted on the socket", self_id_, peer_id_);
+        LOG("[%3d, %3d] shm transport\n", self_id_, peer_id_);
+    } else {
+        shm_.reset();
+        LOG("[%3d, %3d] shm declined\n", self_id_, peer_id_);
+    }
+    if (!pending_out_msgs_.empty()) {
+        flush_pending();
+    }
+    g_ready_nodes.mark(self_id_);
 }
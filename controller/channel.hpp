@@ -3,16 +3,22 @@
 #include "debug.hpp"
 #include "ring_buffer.hpp"
 #include "message.hpp"
+#include "message_pool.hpp"
+#include "uring.hpp"
+#include "shm_pipe.hpp"
+#include "const.hpp"
 
 #include <memory>
 #include <unordered_map>
-#include <queue>
+#include <deque>
 #include <cstdint>
 #include <cstring>
 #include <mutex>
+#include <vector>
 
 extern "C" {
 #include <sys/epoll.h>
+#include <sys/uio.h>
 }
 
 struct pair_hash {
@@ -30,13 +36,15 @@ public:
         CONN_INPROGRESS,
         ACCEPTED,
         CHANNEL_ESTABLISHED,
-        BGP_ESTABLISHED
+        BGP_ESTABLISHED,
+        MUX // a daemon's connection carrying the channels attached to it
     };
     Channel(int fd, int epfd, int self_id, int peer_id, uint32_t events, ChannelState init_state);
     ~Channel();
     uint16_t alloc_port();
-    void sendmsg(std::shared_ptr<Message> &msg);
-    std::vector<std::shared_ptr<Message>> pollin();
+    void sendmsg(MessagePtr &msg);
+    // appends complete messages to incoming_msgs, which is cleared first
+    void pollin(std::vector<MessagePtr> &incoming_msgs);
     void pollout();
     bool pollerr(int event); // destroy the connection or not
     int self_id() {
@@ -45,16 +53,57 @@ public:
     int peer_id() {
         return peer_id_;
     }
+    int fd() {
+        return fd_;
+    }
+    // the worker that created the channel, only it may send or poll on it
+    int worker() {
+        return worker_;
+    }
     bool bgp_is_established() {
         return established_;
     }
     ChannelState state() {
         return state_;
     }
+    bool is_mux() {
+        return state_ == MUX;
+    }
+    /**
+     * A session of the mux connection of its node: the channel has no fd
+     * of its own, sendmsg() queues on mux and the mux's worker routes what
+     * it reads here. Channels are detached when they are destroyed, the
+     * mux itself outlives them (see ChannelManager::release()).
+     */
+    void attach_mux(Channel *mux);
+    // the channel of peer_id attached to this mux, nullptr if there is none
+    Channel *mux_session(int peer_id) {
+        auto it = sessions_.find(peer_id);
+        return it == sessions_.end() ? nullptr : it->second;
+    }
+    std::vector<Channel *> mux_sessions() {
+        std::vector<Channel *> ret;
+        for (auto &[peer, ch] : sessions_) {
+            ret.push_back(ch);
+        }
+        return ret;
+    }
     void on_connect_ok();
-    void on_receive_syn();
+    void on_receive_syn(const real_syn_t *syn);
+    void on_receive_synack(const real_synack_t *synack);
     void on_bgp_established();
     static std::atomic<int> n_channel;
+    // CTRL_SHM_TRANSPORT=1: offer shm pipes in every handshake
+    static bool shm_transport;
+#ifdef IO_URING
+    // completion-driven mode, the channel is not registered to any epoll
+    void attach_uring(UringLoop *uring) {
+        uring_ = uring;
+    }
+    // same as pollin(), with bytes already received by the kernel
+    void feed(const void *buf, size_t len, std::vector<MessagePtr> &incoming_msgs);
+    void on_sent(int res);
+#endif
 
 private:
     ChannelState state_;
@@ -66,8 +115,46 @@ private:
     int epfd_;
     int self_id_;
     int peer_id_;
+    int worker_;
     uint32_t events_;
-    std::queue<std::shared_ptr<Message>> pending_out_msgs_; // owns messages
+    std::deque<MessagePtr> pending_out_msgs_; // owns messages
     bool established_;
-    RingBuffer rb_in_, rb_out_;
+    bool out_blocked_; // a write hit EAGAIN, waiting for an EPOLLOUT edge
+    StreamBuffer rb_in_;
+    Channel *mux_;                                // set on a session of a mux connection
+    std::unordered_map<int, Channel *> sessions_; // of a mux, by peer id
+    void parse_incoming(std::vector<MessagePtr> &incoming_msgs);
+    // write as much as the socket takes, false if it would block
+    bool flush_out();
+    void arm_pollout();
+    // flush_out() or flush_shm(), sets out_blocked_
+    void flush_pending();
+    /**
+     * Offered or in use. While it's only offered, messages queue until the
+     * shim's REAL_SYNACK tells which way they go; once it's on, the socket
+     * only carries doorbells.
+     */
+    std::unique_ptr<ShmSession> shm_;
+    bool shm_on_;
+    int shm_offset_; // bytes of pending_out_msgs_.front() already in the pipe
+    std::unique_ptr<ShmSession> offer_shm();
+    void pollin_shm(std::vector<MessagePtr> &incoming_msgs);
+    bool flush_shm();
+#ifdef ZEROCOPY_SEND
+    // bytes of pending_out_msgs_.front() already written
+    int out_offset_;
+    int fill_iov(struct iovec *iov, int max_iov);
+    void consume_sent(const struct iovec *iov, int iovcnt, size_t n_bytes);
+    bool writev_pending();
+#else
+    StreamBuffer rb_out_;
+#endif
+#ifdef IO_URING
+    friend class UringLoop;
+    UringLoop *uring_;
+    int uring_ops_;      // requests in flight, including multishot ones
+    bool send_inflight_; // at most one writev per channel keeps bytes ordered
+    bool send_listed_;
+    std::vector<struct iovec> uring_iov_;
+#endif
 };
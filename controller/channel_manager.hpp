@@ -1,37 +1,142 @@
 #include "channel.hpp"
 #include "const.hpp"
 
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+/**
+ * Channel table sized by the topology: one slot per directed edge (u, v),
+ * laid out CSR style so that the neighbors of u occupy
+ * [row_start_[u], row_start_[u + 1]) of adj_ and slots_.
+ *
+ * Channels that have no slot of their own (a connection for a pair that
+ * isn't an edge, or one that superseded an older channel of the same pair)
+ * are kept alive in unslotted_ until they are deleted, so a channel is
+ * never destroyed while it is still registered with a poller.
+ *
+ * Mux connections (see MUX_SOCKET_NAME) are kept by node in muxes_, their
+ * sessions take the slots of their edges like any channel.
+ */
 class ChannelManager {
 public:
-    void init(int n_nodes) {
-        for (int u = 0; u <= n_nodes; ++u) {
-            id2fd.emplace_back(n_nodes + 1);
+    void init(const std::vector<std::vector<int>> &G) {
+        row_start_.assign(G.size() + 1, 0);
+        adj_.clear();
+        for (size_t u = 0; u < G.size(); ++u) {
+            size_t begin = adj_.size();
+            adj_.insert(adj_.end(), G[u].begin(), G[u].end());
+            std::sort(adj_.begin() + begin, adj_.end());
+            adj_.erase(std::unique(adj_.begin() + begin, adj_.end()), adj_.end());
+            row_start_[u + 1] = adj_.size();
         }
+        slots_ = std::vector<std::shared_ptr<Channel>>(adj_.size());
+        muxes_ = std::vector<std::shared_ptr<Channel>>(G.size());
     }
     std::shared_ptr<Channel> get(int node_id, int peer_id) {
-        if (id2fd[node_id][peer_id] <= 0 || id2fd[node_id][peer_id] >= MAX_CONNS) {
+        int s = slot(node_id, peer_id);
+        return s < 0 ? nullptr : slots_[s];
+    }
+    std::shared_ptr<Channel> make_channel(int fd, int epfd, int self_id, int peer_id, uint32_t events, Channel::ChannelState init_state) {
+        auto ch = std::make_shared<Channel>(fd, epfd, self_id, peer_id, events, init_state);
+        int s = slot(self_id, peer_id);
+        if (s >= 0 && !slots_[s]) {
+            slots_[s] = ch;
+            return ch;
+        }
+        LOG("channel %d -> %d is unslotted (fd=%d)\n", self_id, peer_id, fd);
+        std::unique_lock lock(unslotted_mutex_);
+        if (s >= 0) {
+            // the newest channel of a pair is the one replay goes to
+            unslotted_.push_back(std::move(slots_[s]));
+            slots_[s] = ch;
+        } else {
+            unslotted_.push_back(ch);
+        }
+        return ch;
+    }
+    // the newest mux of node_id replaces an older one, which is kept until it's deleted
+    std::shared_ptr<Channel> make_mux(int fd, int epfd, int node_id) {
+        auto mux = std::make_shared<Channel>(fd, epfd, node_id, 0, EPOLLIN, Channel::MUX);
+        std::unique_lock lock(mux_mutex_);
+        if (muxes_[node_id]) {
+            LOG("mux of %d superseded (fd=%d)\n", node_id, muxes_[node_id]->fd());
+            std::unique_lock unslotted_lock(unslotted_mutex_);
+            unslotted_.push_back(std::move(muxes_[node_id]));
+        }
+        muxes_[node_id] = mux;
+        return mux;
+    }
+    std::shared_ptr<Channel> mux(int node_id) {
+        if (node_id < 0 || (size_t)node_id >= muxes_.size()) {
             return nullptr;
         }
-        return fd2ch[id2fd[node_id][peer_id]];
+        std::unique_lock lock(mux_mutex_);
+        return muxes_[node_id];
     }
-    std::shared_ptr<Channel> get_by_fd(int fd) {
-        return fd2ch[fd];
+    /**
+     * Drop the table's reference to ch, the caller gets it. The sessions
+     * of a mux are released, and destroyed, first.
+     */
+    std::shared_ptr<Channel> release(Channel *ch) {
+        if (ch->is_mux()) {
+            for (Channel *session : ch->mux_sessions()) {
+                release(session);
+            }
+            std::unique_lock lock(mux_mutex_);
+            auto &mux = muxes_[ch->self_id()];
+            if (mux.get() == ch) {
+                return std::move(mux);
+            }
+        }
+        int s = slot(ch->self_id(), ch->peer_id());
+        if (s >= 0 && slots_[s].get() == ch) {
+            return std::move(slots_[s]);
+        }
+        std::unique_lock lock(unslotted_mutex_);
+        auto it = std::find_if(unslotted_.begin(), unslotted_.end(),
+            [ch](const std::shared_ptr<Channel> &p) { return p.get() == ch; });
+        if (it == unslotted_.end()) {
+            return nullptr;
+        }
+        auto owned = std::move(*it);
+        unslotted_.erase(it);
+        return owned;
     }
-    template <class... Args>
-    std::shared_ptr<Channel> make_channel(int fd, int epfd, int self_id, int peer_id, uint32_t events, Channel::ChannelState init_state) {
-        id2fd[self_id][peer_id] = fd;
-        return fd2ch[fd] = std::make_shared<Channel>(fd, epfd, self_id, peer_id, events, init_state);
+    void delete_channel(Channel *ch) {
+        release(ch);
     }
-    void delete_channel(int fd) {
-        auto ch = fd2ch[fd];
-        if (ch) {
-            id2fd[ch->self_id()][ch->peer_id()] = 0;
+    size_t n_slots() const {
+        return slots_.size();
+    }
+    // slots of the channels of node_id are [first, second)
+    std::pair<int, int> slots_of(int node_id) const {
+        if (node_id < 0 || (size_t)node_id + 1 >= row_start_.size()) {
+            return {0, 0};
+        }
+        return {row_start_[node_id], row_start_[node_id + 1]};
+    }
+    // index of the edge (node_id, peer_id), -1 if there is none
+    int slot(int node_id, int peer_id) const {
+        if (node_id < 0 || (size_t)node_id + 1 >= row_start_.size()) {
+            return -1;
+        }
+        auto begin = adj_.begin() + row_start_[node_id];
+        auto end = adj_.begin() + row_start_[node_id + 1];
+        auto it = std::lower_bound(begin, end, peer_id);
+        if (it == end || *it != peer_id) {
+            return -1;
         }
-        fd2ch[fd] = nullptr;
+        return it - adj_.begin();
     }
 private:
-    std::vector<std::vector<int>> id2fd;
-    std::array<std::shared_ptr<Channel>, MAX_CONNS> fd2ch;
+    std::vector<int> row_start_;
+    std::vector<int> adj_;
+    std::vector<std::shared_ptr<Channel>> slots_;
+    std::mutex unslotted_mutex_;
+    std::vector<std::shared_ptr<Channel>> unslotted_;
+    std::mutex mux_mutex_;
+    std::vector<std::shared_ptr<Channel>> muxes_;
 };
 
 extern ChannelManager g_channel_manager;
@@ -0,0 +1,153 @@
+#include "checkpoint.hpp"
+#include "message_pool.hpp"
+#include "const.hpp"
+
+#include <cstdio>
+#include <format>
+#include <iostream>
+
+extern long gettime_ns(int clock_id = CLOCK_MONOTONIC);
+
+CheckpointWriter g_checkpoint;
+
+namespace {
+
+constexpr uint64_t MAGIC = 0x54504b43594c5052ULL; // "RPLYCKPT"
+constexpr uint32_t VERSION = 1;
+
+template <typename T>
+void put(FILE *f, const T &v)
+{
+    dbg_assert(fwrite(&v, sizeof(v), 1, f) == 1, "checkpoint: fwrite failed");
+}
+
+template <typename T>
+bool get(FILE *f, T &v)
+{
+    return fread(&v, sizeof(v), 1, f) == 1;
+}
+
+void put_entries(FILE *f, const std::vector<NodeCheckpoint::Entry> &entries, const SpillLog *spill)
+{
+    std::vector<char> buf;
+    put(f, (uint64_t)entries.size());
+    for (auto &e : entries) {
+        put(f, e.src_id);
+        put(f, e.len);
+        put(f, e.timestamp);
+        if (e.msg) {
+            dbg_assert(fwrite(e.msg->data(), 1, e.len, f) == (size_t)e.len, "checkpoint: fwrite failed");
+            continue;
+        }
+        // extents in the spill log are never rewritten, no lock needed
+        buf.resize(e.len);
+        spill->read(e.spill_off, {{buf.data(), buf.size()}});
+        dbg_assert(fwrite(buf.data(), 1, e.len, f) == (size_t)e.len, "checkpoint: fwrite failed");
+    }
+}
+
+bool get_entries(FILE *f, std::vector<NodeCheckpoint::Entry> &entries)
+{
+    uint64_t n;
+    if (!get(f, n)) {
+        return false;
+    }
+    entries.resize(n);
+    for (auto &e : entries) {
+        if (!get(f, e.src_id) || !get(f, e.len) || !get(f, e.timestamp) || e.len < (int)sizeof(real_pld_t)) {
+            return false;
+        }
+        e.msg = MessagePool::make(e.len);
+        if (fread(e.msg->alloc_tail(e.len), 1, e.len, f) != (size_t)e.len) {
+            return false;
+        }
+        e.spill_off = -1;
+    }
+    return true;
+}
+
+} // namespace
+
+void CheckpointWriter::write(Checkpoint ck)
+{
+    // teardowns are minutes apart, a write still running is rare
+    wait();
+    thread_ = std::thread([this, ck = std::move(ck)]() {
+        write_file(ck);
+    });
+}
+
+void CheckpointWriter::write_file(const Checkpoint &ck)
+{
+    long start_ts = gettime_ns();
+    std::string tmp_path = path_ + ".tmp";
+    FILE *f = fopen(tmp_path.c_str(), "w");
+    dbg_assert(f != nullptr, "fopen(%s) failed", tmp_path.c_str());
+    put(f, MAGIC);
+    put(f, VERSION);
+    put(f, ck.iteration_round);
+    put(f, ck.iteration_idx);
+    put(f, ck.iteration_delta);
+    put(f, ck.export_tag);
+    put(f, (uint64_t)ck.idle_parts.size());
+    fwrite(ck.idle_parts.data(), 1, ck.idle_parts.size(), f);
+    put(f, (uint64_t)ck.seen_nodes.size());
+    fwrite(ck.seen_nodes.data(), sizeof(int), ck.seen_nodes.size(), f);
+    put(f, (uint64_t)ck.nodes.size());
+    for (auto &node : ck.nodes) {
+        put(f, node.node_id);
+        put(f, node.replayed_seq);
+        put(f, node.restore_until_seq);
+        put_entries(f, node.history, spill_);
+        put_entries(f, node.delayed, spill_);
+        put(f, (uint64_t)node.compacted.size());
+        for (auto &[src_id, ts] : node.compacted) {
+            put(f, src_id);
+            put(f, ts);
+        }
+    }
+    long size = ftell(f);
+    dbg_assert(fflush(f) == 0 && fsync(fileno(f)) == 0, "checkpoint: flushing %s failed", tmp_path.c_str());
+    fclose(f);
+    dbg_assert(rename(tmp_path.c_str(), path_.c_str()) == 0, "rename(%s) failed", tmp_path.c_str());
+    std::cout << std::format("{:.6f}: checkpoint of round {} part {}: {} bytes in {:.3f}s",
+        gettime_ns() / 1e9, ck.iteration_round, ck.iteration_idx, size, (gettime_ns() - start_ts) / 1e9) << std::endl;
+}
+
+bool CheckpointWriter::load(const std::string &path, Checkpoint &ck,
+    const std::function<void(NodeCheckpoint &)> &on_node)
+{
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == nullptr) {
+        return false;
+    }
+    uint64_t magic, n;
+    uint32_t version;
+    bool ok = get(f, magic) && magic == MAGIC && get(f, version) && version == VERSION
+        && get(f, ck.iteration_round) && get(f, ck.iteration_idx) && get(f, ck.iteration_delta)
+        && get(f, ck.export_tag) && get(f, n);
+    if (ok) {
+        ck.idle_parts.resize(n);
+        ok = fread(ck.idle_parts.data(), 1, n, f) == n && get(f, n);
+    }
+    if (ok) {
+        ck.seen_nodes.resize(n);
+        ok = fread(ck.seen_nodes.data(), sizeof(int), n, f) == n && get(f, n);
+    }
+    for (uint64_t i = 0; ok && i < n; ++i) {
+        NodeCheckpoint node;
+        uint64_t n_compacted;
+        ok = get(f, node.node_id) && get(f, node.replayed_seq) && get(f, node.restore_until_seq)
+            && get_entries(f, node.history) && get_entries(f, node.delayed) && get(f, n_compacted);
+        for (uint64_t j = 0; ok && j < n_compacted; ++j) {
+            std::pair<int, long> c;
+            ok = get(f, c.first) && get(f, c.second);
+            node.compacted.push_back(c);
+        }
+        if (ok) {
+            on_node(node);
+        }
+    }
+    fclose(f);
+    return ok;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "message.hpp"
+#include "spill_log.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Replay state of this host at the end of a STAGE_TEARDOWN, written so a
+ * run that dies hours in can be resumed (--resume) at the partition it was
+ * about to start instead of from round 0.
+ *
+ * The main thread only takes a snapshot: the partition schedule and, per
+ * local node, the history index with a reference to each resident payload
+ * (a view of its arena chunk) or its spill log offset. A writer thread
+ * then streams it to path.tmp and renames that over path, so a crash while
+ * writing keeps the previous checkpoint.
+ *
+ * The format is native-endian and only read back by the same binary: a
+ * header, the schedule, then each node's counters, entries and payloads.
+ * Every host checkpoints its own nodes, they're all resumed together.
+ */
+struct NodeCheckpoint {
+    struct Entry {
+        int src_id;
+        int len;
+        long timestamp;
+        MessagePtr msg; // the REAL_PAYLOAD, null if only in the spill log
+        long spill_off;
+    };
+    int node_id;
+    uint64_t replayed_seq;
+    uint64_t restore_until_seq;
+    std::vector<Entry> history;
+    std::vector<Entry> delayed;
+    std::vector<std::pair<int, long>> compacted;
+};
+
+struct Checkpoint {
+    int iteration_round = 0;
+    int iteration_idx = 0;
+    int iteration_delta = 1;
+    int export_tag = 1;
+    std::vector<char> idle_parts;
+    std::vector<int> seen_nodes;
+    std::vector<NodeCheckpoint> nodes;
+};
+
+class CheckpointWriter {
+public:
+    ~CheckpointWriter() {
+        wait();
+    }
+    // spill is where the non-resident payloads are read from
+    void open(const std::string &path, const SpillLog *spill) {
+        path_ = path;
+        spill_ = spill;
+    }
+    bool is_open() const {
+        return !path_.empty();
+    }
+    // writes ck in the background, after the previous write is done
+    void write(Checkpoint ck);
+    void wait() {
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    /**
+     * Reads the checkpoint at path: the schedule into ck, and each node,
+     * with its payloads, to on_node. False if there's none or it doesn't
+     * belong to this binary.
+     */
+    static bool load(const std::string &path, Checkpoint &ck,
+        const std::function<void(NodeCheckpoint &)> &on_node);
+private:
+    std::string path_;
+    const SpillLog *spill_ = nullptr;
+    std::thread thread_;
+
+    void write_file(const Checkpoint &ck);
+};
+
+extern CheckpointWriter g_checkpoint;
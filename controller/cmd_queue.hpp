@@ -0,0 +1,170 @@
+#pragma once
+
+#include "debug.hpp"
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+}
+
+/**
+ * eventfd based wakeup. ring() only issues a write when the doorbell isn't
+ * already pending, so a burst of notifications costs one syscall and one
+ * wakeup of the waiter.
+ */
+class Doorbell {
+public:
+    Doorbell() {
+        efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        dbg_assert(efd_ >= 0, "eventfd failed");
+    }
+    ~Doorbell() {
+        close(efd_);
+    }
+    int fd() const {
+        return efd_;
+    }
+    void ring() {
+        if (pending_.exchange(true, std::memory_order_acq_rel)) {
+            return;
+        }
+        uint64_t one = 1;
+        int r = write(efd_, &one, sizeof(one));
+        dbg_assert(r == sizeof(one), "eventfd write failed");
+    }
+    /**
+     * Must be called before looking at whatever the doorbell guards, the
+     * order depends on it. The count is read before pending_ is reset: a
+     * ring() in between finds pending_ still set and writes nothing, but
+     * its work was published before, so the caller sees it when it looks
+     * next. Resetting first could let the read eat the count of a ring()
+     * that had just set pending_ again; pending_ would then stay set with
+     * no count, and no later ring() would ever write.
+     */
+    void clear() {
+        uint64_t cnt;
+        (void)!read(efd_, &cnt, sizeof(cnt));
+        pending_.store(false, std::memory_order_seq_cst);
+    }
+    // for threads that have nothing else to poll
+    void wait(int timeout_ms) {
+        struct pollfd pfd = {.fd = efd_, .events = POLLIN, .revents = 0};
+        poll(&pfd, 1, timeout_ms);
+        clear();
+    }
+private:
+    int efd_;
+    std::atomic<bool> pending_{false};
+};
+
+/**
+ * Multi-producer single-consumer queue of commands (Vyukov's
+ * sequence-per-slot ring), with a Doorbell so the consumer can wait for it
+ * in epoll or io_uring. Commands are moved out on drain, so a slot doesn't
+ * keep references alive after its command was handled.
+ *
+ * A push never waits for the consumer: workers push into each other's
+ * queues, and two of them spinning on each other's full ring would never
+ * drain their own. What doesn't fit goes to an unbounded overflow list,
+ * and while that list is in use every push goes there, so the commands of
+ * a producer are handled in the order it pushed them.
+ */
+template <class T>
+class CmdQueue {
+public:
+    explicit CmdQueue(size_t capacity = 1024) : mask_(capacity - 1), slots_(new Slot[capacity]) {
+        dbg_assert((capacity & mask_) == 0, "CmdQueue capacity %ld is not a power of two", capacity);
+        for (size_t i = 0; i < capacity; ++i) {
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+    int fd() const {
+        return doorbell_.fd();
+    }
+    void push(const T &cmd) {
+        if (overflowed_.load(std::memory_order_acquire) || !try_push(cmd)) {
+            std::lock_guard lock(overflow_mutex_);
+            overflow_.push_back(cmd);
+            overflowed_.store(true, std::memory_order_release);
+        }
+        doorbell_.ring();
+    }
+    // consumer only, handles every queued command
+    template <class F>
+    void drain(F &&handle) {
+        doorbell_.clear();
+        drain_ring(handle);
+        while (overflowed_.load(std::memory_order_acquire)) {
+            std::deque<T> batch;
+            {
+                std::lock_guard lock(overflow_mutex_);
+                batch.swap(overflow_);
+            }
+            // the ring only holds commands pushed before the batch's
+            drain_ring(handle);
+            for (T &cmd : batch) {
+                handle(cmd);
+            }
+            std::lock_guard lock(overflow_mutex_);
+            if (overflow_.empty()) {
+                overflowed_.store(false, std::memory_order_release);
+            }
+        }
+    }
+private:
+    // false if the ring is full
+    bool try_push(const T &cmd) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            Slot &slot = slots_[pos & mask_];
+            size_t seq = slot.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.cmd = cmd;
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    template <class F>
+    void drain_ring(F &handle) {
+        while (true) {
+            Slot &slot = slots_[head_ & mask_];
+            if (slot.seq.load(std::memory_order_acquire) != head_ + 1) {
+                return;
+            }
+            T cmd = std::move(slot.cmd);
+            slot.seq.store(head_ + mask_ + 1, std::memory_order_release);
+            head_++;
+            handle(cmd);
+        }
+    }
+
+    struct Slot {
+        std::atomic<size_t> seq;
+        T cmd;
+    };
+    size_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+    alignas(64) std::atomic<size_t> tail_{0};
+    alignas(64) size_t head_ = 0;
+    std::atomic<bool> overflowed_{false};
+    std::mutex overflow_mutex_;
+    std::deque<T> overflow_;
+    Doorbell doorbell_;
+};
@@ -6,8 +6,9 @@ const char *msg_type_name[REAL_MAX_MSGTYPE] = {
     "REAL_SYNACK",
     "REAL_PAYLOAD",
     "REAL_ACK",
-    "REAL_ENDOFSTAGE",
-    "REAL_KEEPBUSY",
+    "REAL_TOKEN",
+    "REAL_IDLE",
+    "REAL_FIN",
 };
 
 const char *stage_name[STAGE_MAX] = {
@@ -5,9 +5,18 @@
 constexpr const char* MNG_SOCKET_PATH = "/opt/lwc/volumes/ripc/msg_manager_socket";
 constexpr long MAX_THREADS = 64;
 constexpr long MAX_HOSTS = 64;
+// tid of the thread serving remote host h: past the workers, the acceptor and main
+constexpr long REMOTE_TID_BASE = MAX_THREADS + 2;
+constexpr long MAX_TIDS = REMOTE_TID_BASE + MAX_HOSTS;
 constexpr long MAX_CLIENTS = 20000;
 constexpr long MAX_CONNS = 1 << 20;
+// events fetched per epoll_wait(), the rest stay ready for the next call
+constexpr int MAX_EVENTS = 1024;
 constexpr long PORT_START = 10000;
+// io_uring backend: SQ entries and provided recv buffers per worker
+constexpr unsigned URING_ENTRIES = 4096;
+constexpr unsigned URING_NBUFS = 1024;
+constexpr unsigned URING_BUFSIZ = 1 << 12;
 
 constexpr long SEC_PER_NS = 1'000'000'000;
 constexpr long MSEC_PER_NS = 1'000'000;
@@ -15,7 +24,12 @@ constexpr long USEC_PER_NS = 1'000;
 constexpr long BUILDUP_TRY_INTERVAL = 1'000'000'000;
 constexpr long CONVERGE_TIMEOUT = 3'500'000'000;
 constexpr long EXEC_TIMEOUT_IN_SEC = 180;
-constexpr long KEEPBUSY_INTERVAL = 100'000'000;
+// spilled history is read back this many bytes at a time
+constexpr long SPILL_CHUNK = 1 << 20;
+// quiet period after every online node reported idle, before a stage ends
+constexpr long QUIESCE_HOLD = 200'000'000;
+// a node that went idle with a timer due within this is busy until it fired
+constexpr long IDLE_TIMER_MAX = 2'000'000'000;
 
 #define BGP_TYPE(buf) (*((u_char *)(buf) + 18))
 constexpr long BGP_OPEN = 1;
@@ -28,8 +42,9 @@ enum RealMsgType {
     REAL_SYNACK, // body: 4 byte, 0 stands for ok, other value indicates errno
     REAL_PAYLOAD,
     REAL_ACK,
-    REAL_ENDOFSTAGE,
-    REAL_KEEPBUSY,
+    REAL_TOKEN, // controller to controller, see Termination
+    REAL_IDLE,
+    REAL_FIN, // shim to controller, a session of a mux connection is closed
     REAL_MAX_MSGTYPE,
 };
 
@@ -58,19 +73,59 @@ typedef struct {
     // ignored by controller, only used by
     // listener's shim
     uint16_t cli_port;
+    uint16_t flags; // REAL_SYN_*, in what used to be padding
 } real_syn_t;
 
 typedef struct {
     real_hdr_t hdr;
     uint16_t cli_port;
+    uint16_t flags;
+    int32_t svr_id; // of the REAL_SYN answered, tells the sessions of a mux connection apart
 } real_synack_t;
 
+/**
+ * Handshake flags. REAL_SYN_SHM offers the session's shm pipes (see
+ * shm_pipe.hpp) in the REAL_SYN of whichever side connected and accepts
+ * them in the REAL_SYNACK. The controller connects to listeners without a
+ * reply of its own, the shim answers that offer with a REAL_SYNACK, in the
+ * pipe if it takes it.
+ */
+constexpr uint16_t REAL_SYN_SHM = 1;
+// set by the controller, in its REAL_SYN or REAL_SYNACK, when it replays in
+// a window: the shim sends a REAL_ACK per message consumed, none otherwise
+constexpr uint16_t REAL_SYN_ACKS = 2;
+
+/**
+ * A daemon whose shim is built with MUX=1 keeps a single connection for
+ * all its BGP sessions, from /ripc/emu-real-<node>/mux. A session is
+ * opened by a REAL_SYN on it, from either side, and closed by the shim's
+ * REAL_FIN, a real_pld_t without payload. Payloads and REAL_FINs tell
+ * their session by src_id/dst_id, a REAL_SYNACK by svr_id; acks and idle
+ * reports are per node anyway.
+ */
+constexpr const char *MUX_SOCKET_NAME = "mux";
+
 typedef struct {
     real_hdr_t hdr;
     int32_t src_id;
     int32_t dst_id;
 } real_pld_t;
 
+// sent by a shim whose daemon is about to block, hdr.seq is the last consumed seq
+typedef struct {
+    real_hdr_t hdr;
+    int64_t n_sent;     // REAL_PAYLOADs written so far
+    int64_t timeout_ns; // until the daemon's ppoll() times out, -1 if it has no timer
+} real_idle_t;
+
+// stage termination token, passed to the next host; hdr.seq is the stage epoch
+typedef struct {
+    real_hdr_t hdr;
+    int64_t count;   // REAL_PAYLOADs sent - received by the hosts it visited
+    int32_t black;   // one of them received a payload since the last wave
+    int32_t decided; // every host is done, end the stage
+} real_token_t;
+
 constexpr int hdrsiz = sizeof(real_hdr_t);
 constexpr int synsiz = sizeof(real_syn_t);
 constexpr int synacksiz = sizeof(real_synack_t);
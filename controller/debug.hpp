@@ -3,11 +3,16 @@
 #include <string>
 #include <format>
 
-extern FILE *log_file[128];
+extern FILE *log_file[]; // by tid, MAX_TIDS of them
 extern std::string logPath;
 extern thread_local int tid;
 
-#ifdef MNG_DEBUG
+#if defined(MNG_TRACE)
+// binary records, formatted offline by trace_decode, see trace.hpp
+#include "trace.hpp"
+#define LOG(fmt, ...) trace_event(fmt, ##__VA_ARGS__)
+#define TRACE_FLUSH() trace_flush()
+#elif defined(MNG_DEBUG)
 #define LOG(fmt, ...) \
     do {\
         if (log_file[tid] == NULL) {\
@@ -19,7 +24,9 @@ extern thread_local int tid;
         fprintf(log_file[tid], "%018ld: " fmt, ms, ##__VA_ARGS__); \
         fflush(log_file[tid]); \
     } while (0)
+#define TRACE_FLUSH() do {} while (0)
 #else //MNG_DEBUG
+#define TRACE_FLUSH() do {} while (0)
 static inline void log_stub(const char *fmt, ...) {
     (void)fmt;
 }
@@ -34,6 +41,7 @@ static inline void log_stub(const char *fmt, ...) {
             long ms = _ts.tv_sec * 1000000 + _ts.tv_nsec / 1000;\
             printf("%018ld: " fmt ": %s\n", ms, ##__VA_ARGS__, strerror(errno));\
             fflush(stdout);\
+            TRACE_FLUSH();\
             abort();\
         }\
     } while (0)
@@ -0,0 +1,124 @@
+#include "history.hpp"
+#include "message_pool.hpp"
+#include "const.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+static inline int align8(int len)
+{
+    return (len + 7) & ~7;
+}
+
+void History::push_index(int src_id, long ts, int len, uint64_t loc)
+{
+    src_id_.push_back(src_id);
+    timestamp_.push_back(ts);
+    len_.push_back(len);
+    loc_.push_back(loc);
+    spill_off_.push_back(-1);
+}
+
+uint8_t *History::alloc(int len, uint64_t &loc)
+{
+    int aligned = align8(len);
+    if (chunks_.empty() || chunk_used_ + aligned > chunks_.back()->cap()) {
+        // a record bigger than a chunk gets one of its own
+        chunks_.push_back(MessagePool::make(std::max(CHUNK_SIZE, aligned)));
+        chunk_used_ = 0;
+    }
+    loc = (uint64_t)(chunks_.size() - 1) << 32 | (uint32_t)chunk_used_;
+    chunk_used_ += aligned;
+    arena_bytes_ += aligned;
+    return at(loc);
+}
+
+void History::append(int src_id, long ts, const void *data, int len)
+{
+    uint64_t loc;
+    memcpy(alloc(len, loc), data, len);
+    push_index(src_id, ts, len, loc);
+}
+
+void History::append(int src_id, long ts, Pieces pieces, int len)
+{
+    push_index(src_id, ts, len, NOWHERE);
+    pieces_.resize(size());
+    pieces_.back() = std::move(pieces);
+}
+
+void History::append(const History &other, size_t i)
+{
+    dbg_assert(other.resident(i), "History::append(): entry %ld isn't resident", i);
+    if (other.loc_[i] != NOWHERE) {
+        append(other.src_id_[i], other.timestamp_[i], other.at(other.loc_[i]), other.len_[i]);
+    } else {
+        append(other.src_id_[i], other.timestamp_[i], other.pieces_[i], other.len_[i]);
+    }
+    spill_off_.back() = other.spill_off_[i];
+}
+
+MessagePtr History::payload(size_t i, int dst_id) const
+{
+    if (loc_[i] != NOWHERE) {
+        return MessagePool::make_view(chunks_[loc_[i] >> 32], at(loc_[i]), len_[i]);
+    }
+    const Pieces &pieces = pieces_[i];
+    auto msg = MessagePool::make(len_[i]);
+    auto *pld = (real_pld_t *)msg->alloc_tail(len_[i]);
+    pld->hdr.msg_type = REAL_PAYLOAD;
+    pld->hdr.msg_len = len_[i];
+    pld->hdr.seq = 0;
+    pld->src_id = src_id_[i];
+    pld->dst_id = dst_id;
+    uint8_t *p = (uint8_t *)(pld + 1);
+    memcpy(p, pieces.body->data(), pieces.body->len());
+    if (pieces.nlri) {
+        memcpy(p + pieces.body->len(), pieces.nlri->data(), pieces.nlri->len());
+    }
+    return msg;
+}
+
+void History::evict()
+{
+    for (size_t i = 0; i < size(); ++i) {
+        dbg_assert(spill_off_[i] >= 0, "History::evict(): entry %ld isn't spilled", i);
+        loc_[i] = NOWHERE;
+    }
+    pieces_.clear();
+    chunks_.clear();
+    chunk_used_ = 0;
+    arena_bytes_ = 0;
+}
+
+void History::reserve(size_t first, size_t last, std::vector<struct iovec> &iov)
+{
+    int total = 0;
+    for (size_t i = first; i < last; ++i) {
+        total += align8(len_[i]);
+    }
+    // a chunk of its own, the next append starts a new one
+    chunks_.push_back(MessagePool::make(total));
+    chunk_used_ = chunks_.back()->cap();
+    arena_bytes_ += total;
+    uint32_t off = 0;
+    iov.clear();
+    for (size_t i = first; i < last; ++i) {
+        loc_[i] = (uint64_t)(chunks_.size() - 1) << 32 | off;
+        iov.push_back({at(loc_[i]), (size_t)len_[i]});
+        off += align8(len_[i]);
+    }
+}
+
+void History::swap(History &other)
+{
+    src_id_.swap(other.src_id_);
+    timestamp_.swap(other.timestamp_);
+    len_.swap(other.len_);
+    loc_.swap(other.loc_);
+    spill_off_.swap(other.spill_off_);
+    pieces_.swap(other.pieces_);
+    chunks_.swap(other.chunks_);
+    std::swap(chunk_used_, other.chunk_used_);
+    std::swap(arena_bytes_, other.arena_bytes_);
+}
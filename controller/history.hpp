@@ -0,0 +1,104 @@
+#pragma once
+
+#include "message.hpp"
+
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <sys/uio.h>
+}
+
+/**
+ * Replay history of one destination node.
+ *
+ * Payloads are copied into an append-only arena of chunks, back to back
+ * and 8-byte aligned, each record being a REAL_PAYLOAD framed by its own
+ * real_hdr_t. The index is kept column-wise, so scans over sources or
+ * timestamps don't touch the payloads, and replay walks the arena in
+ * order. A replayed record goes out as a view of its chunk (see
+ * MessagePool::make_view()), which keeps the chunk alive while the
+ * message is queued.
+ *
+ * An entry's bytes are in one of three places: the arena, interned
+ * pieces (ReplayManager::set_dedup()), or only the spill log.
+ */
+class History {
+public:
+    struct Pieces {
+        MessagePtr body; // BGP bytes up to the NLRI, or all of them
+        MessagePtr nlri; // null if not split
+    };
+
+    size_t size() const {
+        return src_id_.size();
+    }
+    bool empty() const {
+        return src_id_.empty();
+    }
+    int src_id(size_t i) const {
+        return src_id_[i];
+    }
+    long timestamp(size_t i) const {
+        return timestamp_[i];
+    }
+    // length of the REAL_PAYLOAD of entry i
+    int len(size_t i) const {
+        return len_[i];
+    }
+    // the bytes of entry i are in memory
+    bool resident(size_t i) const {
+        return loc_[i] != NOWHERE || (i < pieces_.size() && pieces_[i].body);
+    }
+    long spill_off(size_t i) const {
+        return spill_off_[i];
+    }
+    // arena bytes in use
+    long arena_bytes() const {
+        return arena_bytes_;
+    }
+
+    // copies the REAL_PAYLOAD at data into the arena
+    void append(int src_id, long ts, const void *data, int len);
+    // keeps the payload as interned pieces, len is the framed length
+    void append(int src_id, long ts, Pieces pieces, int len);
+    // entry i of other, which must be resident; a copy for arena records
+    void append(const History &other, size_t i);
+    // the REAL_PAYLOAD of entry i, a view into the arena, or framed for
+    // dst_id if it's interned
+    MessagePtr payload(size_t i, int dst_id) const;
+
+    // entry i is also at off in the spill log
+    void set_spilled(size_t i, long off) {
+        spill_off_[i] = off;
+    }
+    // drops the bytes of every entry, they must all be spilled
+    void evict();
+    // room for the bytes of the spilled entries [first, last), one iovec
+    // each; they're resident once the caller filled them
+    void reserve(size_t first, size_t last, std::vector<struct iovec> &iov);
+
+    void swap(History &other);
+private:
+    static constexpr uint64_t NOWHERE = ~0ULL;
+    static constexpr int CHUNK_SIZE = 64 << 10;
+
+    // index, one column per field
+    std::vector<int> src_id_;
+    std::vector<long> timestamp_;
+    std::vector<int> len_;
+    std::vector<uint64_t> loc_; // chunk << 32 | offset, NOWHERE if not in the arena
+    std::vector<long> spill_off_; // -1 until written to the spill log
+    std::vector<Pieces> pieces_; // only as long as the last interned entry
+
+    std::vector<MessagePtr> chunks_;
+    int chunk_used_ = 0;
+    long arena_bytes_ = 0;
+
+    void push_index(int src_id, long ts, int len, uint64_t loc);
+    // len bytes in the arena, loc is set to where they are
+    uint8_t *alloc(int len, uint64_t &loc);
+    uint8_t *at(uint64_t loc) const {
+        return (uint8_t *)chunks_[loc >> 32]->data() + (uint32_t)loc;
+    }
+};
@@ -0,0 +1,139 @@
+/**
+ * Replays the histories of n_nodes nodes through the layout History
+ * replaced (one reference to the received message per entry) and through
+ * History (see history.hpp), and prints msgs/s of each:
+ *     ./history_bench [n_nodes] [msgs_per_node] [rounds]
+ *
+ * Messages arrive round robin over the nodes, as from many channels, with
+ * BGP lengths between 23 and 4096 bytes, mostly short UPDATEs. A replay
+ * stamps the seq and copies the payload out, as sendmsg() would.
+ */
+#include "history.hpp"
+#include "message_pool.hpp"
+#include "const.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// debug.hpp's, unused without DEBUG=1 or TRACE=1
+FILE *log_file[MAX_TIDS];
+std::string logPath;
+thread_local int tid;
+
+// the layout before History: the received message, kept as it is
+struct legacy_entry {
+    int src_id;
+    long timestamp;
+    MessagePtr msg;
+    long spill_off = -1;
+    int spill_len = 0;
+};
+
+static double now_s()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the REAL_PAYLOAD a channel would hand over, with a BGP message of bgp_len bytes
+static MessagePtr receive(int src_id, int dst_id, int bgp_len, uint64_t seed)
+{
+    int len = sizeof(real_pld_t) + bgp_len;
+    auto msg = MessagePool::make(len);
+    auto *pld = (real_pld_t *)msg->alloc_tail(len);
+    pld->hdr.msg_type = REAL_PAYLOAD;
+    pld->hdr.msg_len = len;
+    pld->hdr.seq = 0;
+    pld->src_id = src_id;
+    pld->dst_id = dst_id;
+    memset(pld + 1, (int)seed, bgp_len);
+    return msg;
+}
+
+static int bgp_len_of(uint64_t &rng)
+{
+    rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+    unsigned r = rng >> 33;
+    // 1 in 64 a full message, the rest short UPDATEs and KEEPALIVEs
+    return r % 64 == 0 ? 4096 : 23 + (int)(r % 200);
+}
+
+// seq stamped and bytes copied out, as ReplayManager::deliver() and the kernel do
+static void send(MessagePtr &msg, size_t seq, std::vector<char> &sink, size_t &sink_off)
+{
+    ((real_hdr_t *)msg->data())->seq = seq + 1;
+    if (sink_off + msg->len() > sink.size()) {
+        sink_off = 0;
+    }
+    memcpy(sink.data() + sink_off, msg->data(), msg->len());
+    sink_off += msg->len();
+}
+
+int main(int argc, char **argv)
+{
+    int n_nodes = argc > 1 ? atoi(argv[1]) : 1000;
+    int per_node = argc > 2 ? atoi(argv[2]) : 1000;
+    int rounds = argc > 3 ? atoi(argv[3]) : 5;
+    long n_msgs = (long)n_nodes * per_node;
+    std::vector<char> sink(1 << 20);
+    size_t sink_off = 0;
+
+    printf("%d nodes x %d messages, %d replay rounds\n", n_nodes, per_node, rounds);
+    double t0, t1;
+    {
+        std::vector<std::vector<legacy_entry>> hist(n_nodes);
+        uint64_t rng = 1;
+        t0 = now_s();
+        for (int k = 0; k < per_node; ++k) {
+            for (int u = 0; u < n_nodes; ++u) {
+                auto msg = receive(k % 64, u, bgp_len_of(rng), k);
+                hist[u].push_back({k % 64, k, msg});
+            }
+        }
+        t1 = now_s();
+        printf("legacy  append: %12.0f msgs/s\n", n_msgs / (t1 - t0));
+        t0 = now_s();
+        for (int r = 0; r < rounds; ++r) {
+            for (int u = 0; u < n_nodes; ++u) {
+                for (size_t i = 0; i < hist[u].size(); ++i) {
+                    MessagePtr msg = hist[u][i].msg;
+                    send(msg, i, sink, sink_off);
+                }
+            }
+        }
+        t1 = now_s();
+        printf("legacy  replay: %12.0f msgs/s\n", n_msgs * rounds / (t1 - t0));
+    }
+    {
+        std::vector<History> hist(n_nodes);
+        uint64_t rng = 1;
+        t0 = now_s();
+        for (int k = 0; k < per_node; ++k) {
+            for (int u = 0; u < n_nodes; ++u) {
+                auto msg = receive(k % 64, u, bgp_len_of(rng), k);
+                hist[u].append(k % 64, k, msg->data(), msg->len());
+            }
+        }
+        t1 = now_s();
+        printf("History append: %12.0f msgs/s\n", n_msgs / (t1 - t0));
+        t0 = now_s();
+        for (int r = 0; r < rounds; ++r) {
+            for (int u = 0; u < n_nodes; ++u) {
+                for (size_t i = 0; i < hist[u].size(); ++i) {
+                    MessagePtr msg = hist[u].payload(i, u);
+                    send(msg, i, sink, sink_off);
+                }
+            }
+        }
+        t1 = now_s();
+        printf("History replay: %12.0f msgs/s\n", n_msgs * rounds / (t1 - t0));
+    }
+    // so the copies aren't optimized out
+    long sum = 0;
+    for (size_t i = 0; i < sink.size(); i += 4096) {
+        sum += sink[i];
+    }
+    printf("(sink checksum %ld)\n", sum);
+    return 0;
+}
@@ -5,6 +5,12 @@
 #include "channel_manager.hpp"
 #include "replay_manager.hpp"
 #include "remote_worker.hpp"
+#include "cmd_queue.hpp"
+#include "placement.hpp"
+#include "termination.hpp"
+#include "ready_queue.hpp"
+#include "checkpoint.hpp"
+#include "whatif.hpp"
 
 #include "json.hpp"
 #include <unordered_map>
@@ -13,6 +19,7 @@
 #include <set>
 #include <format>
 #include <bitset>
+#include <bit>
 
 using json = nlohmann::json;
 
@@ -32,27 +39,35 @@ extern "C" {
 #include <pthread.h>
 #include <sys/stat.h>
 #include <sys/epoll.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <execinfo.h>
 }
 
-thread_local static struct epoll_event events[MAX_CONNS];
+thread_local static struct epoll_event events[MAX_EVENTS];
 
 /* debug.hpp */
-FILE *log_file[128];
+FILE *log_file[MAX_TIDS];
 thread_local int tid;
 
 /* partition scheduling */
-std::unordered_set<int> idle_parts;
+std::vector<bool> idle_parts;
+int n_idle_parts = 0;
 volatile std::atomic<int> stage = STAGE_BUILDUP;
-volatile std::atomic<int> n_ready_host = 0;
 int iteration_round = 0;
 int iteration_idx = 0;
 int iteration_delta = 1;
+int export_tag = 1; // suffix of the next routes export
+static bool rate_placed = false;
+// a resumed run restores every node before its first CONVERGE, even in round 0
+static bool resume_restore = false;
+// offline nodes a what-if CONVERGE reached, started in the next round
+static std::vector<int> whatif_frontier;
 
 /* topology */
 std::unordered_set<int> glb_all_cut;
+std::vector<bool> glb_is_cut; // bitmap of glb_all_cut
 std::unordered_set<int> glb_local_cut;
 std::unordered_set<int> glb_seen_nodes;
 std::vector<std::unordered_set<int>> glb_all_parts;
@@ -76,12 +91,40 @@ int glb_host_idx;
 std::bitset<MAX_CLIENTS> local_nodes;
 std::array<int, MAX_CLIENTS> node2host;
 
-/* ctrl pipe */
-int ctrl_pipe[MAX_THREADS + 1][2];
-int ctrl_rev_pipe[MAX_THREADS + 1][2];
-std::mutex worker_ctrl_pipe_mutex[MAX_THREADS + 1];
+/* worker commands */
+struct WorkerCmd {
+    enum Type {
+        CONNECTED, // controller connect(), connect_res/errno tell if it's in progress
+        ACCEPTED,  // controller accept()
+        MUX_ACCEPTED, // controller accept() of self_id's mux connection
+        MUX_OPEN,  // open (self_id, peer_id) on self_id's mux, as CONNECTED does on a listener
+        SEND,      // replay msg on the channel (self_id, peer_id) of this worker
+        READY,     // node self_id was marked by another thread
+        SHUTDOWN,
+    } type;
+    int fd;
+    int self_id;
+    int peer_id;
+    int connect_res;
+    int connect_errno;
+    MessagePtr msg;
+};
+std::array<std::unique_ptr<CmdQueue<WorkerCmd>>, MAX_THREADS + 1> worker_cmds;
+
+void post_send(int worker_id, int self_id, int peer_id, MessagePtr &msg)
+{
+    worker_cmds[worker_id]->push({WorkerCmd::SEND, -1, self_id, peer_id, 0, 0, msg});
+}
+
+void post_ready(int worker_id, int node_id)
+{
+    worker_cmds[worker_id]->push({WorkerCmd::READY, -1, node_id, 0, 0, 0, nullptr});
+}
+
+/* activity of workers and remote workers, polled by stage_transition() */
+std::atomic<long> glb_last_event_ts{0};
+Doorbell main_doorbell;
 
-int remote_ctrl_rev_pipe[MAX_THREADS + 1][2];
 extern std::array<std::unique_ptr<RemoteChannel>, MAX_HOSTS> remote_channels;
 
 static std::string get_stage_name() {
@@ -105,17 +148,8 @@ long gettime_ns(int clock_id = CLOCK_MONOTONIC) {
     return ts.tv_sec * 1'000'000'000 + ts.tv_nsec;
 }
 
-static int read_int(int fd) {
-    int ans;
-    int r = read(fd, &ans, sizeof(ans));
-    assert(r > 0);
-    return ans;
-}
-
-static void write_int(int fd, int num) {
-    int r = write(fd, &num, sizeof(num));
-    assert(r == sizeof(num));
-    return;
+static void note_event() {
+    glb_last_event_ts.store(gettime_ns(), std::memory_order_relaxed);
 }
 
 int init_socket()
@@ -277,8 +311,12 @@ std::string get_addr(int id, uint16_t port) {
     return "/opt/lwc/volumes/ripc/emu-real-" + std::to_string(id) + "/listener:" + std::to_string(port);
 }
 
+std::string get_mux_path(int id) {
+    return "/opt/lwc/volumes/ripc/emu-real-" + std::to_string(id) + "/" + MUX_SOCKET_NAME;
+}
+
 inline bool globally_converged() {
-    return (int)idle_parts.size() == n_parts;
+    return n_idle_parts == n_parts;
 }
 
 void end_iteration(
@@ -288,15 +326,14 @@ void end_iteration(
 )
 {
     g_replay_mnger.new_iteration();
-    static int tag = 1;
     if (globally_converged()) {
         export_routes(image, parts[iteration_idx], "final", log_path);
         export_routes(image, glb_local_cut, "final", log_path);
     } else {
-        export_routes(image, parts[iteration_idx], std::to_string(tag), log_path);
-        export_routes(image, glb_local_cut, std::to_string(tag), log_path);
+        export_routes(image, parts[iteration_idx], std::to_string(export_tag), log_path);
+        export_routes(image, glb_local_cut, std::to_string(export_tag), log_path);
     }
-    tag++;
+    export_tag++;
 
     std::string ts_filename = log_path + "/switch_pods_ts.txt";
     FILE *TsFile = fopen(ts_filename.c_str(), "a+");
@@ -307,6 +344,7 @@ void end_iteration(
     for (auto u : parts[iteration_idx]) {
         g_replay_mnger.node_offline(u);
     }
+    g_replay_mnger.sweep_store();
 }
 
 static int cut_nchannel()
@@ -336,12 +374,12 @@ void try_buildup()
     }
     for (auto i : nodes) { // i is definitely local node
         // i is online, check (i <= ctrler) <= j channel
-        int i_is_cut = glb_all_cut.count(i);
+        int i_is_cut = glb_is_cut[i];
         for (auto j : glb_G[i]) { // i and j are connected
             // j don't need to be local node, which implies:
             // 1. don't skip j for being remote
             // 2. use glb_all_cut rather than glb_local_cut here
-            int j_is_cut = glb_all_cut.count(j);
+            int j_is_cut = glb_is_cut[j];
             if (i_is_cut == j_is_cut) {
                 // equivalent nodes, break tie by node_id
                 if (i < j) {
@@ -363,6 +401,17 @@ void try_buildup()
             if (g_channel_manager.get(i, j)) {
                 continue;
             }
+            if (auto mux = g_channel_manager.mux(i)) {
+                int worker_id = mux->worker();
+                LOG("[%3d, %3d] building channel on the mux @ thread %d\n", i, j, worker_id);
+                worker_cmds[worker_id]->push({WorkerCmd::MUX_OPEN, -1, i, j, 0, 0});
+                continue;
+            }
+            if (access(get_mux_path(i).c_str(), F_OK) == 0) {
+                // i listens on its mux, which the acceptor hasn't handed over
+                // yet; start_nodes() and restart_nodes() remove stale ones
+                continue;
+            }
             // channel is not built
             int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
             int flags = fcntl(fd, F_GETFL, 0);
@@ -382,39 +431,142 @@ void try_buildup()
     }
 
     for (auto [fd, i, j, r, err] : fd_pass_list) {
-        int cmd = 0;
-        int worker_id = i % nthreads;
-        int ctrl_fd = ctrl_pipe[worker_id][1];
+        int worker_id = g_placement.channel_worker(i, j);
         LOG("pass %d to thread %d\n", fd, worker_id);
-        std::unique_lock lock(worker_ctrl_pipe_mutex[worker_id]);
-        write_int(ctrl_fd, cmd);
-        write_int(ctrl_fd, fd);
-        write_int(ctrl_fd, i);
-        write_int(ctrl_fd, j);
-        write_int(ctrl_fd, r);
-        write_int(ctrl_fd, err);
+        worker_cmds[worker_id]->push({WorkerCmd::CONNECTED, fd, i, j, r, err});
+    }
+}
+
+// node degree, plus the messages seen so far if with_msgs
+static std::vector<long> placement_weight(bool with_msgs)
+{
+    std::vector<long> weight(n_nodes + 1, 0);
+    if (with_msgs) {
+        g_replay_mnger.msg_load(weight);
+    }
+    for (int u = 1; u <= n_nodes; ++u) {
+        weight[u] += glb_G[u].size();
+    }
+    return weight;
+}
+
+/**
+ * This host is done with RESTORE or CONVERGE once every online node is
+ * provably idle for QUIESCE_HOLD (see ReplayManager::all_quiescent()), or
+ * at the latest CONVERGE_TIMEOUT after the last local event. Payloads in
+ * flight between hosts are left to g_termination.
+ */
+static bool stage_quiescent(long last_event_ts)
+{
+    long idle_ns = gettime_ns() - last_event_ts;
+    if (idle_ns >= CONVERGE_TIMEOUT) {
+        return true;
+    }
+    return idle_ns >= QUIESCE_HOLD && g_replay_mnger.all_quiescent();
+}
+
+static void print_stage_end(long last_event_ts)
+{
+    long idle_ns = gettime_ns() - last_event_ts;
+    if (idle_ns < CONVERGE_TIMEOUT) {
+        std::cout << std::format("{:.6f}: {} quiescent, {:.3f}s before the timeout",
+            gettime_ns() / 1e9, get_stage_name(), (CONVERGE_TIMEOUT - idle_ns) / 1e9) << std::endl;
+    }
+}
+
+// the schedule as of the partition about to start, and the local histories
+static void save_checkpoint()
+{
+    Checkpoint ck;
+    ck.iteration_round = iteration_round;
+    ck.iteration_idx = iteration_idx;
+    ck.iteration_delta = iteration_delta;
+    ck.export_tag = export_tag;
+    ck.idle_parts.assign(idle_parts.begin(), idle_parts.end());
+    ck.seen_nodes.assign(glb_seen_nodes.begin(), glb_seen_nodes.end());
+    for (int u = 1; u <= n_nodes; ++u) {
+        if (local_nodes.test(u)) {
+            g_replay_mnger.checkpoint(u, ck.nodes.emplace_back());
+        }
+    }
+    g_checkpoint.write(std::move(ck));
+}
+
+// the nodes of a what-if round stay online, like the cut of iterative
+// convergence, and the controller stands in for all the others
+static void whatif_set_active(const std::unordered_set<int> &active)
+{
+    glb_all_cut = active;
+    glb_local_cut.clear();
+    glb_is_cut.assign(n_nodes + 1, false);
+    int nchannel = 0;
+    for (auto u : active) {
+        glb_is_cut[u] = true;
+        if (local_nodes.test(u)) {
+            glb_local_cut.insert(u);
+            nchannel += glb_G[u].size();
+        }
     }
+    // an empty part, and the active nodes as the cut
+    n_parts = 1;
+    glb_all_parts = {{}, glb_all_cut};
+    glb_local_parts = {{}, glb_local_cut};
+    glb_parts_nchannel = {0, nchannel};
+    glb_parts_nchannel_cut = {nchannel, 0};
 }
 
-void stage_transition(bool has_event)
+static void whatif_next_round()
+{
+    static int round = 1;
+    round++;
+    std::unordered_set<int> started(whatif_frontier.begin(), whatif_frontier.end());
+    for (auto u : glb_local_cut) {
+        g_replay_mnger.hold(u);
+    }
+    std::unordered_set<int> active = glb_all_cut;
+    active.insert(started.begin(), started.end());
+    whatif_set_active(active);
+    stage = STAGE_BUILDUP;
+    std::cout << std::format("{:.6f}: {} @ what-if round {}, {} more nodes, {} active",
+        gettime_ns() / 1e9, get_stage_name(), round, started.size(), active.size()) << std::endl;
+    start_nodes(image, started, neighborList, neighborList.size(), logPath);
+    std::cout << std::format("{:.6f}: start_nodes done", gettime_ns() / 1e9) << std::endl;
+}
+
+// true if the run continues from logPath/checkpoint.bin
+static bool load_checkpoint()
+{
+    Checkpoint ck;
+    bool ok = CheckpointWriter::load(logPath + "/checkpoint.bin", ck, [](NodeCheckpoint &node) {
+        dbg_assert(node.node_id > 0 && node.node_id <= n_nodes && local_nodes.test(node.node_id),
+            "checkpoint: node %d isn't local", node.node_id);
+        g_replay_mnger.restore(node);
+    });
+    if (!ok) {
+        return false;
+    }
+    dbg_assert(ck.idle_parts.size() == idle_parts.size() && ck.iteration_idx >= 0 && ck.iteration_idx <= n_parts,
+        "checkpoint: %ld parts, %ld expected", ck.idle_parts.size(), idle_parts.size());
+    iteration_round = ck.iteration_round;
+    iteration_idx = ck.iteration_idx;
+    iteration_delta = ck.iteration_delta;
+    export_tag = ck.export_tag;
+    n_idle_parts = 0;
+    for (size_t i = 0; i < idle_parts.size(); ++i) {
+        idle_parts[i] = ck.idle_parts[i];
+        n_idle_parts += ck.idle_parts[i];
+    }
+    glb_seen_nodes.insert(ck.seen_nodes.begin(), ck.seen_nodes.end());
+    return true;
+}
+
+void stage_transition()
 {
     static long last_conn_ts = 0;
     static long last_event_ts = 0;
     static long last_teardown_debug_ts = 0;
-    static long last_keepbusy_ts = 0;
-    if (has_event) {
-        last_event_ts = gettime_ns();
-    }
+    last_event_ts = std::max(last_event_ts, glb_last_event_ts.load(std::memory_order_relaxed));
     static bool local_stage_end = false;
-    if (stage == STAGE_CONVERGE && last_event_ts - last_keepbusy_ts > KEEPBUSY_INTERVAL) {
-        last_keepbusy_ts = last_event_ts;
-        for (int hid = 0; hid < glb_nhosts; ++hid) {
-            if (remote_channels[hid] != nullptr) {
-                LOG("send_keepbusy %s host %d\n", stage_name[stage], hid);
-                remote_channels[hid]->send_keepbusy();
-            }
-        }
-    }
     switch (stage) {
     case STAGE_BUILDUP: {
         if (!local_stage_end) {
@@ -432,46 +584,31 @@ void stage_transition(bool has_event)
             }
             assert(Channel::n_channel == nch_target);
             local_stage_end = true;
-            n_ready_host++;
-            for (int hid = 0; hid < glb_nhosts; ++hid) {
-                if (remote_channels[hid] != nullptr) {
-                    LOG("send_eos %s host %d\n", stage_name[stage], hid);
-                    remote_channels[hid]->send_eos(stage);
-                }
-            }
             std::cout << std::format("{:.6f}: {} done locally", gettime_ns() / 1e9, get_stage_name()) << std::endl;
         }
-        if (local_stage_end && n_ready_host == glb_nhosts) {
+        if (local_stage_end && g_termination.poll(true, false)) {
             local_stage_end = false;
-            n_ready_host = 0;
-            if (iteration_round == 0) {
+            if (iteration_round == 0 && !resume_restore) {
                 stage = STAGE_CONVERGE;
             } else {
                 stage = STAGE_RESTORE;
             }
+            resume_restore = false;
             std::cout << std::format("{:.6f}: {}", gettime_ns() / 1e9, get_stage_name()) << std::endl;
             last_event_ts = gettime_ns(); // timeout should be counted as least from now.   
         }
         break;
     }
     case STAGE_RESTORE: {
-        if (!local_stage_end) {
-            if (gettime_ns() - last_event_ts < CONVERGE_TIMEOUT) {
-                break;
-            }
-            local_stage_end = true;
-            n_ready_host++;
-            for (int hid = 0; hid < glb_nhosts; ++hid) {
-                if (remote_channels[hid] != nullptr) {
-                    LOG("send_eos %s host %d\n", stage_name[stage], hid);
-                    remote_channels[hid]->send_eos(stage);
-                }
-            }
+        // unlike BUILDUP and TEARDOWN, a host that got done can get busy again
+        bool quiescent = stage_quiescent(last_event_ts);
+        if (quiescent && !local_stage_end) {
             std::cout << std::format("{:.6f}: {} done locally", gettime_ns() / 1e9, get_stage_name()) << std::endl;
         }
-        if (local_stage_end && n_ready_host == glb_nhosts) {
+        local_stage_end = quiescent;
+        if (local_stage_end && g_termination.poll(true, true)) {
             local_stage_end = false;
-            n_ready_host = 0;
+            print_stage_end(last_event_ts);
             stage = STAGE_CONVERGE;
             std::cout << std::format("{:.6f}: {}", gettime_ns() / 1e9, get_stage_name()) << std::endl;
             last_event_ts = gettime_ns(); // timeout should be counted as least from now.
@@ -479,31 +616,36 @@ void stage_transition(bool has_event)
         break;
     }
     case STAGE_CONVERGE: {
-        if (!local_stage_end) {
-            if (gettime_ns() - last_event_ts < CONVERGE_TIMEOUT) {
-                break;
-            }
-            local_stage_end = true;
-            n_ready_host++;
-            for (int hid = 0; hid < glb_nhosts; ++hid) {
-                if (remote_channels[hid] != nullptr) {
-                    LOG("send_eos %s host %d\n", stage_name[stage], hid);
-                    remote_channels[hid]->send_eos(stage);
-                }
-            }
+        bool quiescent = stage_quiescent(last_event_ts);
+        if (quiescent && !local_stage_end) {
             std::cout << std::format("{:.6f}: {} done locally", gettime_ns() / 1e9, get_stage_name()) << std::endl;
         }
-        if (local_stage_end && n_ready_host == glb_nhosts) {
+        local_stage_end = quiescent;
+        if (local_stage_end && g_termination.poll(true, true)) {
             local_stage_end = false;
-            n_ready_host = 0;
+            print_stage_end(last_event_ts);
             stage = STAGE_TEARDOWN;
             std::cout << std::format("{:.6f}: {}", gettime_ns() / 1e9, get_stage_name()) << std::endl;
-            if (g_replay_mnger.has_new_msg()) {
+            bool busy = g_replay_mnger.has_new_msg();
+            if (g_whatif.active()) {
+                whatif_frontier.clear();
+                for (auto u : g_replay_mnger.take_touched()) {
+                    if (!glb_is_cut[u] && !g_whatif.node_down(u)) {
+                        whatif_frontier.push_back(u);
+                    }
+                }
+                busy = !whatif_frontier.empty();
+            }
+            if (busy) {
                 std::cout << std::format("{:.6f}: part {} busy", gettime_ns() / 1e9, iteration_idx) << std::endl;
-                idle_parts.clear();
+                idle_parts.assign(idle_parts.size(), false);
+                n_idle_parts = 0;
             } else {
                 std::cout << std::format("{:.6f}: part {} idle", gettime_ns() / 1e9, iteration_idx) << std::endl;
-                idle_parts.insert(iteration_idx);
+                if (!idle_parts[iteration_idx]) {
+                    idle_parts[iteration_idx] = true;
+                    n_idle_parts++;
+                }
             }
             std::string ts_path = logPath + "/converge_end_ts.txt";
             FILE *end_ts_file = fopen(ts_path.c_str(), "aw");
@@ -525,23 +667,23 @@ void stage_transition(bool has_event)
             dbg_assert(Channel::n_channel == cut_nchannel(),
                 "cut_nchannel %d, actual nchannel %d", cut_nchannel(), Channel::n_channel.load());
             local_stage_end = true;
-            n_ready_host++;
-            for (int hid = 0; hid < glb_nhosts; ++hid) {
-                if (remote_channels[hid] != nullptr) {
-                    LOG("send_eos %s host %d\n", stage_name[stage], hid);
-                    remote_channels[hid]->send_eos(stage);
-                }
-            }
             std::cout << std::format("{:.6f}: {} done locally", gettime_ns() / 1e9, get_stage_name()) << std::endl;
         }
-        if (local_stage_end && n_ready_host == glb_nhosts) {
+        if (local_stage_end && g_termination.poll(true, false)) {
             local_stage_end = false;
-            n_ready_host = 0;
             if (globally_converged()) {
+                if (g_checkpoint.is_open() && !g_whatif.active()) {
+                    // the converged snapshot what-if runs start from
+                    save_checkpoint();
+                }
                 stage = STAGE_END;
                 std::cout << std::format("{:.6f}: {}", gettime_ns() / 1e9, get_stage_name()) << std::endl;
                 break;
             }
+            if (g_whatif.active()) {
+                whatif_next_round();
+                break;
+            }
             // local converge, switch to next part
             do {
                 iteration_idx += iteration_delta;
@@ -554,10 +696,18 @@ void stage_transition(bool has_event)
                     iteration_delta = 1;
                     iteration_idx += 2;
                 }
-            } while (idle_parts.count(iteration_idx));
+            } while (iteration_idx >= 0 && idle_parts[iteration_idx]);
+            if (iteration_round == 1 && !rate_placed && g_placement.mode() == Placement::RATE) {
+                // round 0 replayed every part once, its traffic is the best estimate
+                rate_placed = true;
+                g_placement.assign(placement_weight(true));
+            }
             for (auto u : glb_all_parts[iteration_idx]) {
                 glb_seen_nodes.insert(u);
             }
+            if (g_checkpoint.is_open()) {
+                save_checkpoint();
+            }
             stage = STAGE_BUILDUP;
             std::cout << std::format("{:.6f}: {} @ part {}", gettime_ns() / 1e9, get_stage_name(), iteration_idx) << std::endl;
             if (iteration_round == 0) {
@@ -579,6 +729,9 @@ void stage_transition(bool has_event)
 
 static inline bool allow_connect(int src, int dst)
 {
+    if (src <= 0 || src > n_nodes || dst <= 0 || dst > n_nodes) {
+        return false;
+    }
     bool ok = true;
     /**
      * Only allow connection of a determined direction:
@@ -592,8 +745,11 @@ static inline bool allow_connect(int src, int dst)
      * This is clever in that it doesn't check seen_nodes.
      * This effectively delayes cut<->part connection until the part's first bootup
      */
-    int src_is_cut = glb_all_cut.count(src);
-    int dst_is_cut = glb_all_cut.count(dst);
+    if (g_whatif.active() && g_whatif.link_down(src, dst)) {
+        return false;
+    }
+    int src_is_cut = glb_is_cut[src];
+    int dst_is_cut = glb_is_cut[dst];
     if (src_is_cut != dst_is_cut) {
         if (src_is_cut) {
             // cut -> normal, reject
@@ -605,161 +761,496 @@ static inline bool allow_connect(int src, int dst)
     return ok;
 }
 
+// VmRSS in KiB, -1 if /proc is unavailable
+static long get_rss_kb()
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return -1;
+    }
+    long rss = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld kB", &rss) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return rss;
+}
+
+// REAL_SYNACK of a session the mux's REAL_SYN asked for, with cli_port 0 if it's refused
+static void mux_reply_synack(Channel *mux, int svr_id, uint16_t cli_port)
+{
+    auto msg = MessagePool::make(synacksiz);
+    real_synack_t *synack = (real_synack_t *)msg->alloc_tail(synacksiz);
+    synack->hdr.msg_type = REAL_SYNACK;
+    synack->hdr.msg_len = synacksiz;
+    synack->hdr.seq = 0;
+    synack->cli_port = cli_port;
+    synack->flags = 0;
+    synack->svr_id = svr_id;
+    mux->sendmsg(msg);
+}
+
+/**
+ * The channel a message read from a mux connection belongs to: the
+ * session it names, a new one for a REAL_SYN, or the mux itself for the
+ * per node acks and idle reports. nullptr if the message is done with.
+ */
+static Channel *mux_route(Channel *mux, MessagePtr &msg)
+{
+    real_hdr_t *hdr = (real_hdr_t *)msg->data();
+    switch (hdr->msg_type) {
+    case REAL_SYN: {
+        // as the acceptor does for a session of its own
+        real_syn_t *syn = (real_syn_t *)msg->data();
+        int u = syn->cli_id, v = syn->svr_id;
+        dbg_assert(u == mux->self_id(), "REAL_SYN of %d on the mux of %d", u, mux->self_id());
+        LOG("[%3d, %3d] session opened on mux fd=%d\n", u, v, mux->fd());
+        if (!!g_channel_manager.get(u, v) || !allow_connect(u, v)) {
+            mux_reply_synack(mux, v, 0);
+            LOG("rejected\n");
+            return nullptr;
+        }
+        auto ch = g_channel_manager.make_channel(-1, -1, u, v, 0, Channel::ACCEPTED);
+        ch->attach_mux(mux);
+        return ch.get();
+    }
+    case REAL_PAYLOAD:
+    case REAL_FIN: {
+        real_pld_t *pld = (real_pld_t *)msg->data();
+        Channel *ch = mux->mux_session(pld->dst_id);
+        if (!ch) {
+            LOG("[%3d, %3d] %s dropped, no such session on the mux\n",
+                pld->src_id, pld->dst_id, msg_type_name[hdr->msg_type]);
+            return nullptr;
+        }
+        if (hdr->msg_type == REAL_FIN) {
+            // as EPOLLHUP on the session's own socket
+            LOG("[%3d, %3d] session closed on mux fd=%d\n", pld->src_id, pld->dst_id, mux->fd());
+            g_channel_manager.delete_channel(ch);
+            return nullptr;
+        }
+        return ch;
+    }
+    default:
+        return mux;
+    }
+}
+
+// the controller's side of a session on node i's mux, as its connect() to i's listener
+static void mux_open(int i, int j)
+{
+    auto mux = g_channel_manager.mux(i);
+    if (!mux || mux->worker() != tid || g_channel_manager.get(i, j)) {
+        LOG("[%3d, %3d] not opened on the mux: built already, or the mux is gone\n", i, j);
+        return;
+    }
+    auto ch = g_channel_manager.make_channel(-1, -1, i, j, 0, Channel::CONN_INPROGRESS);
+    ch->attach_mux(mux.get());
+    ch->on_connect_ok();
+}
+
+static void handle_incoming(Channel *channel, std::vector<MessagePtr> &incoming_msgs)
+{
+    Channel *mux = channel->is_mux() ? channel : nullptr;
+    for (auto &msg : incoming_msgs) {
+        if (mux && !(channel = mux_route(mux, msg))) {
+            continue;
+        }
+        real_hdr_t *hdr = (real_hdr_t *)msg->data();
+        real_hdr_t orig_hdr = *hdr;
+        switch (hdr->msg_type) {
+        case REAL_SYN: {
+            // ignore syn->cli_port, it's only used in
+            // listener's accept() in the shim
+            channel->on_receive_syn((real_syn_t *)msg->data());
+            break;
+        }
+        case REAL_PAYLOAD: {
+            g_replay_mnger.on_payload(channel->self_id());
+            // round 0: both stage buildup and converge can add_msg
+            if (iteration_round == 0 && stage == STAGE_TEARDOWN) {
+                break;
+            }
+            // round 1+: only stage converge can add_msg, otherwise treat as restore
+            if (iteration_round != 0 && stage != STAGE_CONVERGE) {
+                break;
+            }
+            // a resumed run restores in round 0 too
+            if (stage == STAGE_RESTORE) {
+                break;
+            }
+            g_replay_mnger.add_msg(msg, channel->self_id(), channel->peer_id());
+            break;
+        }
+        case REAL_ACK: {
+            g_replay_mnger.on_ack(channel->self_id(), hdr->seq);
+            break;
+        }
+        case REAL_IDLE: {
+            real_idle_t *idle = (real_idle_t *)msg->data();
+            g_replay_mnger.on_idle(channel->self_id(), hdr->seq, idle->n_sent, idle->timeout_ns);
+            main_doorbell.ring();
+            break;
+        }
+        case REAL_SYNACK: {
+            // only sent by a listener's shim answering a shm offer
+            channel->on_receive_synack((real_synack_t *)msg->data());
+            break;
+        }
+        default:
+            dbg_assert(false, "Unexpected msg_type: %d", hdr->msg_type);
+            break;
+        }
+        LOG("[%3d, %3d] recvmsg(): msg_type=%s(%d), len=%d, seq=%ld\n",
+            channel->self_id(), channel->peer_id(), msg_type_name[orig_hdr.msg_type],
+            orig_hdr.msg_type, orig_hdr.msg_len, orig_hdr.seq);
+    }
+}
+
+#ifdef IO_URING
+bool use_io_uring = true;
+
+/**
+ * Same as the epoll loop of worker_main(), but every channel fd is driven
+ * by io_uring completions. Returns false if io_uring can't be set up, the
+ * caller then falls back to epoll.
+ */
+static bool worker_main_uring(int worker_id)
+{
+    UringLoop uring;
+    if (!uring.init(URING_ENTRIES, URING_NBUFS, URING_BUFSIZ)) {
+        return false;
+    }
+    int timeout = 200; // ms
+    auto &cmds = *worker_cmds[tid];
+    uring.arm_ctrl(cmds.fd());
+
+    int placement_epoch = -1;
+    int seen_stage = -1;
+    std::vector<int> managed_nodes;
+    std::vector<int> ready_nodes;
+    std::vector<MessagePtr> incoming_msgs;
+
+    bool shutdown = false;
+    while (!shutdown && uring.submit_and_wait(timeout) >= 0) {
+        bool external_event = false;
+        uring.for_each_cqe([&](struct io_uring_cqe *cqe) {
+            Channel *channel = UringLoop::channel_of(cqe);
+            switch (UringLoop::op_of(cqe)) {
+            case UringLoop::OP_CTRL: {
+                // the doorbell rang: drain() takes every queued command
+                // without blocking, one completion may stand for many rings
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    uring.arm_ctrl(cmds.fd());
+                }
+                cmds.drain([&](WorkerCmd &cmd) {
+                    switch (cmd.type) {
+                    case WorkerCmd::CONNECTED: {
+                        int ch_fd = cmd.fd, i = cmd.self_id, j = cmd.peer_id;
+                        LOG("recv active %d @ thread %d\n", ch_fd, worker_id);
+
+                        if (cmd.connect_res == -1 && cmd.connect_errno != EAGAIN) {
+                            LOG("[%3d, %3d] connect(fd=%d, self_id=%d, peer_id=%d) error: %d (%s)\n",
+                                i, j, ch_fd, i, j, cmd.connect_res, strerror(cmd.connect_errno));
+                            break;
+                        }
+                        auto ch = g_channel_manager.make_channel(ch_fd, -1, i, j, EPOLLIN | EPOLLOUT, Channel::CONN_INPROGRESS);
+                        ch->attach_uring(&uring);
+                        if (cmd.connect_res == 0) {
+                            LOG("[%3d, %3d] connect(fd=%d, self_id=%d, peer_id=%d) success\n",
+                                i, j, ch_fd, i, j);
+                            ch->on_connect_ok();
+                            uring.arm_recv(ch.get());
+                        } else {
+                            LOG("[%3d, %3d] connect(fd=%d, self_id=%d, peer_id=%d) EAGAIN\n",
+                                i, j, ch_fd, i, j);
+                            uring.arm_connect(ch.get());
+                        }
+                        break;
+                    }
+                    case WorkerCmd::ACCEPTED: {
+                        LOG("accept() = %d (%d -> %d)\n", cmd.fd, cmd.self_id, cmd.peer_id);
+                        assert(cmd.fd >= 0);
+                        auto ch = g_channel_manager.make_channel(cmd.fd, -1, cmd.self_id, cmd.peer_id, EPOLLIN, Channel::ACCEPTED);
+                        ch->attach_uring(&uring);
+                        uring.arm_recv(ch.get());
+                        LOG("recv passive %d @ thread %d\n", cmd.fd, worker_id);
+                        break;
+                    }
+                    case WorkerCmd::MUX_ACCEPTED: {
+                        auto mux = g_channel_manager.make_mux(cmd.fd, -1, cmd.self_id);
+                        mux->attach_uring(&uring);
+                        uring.arm_recv(mux.get());
+                        LOG("recv mux %d of %d @ thread %d\n", cmd.fd, cmd.self_id, worker_id);
+                        break;
+                    }
+                    case WorkerCmd::MUX_OPEN: {
+                        mux_open(cmd.self_id, cmd.peer_id);
+                        break;
+                    }
+                    case WorkerCmd::SEND: {
+                        auto ch = g_channel_manager.get(cmd.self_id, cmd.peer_id);
+                        if (!ch || ch->worker() != worker_id) {
+                            LOG("[%3d, %3d] handed over message dropped, channel is gone\n", cmd.self_id, cmd.peer_id);
+                            break;
+                        }
+                        ReplayManager::deliver(ch.get(), cmd.msg);
+                        break;
+                    }
+                    case WorkerCmd::READY: {
+                        g_ready_nodes.on_posted(worker_id, cmd.self_id);
+                        break;
+                    }
+                    case WorkerCmd::SHUTDOWN: {
+                        shutdown = true;
+                        break;
+                    }
+                    }
+                });
+                break;
+            }
+            case UringLoop::OP_CONNECT: {
+                if (uring.is_retired(channel)) {
+                    break;
+                }
+                external_event = true;
+                LOG("outcoming connect() done, event = %x\n", cqe->res);
+                if (cqe->res < 0 || (cqe->res & (POLLERR | POLLHUP))) {
+                    uring.retire(channel);
+                    break;
+                }
+                channel->on_connect_ok();
+                uring.arm_recv(channel);
+                break;
+            }
+            case UringLoop::OP_RECV: {
+                if (uring.is_retired(channel)) {
+                    break;
+                }
+                external_event = true;
+                if (cqe->res > 0) {
+                    channel->feed(uring.recv_buf(cqe), cqe->res, incoming_msgs);
+                    handle_incoming(channel, incoming_msgs);
+                } else if (cqe->res != -ENOBUFS) {
+                    // EOF or error, same as EPOLLHUP/EPOLLERR
+                    LOG("fd=%d recv() = %d, closing\n", channel->fd(), cqe->res);
+                    uring.retire(channel);
+                    break;
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    uring.arm_recv(channel);
+                }
+                break;
+            }
+            case UringLoop::OP_SEND: {
+                if (uring.is_retired(channel)) {
+                    break;
+                }
+                if (cqe->res < 0) {
+                    LOG("fd=%d writev() = %d, closing\n", channel->fd(), cqe->res);
+                    uring.retire(channel);
+                    break;
+                }
+                channel->on_sent(cqe->res);
+                break;
+            }
+            case UringLoop::OP_CANCEL:
+                break;
+            }
+        });
+        if (shutdown) {
+            break;
+        }
+        if (placement_epoch != g_placement.epoch() || seen_stage != stage) {
+            // online parts, stage checks and delayed messages may have
+            // changed for every node
+            if (placement_epoch != g_placement.epoch()) {
+                placement_epoch = g_placement.epoch();
+                managed_nodes = g_placement.managed_nodes(worker_id);
+            }
+            seen_stage = stage;
+            for (auto nid : managed_nodes) {
+                g_ready_nodes.mark(nid);
+            }
+        }
+        if (stage != STAGE_TEARDOWN) {
+            g_ready_nodes.take(worker_id, ready_nodes);
+            for (auto nid : ready_nodes) {
+                if (g_replay_mnger.node_replay(nid)) {
+                    // credits left, or one message per wakeup without a window
+                    g_ready_nodes.mark(nid);
+                }
+            }
+        }
+        if (external_event) {
+            note_event();
+        }
+    }
+    return true;
+}
+#endif
+
 void worker_main(int worker_id)
 {
     tid = worker_id;
 
+#ifdef IO_URING
+    if (use_io_uring) {
+        if (worker_main_uring(worker_id)) {
+            return;
+        }
+        std::cout << std::format("worker {}: io_uring unavailable, falling back to epoll", worker_id) << std::endl;
+    }
+#endif
+
     int timeout = 200; // ms
     int epfd = epoll_create(MAX_CONNS);
     if (epfd < 0) {
         perror("epoll_create failed");
         return;
     }
-    int ctrl_fd = ctrl_pipe[tid][0];
-    int ctrl_rev_fd = ctrl_rev_pipe[tid][1];
+    auto &cmds = *worker_cmds[tid];
     struct epoll_event ev = (struct epoll_event) {
         .events = EPOLLIN,
         .data = (union epoll_data) {
-            .fd = ctrl_fd
+            .ptr = nullptr // channels carry their Channel *
         }
     };
-    epoll_ctl(epfd, EPOLL_CTL_ADD, ctrl_fd, &ev);
+    epoll_ctl(epfd, EPOLL_CTL_ADD, cmds.fd(), &ev);
 
-    std::unordered_set<int> managed_nodes;
-    for (int i = worker_id ?: nthreads; i <= n_nodes; i += nthreads) {
-        if (local_nodes.test(i)) {
-            managed_nodes.insert(i);
-        }
-    }
+    int placement_epoch = -1;
+    int seen_stage = -1;
+    std::vector<int> managed_nodes;
+    std::vector<int> ready_nodes;
+
+    // reused across pollin() calls to avoid a vector allocation per event
+    std::vector<MessagePtr> incoming_msgs;
 
+    bool shutdown = false;
     int nev;
-    while ((nev = epoll_wait(epfd, events, MAX_CONNS, timeout)) >= 0) {
+    while ((nev = epoll_wait(epfd, events, MAX_EVENTS, timeout)) >= 0) {
         LOG("epoll_wait() = %d\n", nev);
         bool external_event = false;
         /* Process Events */
         for (int i = 0; i < nev; ++i) {
             int event = events[i].events;
-            int fd = events[i].data.fd;
-            if (fd == ctrl_fd) {
-                int cmd = read_int(ctrl_fd);
-                switch (cmd) {
-                case 0: { // active ch_fd: controller connect()
-                    int ch_fd = read_int(ctrl_fd);
-                    int i = read_int(ctrl_fd);
-                    int j = read_int(ctrl_fd);
-                    int connect_res = read_int(ctrl_fd);
-                    int connect_errno = read_int(ctrl_fd);
-                    LOG("recv active %d @ thread %d\n", ch_fd, worker_id);
-
-                    if (connect_res == 0) {
-                        LOG("[%3d, %3d] connect(fd=%d, self_id=%d, peer_id=%d) success\n",
-                            i, j, ch_fd, i, j);
-                        auto channel = g_channel_manager.make_channel(ch_fd, epfd, i, j, EPOLLIN | EPOLLOUT, Channel::CONN_INPROGRESS);
-                        channel->on_connect_ok();
-                    } else if (connect_res == -1 && connect_errno != EAGAIN) {
-                        LOG("[%3d, %3d] connect(fd=%d, self_id=%d, peer_id=%d) error: %d (%s)\n",
-                            i, j, ch_fd, i, j, connect_res, strerror(connect_errno));
-                    } else {
-                        LOG("[%3d, %3d] connect(fd=%d, self_id=%d, peer_id=%d) EAGAIN\n",
-                            i, j, ch_fd, i, j);
-                        assert(connect_errno == EAGAIN);
-                        g_channel_manager.make_channel(ch_fd, epfd, i, j, EPOLLIN | EPOLLOUT, Channel::CONN_INPROGRESS);
+            Channel *channel = (Channel *)events[i].data.ptr;
+            if (channel == nullptr) {
+                cmds.drain([&](WorkerCmd &cmd) {
+                    switch (cmd.type) {
+                    case WorkerCmd::CONNECTED: {
+                        int ch_fd = cmd.fd, i = cmd.self_id, j = cmd.peer_id;
+                        LOG("recv active %d @ thread %d\n", ch_fd, worker_id);
+
+                        if (cmd.connect_res == 0) {
+                            LOG("[%3d, %3d] connect(fd=%d, self_id=%d, peer_id=%d) success\n",
+                                i, j, ch_fd, i, j);
+                            auto channel = g_channel_manager.make_channel(ch_fd, epfd, i, j, EPOLLIN | EPOLLOUT, Channel::CONN_INPROGRESS);
+                            channel->on_connect_ok();
+                        } else if (cmd.connect_res == -1 && cmd.connect_errno != EAGAIN) {
+                            LOG("[%3d, %3d] connect(fd=%d, self_id=%d, peer_id=%d) error: %d (%s)\n",
+                                i, j, ch_fd, i, j, cmd.connect_res, strerror(cmd.connect_errno));
+                        } else {
+                            LOG("[%3d, %3d] connect(fd=%d, self_id=%d, peer_id=%d) EAGAIN\n",
+                                i, j, ch_fd, i, j);
+                            assert(cmd.connect_errno == EAGAIN);
+                            g_channel_manager.make_channel(ch_fd, epfd, i, j, EPOLLIN | EPOLLOUT, Channel::CONN_INPROGRESS);
+                        }
+                        break;
                     }
-                    break;
-                }
-                case 1: { // passive ch_fd: controller accept()
-                    int ch_fd = read_int(ctrl_fd);
-                    int u = read_int(ctrl_fd);
-                    int v = read_int(ctrl_fd);
-                    LOG("accept() = %d (%d -> %d)\n", ch_fd, u, v);
-                    assert(ch_fd >= 0);
-                    g_channel_manager.make_channel(ch_fd, epfd, u, v, EPOLLIN, Channel::ACCEPTED);
-                    LOG("recv passive %d @ thread %d\n", ch_fd, worker_id);
-                    break;
-                }
-                case 2: { // shutdown
-                    return;
-                }
-                default: {
-                    LOG("cmd=%d\n", cmd);
-                    assert(0);
-                }
-                }
+                    case WorkerCmd::ACCEPTED: {
+                        LOG("accept() = %d (%d -> %d)\n", cmd.fd, cmd.self_id, cmd.peer_id);
+                        assert(cmd.fd >= 0);
+                        g_channel_manager.make_channel(cmd.fd, epfd, cmd.self_id, cmd.peer_id, EPOLLIN, Channel::ACCEPTED);
+                        LOG("recv passive %d @ thread %d\n", cmd.fd, worker_id);
+                        break;
+                    }
+                    case WorkerCmd::MUX_ACCEPTED: {
+                        g_channel_manager.make_mux(cmd.fd, epfd, cmd.self_id);
+                        LOG("recv mux %d of %d @ thread %d\n", cmd.fd, cmd.self_id, worker_id);
+                        break;
+                    }
+                    case WorkerCmd::MUX_OPEN: {
+                        mux_open(cmd.self_id, cmd.peer_id);
+                        break;
+                    }
+                    case WorkerCmd::SEND: {
+                        auto ch = g_channel_manager.get(cmd.self_id, cmd.peer_id);
+                        if (!ch || ch->worker() != worker_id) {
+                            LOG("[%3d, %3d] handed over message dropped, channel is gone\n", cmd.self_id, cmd.peer_id);
+                            break;
+                        }
+                        ReplayManager::deliver(ch.get(), cmd.msg);
+                        break;
+                    }
+                    case WorkerCmd::READY: {
+                        g_ready_nodes.on_posted(worker_id, cmd.self_id);
+                        break;
+                    }
+                    case WorkerCmd::SHUTDOWN: {
+                        shutdown = true;
+                        break;
+                    }
+                    }
+                });
                 continue;
             }
             external_event = true;
-            auto channel = g_channel_manager.get_by_fd(fd);
-            dbg_assert(channel != nullptr, "channel @ fd(%d) == nullptr", fd);
+            int fd = channel->fd();
             if (event & (~(EPOLLIN | EPOLLOUT))) {
                 LOG("fd=%d pollerr()\n", fd);
                 bool destroy = channel->pollerr(event & (~(EPOLLIN | EPOLLOUT)));
                 if (destroy) {
-                    g_channel_manager.delete_channel(fd);
+                    g_channel_manager.delete_channel(channel);
                 }
                 continue;
             }
             if (channel->state() == Channel::CONN_INPROGRESS) {
                 assert(event & EPOLLOUT);
                 LOG("outcoming connect() success, fd=%d, event = %x\n", fd, event);
-                // out coming connect()s
-                if (event & (~(EPOLLIN | EPOLLOUT))) {
-                    g_channel_manager.delete_channel(fd);
-                } else {
-                    channel->on_connect_ok();
-                }
-                continue;
+                // out coming connect()s, the SYN is written inline and
+                // an EPOLLIN edge in the same event must not be dropped
+                channel->on_connect_ok();
             }
             if (event & EPOLLIN) {
                 LOG("fd=%d pollin()\n", fd);
-                std::vector<std::shared_ptr<Message>> incoming_msgs = channel->pollin();
-                for (auto &msg : incoming_msgs) {
-                    real_hdr_t *hdr = (real_hdr_t *)msg->data();
-                    real_hdr_t orig_hdr = *hdr;
-                    switch (hdr->msg_type) {
-                    case REAL_SYN: {
-                        // ignore syn->cli_port, it's only used in
-                        // listener's accept() in the shim
-                        channel->on_receive_syn();
-                        break;
-                    }
-                    case REAL_PAYLOAD: {
-                        // round 0: both stage buildup and converge can add_msg
-                        if (iteration_round == 0 && stage == STAGE_TEARDOWN) {
-                            break;
-                        }
-                        // round 1+: only stage converge can add_msg, otherwise treat as restore
-                        if (iteration_round != 0 && stage != STAGE_CONVERGE) {
-                            break;
-                        }
-                        g_replay_mnger.add_msg(msg, channel->self_id(), channel->peer_id());
-                        break;
-                    }
-                    case REAL_SYNACK: {
-                        dbg_assert(false, "Manager don't receive REAL_SYNACK packet.");
-                        break;
-                    }
-                    default:
-                        dbg_assert(false, "Unexpected msg_type: %d", hdr->msg_type);
-                        break;
-                    }
-                    LOG("[%3d, %3d] recvmsg(): msg_type=%s(%d), len=%d, seq=%ld\n",
-                        channel->self_id(), channel->peer_id(), msg_type_name[orig_hdr.msg_type],
-                        orig_hdr.msg_type, orig_hdr.msg_len, orig_hdr.seq);
-                }
+                channel->pollin(incoming_msgs);
+                handle_incoming(channel, incoming_msgs);
             }
             if (event & EPOLLOUT) {
                 LOG("fd=%d pollout()\n", fd);
                 channel->pollout();
             }
         }
-        if (stage != STAGE_TEARDOWN) {
-        // if (stage == STAGE_CONVERGE || stage == STAGE_RESTORE) {
+        if (shutdown) {
+            return;
+        }
+        if (placement_epoch != g_placement.epoch() || seen_stage != stage) {
+            // online parts, stage checks and delayed messages may have
+            // changed for every node
+            if (placement_epoch != g_placement.epoch()) {
+                placement_epoch = g_placement.epoch();
+                managed_nodes = g_placement.managed_nodes(worker_id);
+            }
+            seen_stage = stage;
             for (auto nid : managed_nodes) {
-                g_replay_mnger.node_replay_one_msg(nid);
+                g_ready_nodes.mark(nid);
+            }
+        }
+        if (stage != STAGE_TEARDOWN) {
+            g_ready_nodes.take(worker_id, ready_nodes);
+            for (auto nid : ready_nodes) {
+                if (g_replay_mnger.node_replay(nid)) {
+                    // credits left, or one message per wakeup without a window
+                    g_ready_nodes.mark(nid);
+                }
             }
         }
         if (external_event) {
-            write_int(ctrl_rev_fd, 1);
+            note_event();
         }
     }
 }
@@ -782,21 +1273,27 @@ void acceptor_main(int thread_id, int msg_manager_socket)
     };
     epoll_ctl(epfd, EPOLL_CTL_ADD, msg_manager_socket, &ev);
 
-    int acceptor_ctrl_fd = ctrl_pipe[tid][0];
-    ev.data.fd = acceptor_ctrl_fd;
-    epoll_ctl(epfd, EPOLL_CTL_ADD, acceptor_ctrl_fd, &ev);
+    auto &cmds = *worker_cmds[tid];
+    ev.data.fd = cmds.fd();
+    epoll_ctl(epfd, EPOLL_CTL_ADD, cmds.fd(), &ev);
 
     int nev;
-    while ((nev = epoll_wait(epfd, events, MAX_CONNS, timeout)) >= 0) {
+    while ((nev = epoll_wait(epfd, events, MAX_EVENTS, timeout)) >= 0) {
         LOG("epoll_wait() = %d\n", nev);
         for (int i = 0; i < nev; ++i) {
             int event = events[i].events;
             int fd = events[i].data.fd;
             if (fd != msg_manager_socket) {
-                if (fd == acceptor_ctrl_fd) {
-                    int r = read_int(acceptor_ctrl_fd);
-                    assert(r == 2);
-                    return;
+                if (fd == cmds.fd()) {
+                    bool shutdown = false;
+                    cmds.drain([&](WorkerCmd &cmd) {
+                        assert(cmd.type == WorkerCmd::SHUTDOWN);
+                        shutdown = true;
+                    });
+                    if (shutdown) {
+                        return;
+                    }
+                    continue;
                 }
                 // rejected ch_fd
                 LOG("fd %d, event %x\n", fd, event);
@@ -817,7 +1314,18 @@ void acceptor_main(int thread_id, int msg_manager_socket)
             int ch_fd = accept4(msg_manager_socket, (sockaddr*)&uds_srcaddr, &socklen, SOCK_CLOEXEC);
             int u, v;
             dbg_assert(ch_fd >= 0, "errno: %d, sunpath = %s, socklen=%d", errno, uds_srcaddr.sun_path, socklen);
-            sscanf(uds_srcaddr.sun_path, "/ripc/emu-real-%d/%d", &u, &v);
+            if (sscanf(uds_srcaddr.sun_path, "/ripc/emu-real-%d/%d", &u, &v) != 2) {
+                const char *base = strrchr(uds_srcaddr.sun_path, '/');
+                dbg_assert(sscanf(uds_srcaddr.sun_path, "/ripc/emu-real-%d/", &u) == 1 && base
+                    && !strcmp(base + 1, MUX_SOCKET_NAME) && u > 0 && u <= n_nodes,
+                    "unexpected sunpath = %s", uds_srcaddr.sun_path);
+                int flags = fcntl(ch_fd, F_GETFL, 0);
+                fcntl(ch_fd, F_SETFL, flags | O_NONBLOCK);
+                int worker_id = g_placement.node_worker(u);
+                LOG("accept() = %d (mux of %d), pass to thread %d\n", ch_fd, u, worker_id);
+                worker_cmds[worker_id]->push({WorkerCmd::MUX_ACCEPTED, ch_fd, u, 0, 0, 0});
+                continue;
+            }
             LOG("accept() = %d (%d -> %d)\n", ch_fd, u, v);
             if (!!g_channel_manager.get(u, v) || !allow_connect(u, v)) {
                 real_syn_t syn;
@@ -833,6 +1341,8 @@ void acceptor_main(int thread_id, int msg_manager_socket)
                 synack.hdr.msg_len = synacksiz;
                 synack.hdr.seq = 0;
                 synack.cli_port = 0;
+                synack.flags = 0;
+                synack.svr_id = v;
                 int n_written = 0;
                 do {
                     // TODO: don't block here
@@ -847,14 +1357,9 @@ void acceptor_main(int thread_id, int msg_manager_socket)
             }
             int flags = fcntl(ch_fd, F_GETFL, 0);
             fcntl(ch_fd, F_SETFL, flags | O_NONBLOCK);
-            int worker_id = u % nthreads;
+            int worker_id = g_placement.channel_worker(u, v);
             LOG("pass %d to thread %d\n", ch_fd, worker_id);
-            int worker_ctrl_fd = ctrl_pipe[worker_id][1];
-            std::unique_lock lock(worker_ctrl_pipe_mutex[worker_id]);
-            write_int(worker_ctrl_fd, 1);
-            write_int(worker_ctrl_fd, ch_fd);
-            write_int(worker_ctrl_fd, u);
-            write_int(worker_ctrl_fd, v);
+            worker_cmds[worker_id]->push({WorkerCmd::ACCEPTED, ch_fd, u, v, 0, 0});
         }
     }
 }
@@ -873,6 +1378,7 @@ int main(int argc, char *argv[]) {
     auto [nhosts, host_idx] = inter_host_buildup(argv[6]);
     glb_nhosts = nhosts;
     glb_host_idx = host_idx;
+    g_termination.init(nhosts, host_idx);
 
     std::string topoPath = "conf/" + image + "/" + conf + "/";
     auto [G_, all_parts_, local_parts_, parts_nchannel_, parts_nchannel_cut_, neighborList_, host_nodes] = parse_topo(topoPath, nhosts, host_idx);
@@ -899,9 +1405,87 @@ int main(int argc, char *argv[]) {
         glb_local_cut = glb_local_parts[n_parts];
         glb_all_cut = glb_all_parts[n_parts];
     }
+    glb_is_cut.assign(n_nodes + 1, false);
+    for (auto u : glb_all_cut) {
+        glb_is_cut[u] = true;
+    }
+    // iteration_idx only ever lands on [0, n_parts]
+    idle_parts.assign(n_parts + 1, false);
 
     g_replay_mnger.init(n_nodes);
-    g_channel_manager.init(n_nodes);
+    g_ready_nodes.init(n_nodes);
+    // CTRL_REPLAY_WINDOW=W keeps up to W unacknowledged messages per node in
+    // flight and replays as fast as the shim acks them, 0 (default) replays
+    // one message per node and wakeup
+    const char *replay_window = getenv("CTRL_REPLAY_WINDOW");
+    g_replay_mnger.set_window(replay_window ? std::max(0, atoi(replay_window)) : 0);
+    // CTRL_IDLE_TIMER_MS=T keeps a node that went idle with a timer due in
+    // at most T ms busy until the timer fired (default IDLE_TIMER_MAX)
+    const char *idle_timer = getenv("CTRL_IDLE_TIMER_MS");
+    if (idle_timer) {
+        g_replay_mnger.set_idle_timer_max(std::max(0L, atol(idle_timer)) * 1'000'000);
+    }
+    // CTRL_COMPACT=1 restores restarted daemons from a BGP-compacted history
+    const char *compact = getenv("CTRL_COMPACT");
+    g_replay_mnger.set_compaction(compact && std::string(compact) == "1");
+    // CTRL_DEDUP=1 shares identical BGP bytes between history entries
+    const char *dedup = getenv("CTRL_DEDUP");
+    g_replay_mnger.set_dedup(dedup && std::string(dedup) == "1");
+    // CTRL_SPILL_MB=N moves the history of nodes going offline to disk while
+    // the history in memory exceeds N MB, 0 spills every offline node
+    const char *spill_mb = getenv("CTRL_SPILL_MB");
+    if (spill_mb) {
+        g_replay_mnger.set_spill(logPath + "/history.spill", std::max(0L, atol(spill_mb)) << 20);
+    }
+    g_channel_manager.init(glb_G);
+    // CTRL_PLACEMENT=degree|rate balances the nodes over the workers,
+    // CTRL_HUB_SPLIT=0 keeps the channels of a hub on a single worker
+    const char *placement = getenv("CTRL_PLACEMENT");
+    const char *hub_split = getenv("CTRL_HUB_SPLIT");
+    g_placement.init(placement ? placement : "modulo", !(hub_split && std::string(hub_split) == "0"), nthreads);
+    g_placement.assign(placement_weight(false));
+    // --resume continues from the checkpoint in logPath, CTRL_CHECKPOINT=1
+    // writes one at every STAGE_TEARDOWN
+    bool resume = argc > 7 && std::string(argv[7]) == "--resume";
+    if (resume) {
+        bool loaded = load_checkpoint();
+        dbg_assert(loaded, "--resume: no usable checkpoint in %s", logPath.c_str());
+        if (iteration_round > 0 && g_placement.mode() == Placement::RATE) {
+            rate_placed = true;
+            g_placement.assign(placement_weight(true));
+        }
+    }
+    // --what-if DELTA starts from the converged checkpoint in logPath and
+    // only reconverges what the topology change in DELTA reaches
+    bool whatif = argc > 8 && std::string(argv[7]) == "--what-if";
+    if (whatif) {
+        dbg_assert(nhosts == 1, "--what-if runs on a single host");
+        g_whatif.load(argv[8], n_nodes);
+        bool loaded = load_checkpoint();
+        dbg_assert(loaded, "--what-if: no usable checkpoint in %s", logPath.c_str());
+        // channel slots were made for the whole topology, which is fine
+        g_whatif.apply(glb_G);
+        for (auto [u, v] : g_whatif.down_links()) {
+            g_replay_mnger.drop_src(u, v);
+            g_replay_mnger.drop_src(v, u);
+        }
+        iteration_round = 1;
+        iteration_idx = 0;
+        iteration_delta = 1;
+        idle_parts.assign(2, false);
+        n_idle_parts = 0;
+        glb_seen_nodes.clear();
+        for (int u = 1; u <= n_nodes; ++u) {
+            if (!g_whatif.node_down(u)) {
+                glb_seen_nodes.insert(u);
+            }
+        }
+        whatif_set_active(g_whatif.seeds(glb_G));
+    }
+    const char *checkpoint = getenv("CTRL_CHECKPOINT");
+    if (checkpoint && std::string(checkpoint) == "1") {
+        g_checkpoint.open(logPath + "/checkpoint.bin", &g_replay_mnger.spill_log());
+    }
 
     LOG("=========Topo Debug ==========\n");
     LOG("G:\n");
@@ -955,89 +1539,89 @@ int main(int argc, char *argv[]) {
 
     signal(SIGPIPE, SIG_IGN);
 
+    // CTRL_SHM_TRANSPORT=1 moves messages between shims and workers through
+    // shm pipes instead of the sockets, sessions of io_uring workers stay put
+    const char *shm_transport = getenv("CTRL_SHM_TRANSPORT");
+    Channel::shm_transport = shm_transport && std::string(shm_transport) == "1";
+
+#ifdef IO_URING
+    // CTRL_IO_BACKEND=epoll runs the epoll loop of the same binary for comparison
+    const char *io_backend = getenv("CTRL_IO_BACKEND");
+    use_io_uring = !(io_backend && std::string(io_backend) == "epoll");
+    std::cout << std::format("io backend: {}", use_io_uring ? "io_uring" : "epoll") << std::endl;
+#endif
+
     tid = nthreads + 1;
 
-    int main_epfd = epoll_create(MAX_CONNS);
-    if (main_epfd < 0) {
-        perror("epoll_create failed");
-        return -1;
-    }
     std::vector<std::thread> threads(nthreads + 1);
     for (int i = 0; i <= nthreads; ++i) {
-        int r;
-        r = pipe(ctrl_pipe[i]);
-        assert(r == 0);
-        r = pipe(ctrl_rev_pipe[i]);
-        assert(r == 0);
-        struct epoll_event ev = (struct epoll_event) {
-            .events = EPOLLIN,
-            .data = (union epoll_data) {
-                .fd = ctrl_rev_pipe[i][0]
-            }
-        };
-        epoll_ctl(main_epfd, EPOLL_CTL_ADD, ctrl_rev_pipe[i][0], &ev);
+        // room for a READY of every node on top of the other commands, SENDs may overflow
+        worker_cmds[i] = std::make_unique<CmdQueue<WorkerCmd>>(std::bit_ceil((size_t)n_nodes + 1024));
+    }
+    for (int i = 0; i <= nthreads; ++i) {
         if (i < nthreads) {
             threads[i] = std::thread(worker_main, i);
         } else {
             threads[i] = std::thread(acceptor_main, i, msg_manager_socket);
         }
     }
-    for (int i = 0; i < nhosts; i++) {
-        if (i == host_idx) {
-            continue;
-        }
-        struct epoll_event ev = (struct epoll_event) {
-            .events = EPOLLIN,
-            .data = (union epoll_data) {
-                .fd = remote_ctrl_rev_pipe[i][0]
-            }
-        };
-        epoll_ctl(main_epfd, EPOLL_CTL_ADD, remote_ctrl_rev_pipe[i][0], &ev);
-    }
+
+    // all tables are allocated by now, nothing has been replayed yet
+    std::cout << std::format("baseline rss: {} KiB ({} nodes, {} channel slots)",
+        get_rss_kb(), n_nodes, g_channel_manager.n_slots()) << std::endl;
 
     // start the first iteration
     long start_ts = gettime_ns();
-    std::cout << std::format("{:.6f}: STAGE_BUILDUP @ part {}", gettime_ns() / 1e9, iteration_idx) << std::endl;
-    for (auto u : glb_all_parts[0]) {
-        glb_seen_nodes.insert(u);
-    }
-    for (auto u : glb_all_cut) {
-        glb_seen_nodes.insert(u);
+    if (resume) {
+        std::cout << std::format("{:.6f}: STAGE_BUILDUP @ part {}, resumed in round {}",
+            gettime_ns() / 1e9, iteration_idx, iteration_round) << std::endl;
+        // whatever survived the previous controller is out of sync with the history
+        stop_nodes(image, glb_local_parts[iteration_idx], logPath);
+        stop_nodes(image, glb_local_cut, logPath);
+        resume_restore = true;
+    } else if (whatif) {
+        std::cout << std::format("{:.6f}: STAGE_BUILDUP @ what-if round 1, {} links down, {} active",
+            gettime_ns() / 1e9, g_whatif.down_links().size(), glb_all_cut.size()) << std::endl;
+        stop_nodes(image, glb_local_cut, logPath);
+    } else {
+        std::cout << std::format("{:.6f}: STAGE_BUILDUP @ part {}", gettime_ns() / 1e9, iteration_idx) << std::endl;
+        for (auto u : glb_all_parts[0]) {
+            glb_seen_nodes.insert(u);
+        }
+        for (auto u : glb_all_cut) {
+            glb_seen_nodes.insert(u);
+        }
     }
-    start_nodes(image, glb_local_parts[0], neighborList, neighborList.size(), logPath);
+    start_nodes(image, glb_local_parts[iteration_idx], neighborList, neighborList.size(), logPath);
     start_nodes(image, glb_local_cut, neighborList, neighborList.size(), logPath);
     std::cout << std::format("{:.6f}: start_nodes done", gettime_ns() / 1e9) << std::endl;
 
-    int nev;
-    while ((nev = epoll_wait(main_epfd, events, MAX_CONNS, timeout)) >= 0) {
+    // workers publish activity through glb_last_event_ts, the doorbell is
+    // only rung for changes that stage_transition() should see right away
+    while (true) {
+        main_doorbell.wait(timeout);
         if (gettime_ns() - start_ts > max_runtime_ns) {
             std::cout << std::format("{:.6f}: Max runtime reached, exiting...", gettime_ns() / 1e9) << std::endl;
             stage = STAGE_TEARDOWN;
             break;
         }
-        LOG("epoll_wait() = %d\n", nev);
-        for (int i = 0; i < nev; ++i) {
-            int event = events[i].events;
-            assert(event == EPOLLIN);
-            int fd = events[i].data.fd;
-            // fd is ctrl_rev_pipe or remote_ctrl_rev_pipe
-            // currently only for last_msg_ts update, just read cmd and ignore
-            read_int(fd);
-        }
-        stage_transition(nev);
+        stage_transition();
         if (stage == STAGE_END) {
             break;
         }
     }
 
     for (int i = 0; i <= nthreads; ++i) {
-        {
-            std::unique_lock lock(worker_ctrl_pipe_mutex[i]);
-            write_int(ctrl_pipe[i][1], 2);
-        }
+        worker_cmds[i]->push({WorkerCmd::SHUTDOWN, -1, 0, 0, 0, 0});
         threads[i].join();
     }
 
+    if (whatif) {
+        std::cout << std::format("what-if: reconverged in {:.3f}s, {} of {} nodes started",
+            (gettime_ns() - start_ts) / 1e9, glb_all_cut.size(), n_nodes) << std::endl;
+    }
+    g_checkpoint.wait();
     g_replay_mnger.export_iolog();
+    MessagePool::report();
     return 0;
 }
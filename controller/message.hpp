@@ -2,18 +2,28 @@
 
 #include "debug.hpp"
 
+#include <atomic>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <utility>
+
+class MessagePool;
 
 class Message {
 public:
-    Message(int cap): cap_(cap), len_(0) {
+    Message(int cap): refcnt_(1), pool_(nullptr), slot_class_(-1), cap_(cap), len_(0), inline_(false), parent_(nullptr) {
         buffer_ = malloc(cap_);
         LOG("Message() malloc-ed %d bytes at 0x%lx\n", cap_, (uint64_t)buffer_);
         dbg_assert(buffer_ != nullptr, "malloc failed in Message(%d)", cap_);
     }
     ~Message() {
-        free(buffer_);
+        if (!inline_) {
+            free(buffer_);
+        }
+        if (parent_) {
+            parent_->put();
+        }
     }
     void *data() {
         return buffer_;
@@ -28,7 +38,16 @@ public:
         if (cap_ >= new_cap) {
             return;
         }
-        buffer_ = realloc(buffer_, new_cap);
+        if (inline_) {
+            // outgrew its slab slot, move the payload to the heap
+            void *new_buffer = malloc(new_cap);
+            dbg_assert(new_buffer != nullptr, "malloc failed in Message::extend(%d)", new_cap);
+            memcpy(new_buffer, buffer_, len_);
+            buffer_ = new_buffer;
+            inline_ = false;
+        } else {
+            buffer_ = realloc(buffer_, new_cap);
+        }
         cap_ = new_cap;
     }
     void *alloc_tail(int nbytes) {
@@ -38,7 +57,94 @@ public:
         return ret;
     }
 private:
+    friend class MessagePtr;
+    friend class MessagePool;
+
+    // slab-backed message, payload is stored right after the object
+    Message(MessagePool *pool, int slot_class, int cap):
+        refcnt_(1), pool_(pool), slot_class_(slot_class), cap_(cap), len_(0), inline_(true), parent_(nullptr) {
+        buffer_ = this + 1;
+    }
+    // len bytes at data inside parent, which is kept alive meanwhile
+    Message(MessagePool *pool, int slot_class, Message *parent, void *data, int len):
+        refcnt_(1), pool_(pool), slot_class_(slot_class), cap_(len), len_(len), inline_(true), parent_(parent) {
+        buffer_ = data;
+        parent_->get();
+    }
+    void get() {
+        refcnt_.fetch_add(1, std::memory_order_relaxed);
+    }
+    void put() {
+        if (refcnt_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            destroy();
+        }
+    }
+    void destroy();
+
+    std::atomic<int> refcnt_;
+    MessagePool *pool_; // nullptr if not carved from a slab
+    int slot_class_;
     int cap_;
     int len_;
+    bool inline_;
+    Message *parent_; // set for views, see MessagePool::make_view()
     void *buffer_;
 };
+
+/**
+ * Intrusive reference to a Message.
+ * Same semantics as std::shared_ptr<Message>, but the refcount lives in
+ * the Message itself, so no separate control block is allocated.
+ */
+class MessagePtr {
+public:
+    MessagePtr(): msg_(nullptr) {}
+    MessagePtr(std::nullptr_t): msg_(nullptr) {}
+    // adopts the initial reference of a newly created message
+    explicit MessagePtr(Message *msg): msg_(msg) {}
+    MessagePtr(const MessagePtr &other): msg_(other.msg_) {
+        if (msg_) {
+            msg_->get();
+        }
+    }
+    MessagePtr(MessagePtr &&other) noexcept: msg_(other.msg_) {
+        other.msg_ = nullptr;
+    }
+    MessagePtr &operator=(const MessagePtr &other) {
+        MessagePtr(other).swap(*this);
+        return *this;
+    }
+    MessagePtr &operator=(MessagePtr &&other) noexcept {
+        MessagePtr(std::move(other)).swap(*this);
+        return *this;
+    }
+    ~MessagePtr() {
+        if (msg_) {
+            msg_->put();
+        }
+    }
+    void swap(MessagePtr &other) noexcept {
+        std::swap(msg_, other.msg_);
+    }
+    void reset() {
+        MessagePtr().swap(*this);
+    }
+    Message *get() const {
+        return msg_;
+    }
+    Message *operator->() const {
+        return msg_;
+    }
+    Message &operator*() const {
+        return *msg_;
+    }
+    explicit operator bool() const {
+        return msg_ != nullptr;
+    }
+    // references to the message, including this one
+    int use_count() const {
+        return msg_ ? msg_->refcnt_.load(std::memory_order_relaxed) : 0;
+    }
+private:
+    Message *msg_;
+};
@@ -0,0 +1,110 @@
+#include "message_pool.hpp"
+
+#include <format>
+#include <iostream>
+
+std::mutex MessagePool::pools_mutex_;
+std::vector<MessagePool *> MessagePool::pools_;
+
+static thread_local MessagePool *tls_pool = nullptr;
+
+MessagePool &MessagePool::local()
+{
+    if (tls_pool == nullptr) {
+        tls_pool = new MessagePool();
+        std::unique_lock lock(pools_mutex_);
+        pools_.push_back(tls_pool);
+    }
+    return *tls_pool;
+}
+
+void MessagePool::refill(int slot_class)
+{
+    // take back slots released by other threads first
+    FreeSlot *remote = remote_free_[slot_class].exchange(nullptr, std::memory_order_acquire);
+    if (remote != nullptr) {
+        free_list_[slot_class] = remote;
+        return;
+    }
+    size_t siz = slot_size(slot_class);
+    char *slab = (char *)aligned_alloc(16, siz * SLAB_SLOTS);
+    dbg_assert(slab != nullptr, "aligned_alloc failed for slab of class %d", slot_class);
+    for (int i = SLAB_SLOTS - 1; i >= 0; --i) {
+        FreeSlot *slot = (FreeSlot *)(slab + i * siz);
+        slot->next = free_list_[slot_class];
+        free_list_[slot_class] = slot;
+    }
+    n_slabs_.store(n_slabs_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+MessagePtr MessagePool::alloc(int cap)
+{
+    int slot_class = 0;
+    while (slot_class < N_CLASSES && class_cap[slot_class] < cap) {
+        slot_class++;
+    }
+    if (slot_class == N_CLASSES) {
+        n_heap_.store(n_heap_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return MessagePtr(new Message(cap));
+    }
+    if (free_list_[slot_class] == nullptr) {
+        refill(slot_class);
+    }
+    FreeSlot *slot = free_list_[slot_class];
+    free_list_[slot_class] = slot->next;
+    n_pooled_.store(n_pooled_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return MessagePtr(new (slot) Message(this, slot_class, class_cap[slot_class]));
+}
+
+MessagePtr MessagePool::alloc_view(const MessagePtr &parent, void *data, int len)
+{
+    // a view only needs the Message itself, the smallest class fits it
+    if (free_list_[0] == nullptr) {
+        refill(0);
+    }
+    FreeSlot *slot = free_list_[0];
+    free_list_[0] = slot->next;
+    n_pooled_.store(n_pooled_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return MessagePtr(new (slot) Message(this, 0, parent.get(), data, len));
+}
+
+void MessagePool::free(Message *msg)
+{
+    MessagePool *owner = msg->pool_;
+    int slot_class = msg->slot_class_;
+    msg->~Message();
+    FreeSlot *slot = (FreeSlot *)msg;
+    if (owner == tls_pool) {
+        slot->next = owner->free_list_[slot_class];
+        owner->free_list_[slot_class] = slot;
+        return;
+    }
+    auto &head = owner->remote_free_[slot_class];
+    slot->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(slot->next, slot,
+            std::memory_order_release, std::memory_order_relaxed)) {
+    }
+}
+
+void Message::destroy()
+{
+    if (pool_ != nullptr) {
+        MessagePool::free(this);
+    } else {
+        delete this;
+    }
+}
+
+void MessagePool::report()
+{
+    long n_pooled = 0, n_slabs = 0, n_heap = 0;
+    std::unique_lock lock(pools_mutex_);
+    for (auto *pool : pools_) {
+        n_pooled += pool->n_pooled_.load(std::memory_order_relaxed);
+        n_slabs += pool->n_slabs_.load(std::memory_order_relaxed);
+        n_heap += pool->n_heap_.load(std::memory_order_relaxed);
+    }
+    // each pooled message used to cost a make_shared and a payload malloc
+    std::cout << std::format("msg_pool: {} messages from {} slabs in {} pools, {} allocations avoided, {} heap messages",
+        n_pooled, n_slabs, pools_.size(), 2 * n_pooled - n_slabs, n_heap) << std::endl;
+}
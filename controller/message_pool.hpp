@@ -0,0 +1,68 @@
+#pragma once
+
+#include "message.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+/**
+ * Per-thread slab allocator for Message.
+ *
+ * A pooled message is a single slab slot holding the Message object
+ * followed by its payload, so creating one costs neither a malloc nor a
+ * shared_ptr control block. Each thread carves messages from its own pool;
+ * a message released on another thread (e.g. history freed by main, or a
+ * remote payload sent by the remote worker) is pushed back to its owner's
+ * lock-free remote free list and recycled on the owner's next refill.
+ *
+ * Pools are never destroyed: messages in the replay history outlive the
+ * worker threads that received them.
+ */
+class MessagePool {
+public:
+    // pool of the calling thread
+    static MessagePool &local();
+    // message with room for at least cap bytes, falls back to the heap
+    // for payloads larger than the biggest slot
+    static MessagePtr make(int cap) {
+        return local().alloc(cap);
+    }
+    // message reading len bytes at data, which belong to parent; holds a
+    // reference to parent instead of a copy
+    static MessagePtr make_view(const MessagePtr &parent, void *data, int len) {
+        return local().alloc_view(parent, data, len);
+    }
+    static void report();
+
+private:
+    friend class Message;
+
+    static constexpr int N_CLASSES = 4;
+    // largest class fits a full 4096-byte BGP message plus real_pld_t
+    static constexpr int class_cap[N_CLASSES] = {64, 256, 1024, 4096 + 64};
+    static constexpr int SLAB_SLOTS = 64;
+
+    struct FreeSlot {
+        FreeSlot *next;
+    };
+
+    MessagePtr alloc(int cap);
+    MessagePtr alloc_view(const MessagePtr &parent, void *data, int len);
+    void refill(int slot_class);
+    static void free(Message *msg);
+    static size_t slot_size(int slot_class) {
+        return (sizeof(Message) + class_cap[slot_class] + 15) & ~(size_t)15;
+    }
+
+    FreeSlot *free_list_[N_CLASSES] = {};
+    std::atomic<FreeSlot *> remote_free_[N_CLASSES] = {};
+
+    // only written by the owner thread, relaxed so report() can read them
+    std::atomic<long> n_pooled_{0};
+    std::atomic<long> n_slabs_{0};
+    std::atomic<long> n_heap_{0};
+
+    static std::mutex pools_mutex_;
+    static std::vector<MessagePool *> pools_;
+};
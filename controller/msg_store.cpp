@@ -0,0 +1,133 @@
+#include "msg_store.hpp"
+#include "message_pool.hpp"
+#include "const.hpp"
+
+#include <cstring>
+#include <format>
+#include <iostream>
+
+namespace {
+
+constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t P3 = 0x165667B19E3779F9ULL;
+
+inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t load64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t round64(uint64_t acc, uint64_t v)
+{
+    return rotl(acc + v * P2, 31) * P1;
+}
+
+} // namespace
+
+uint64_t MessageStore::hash(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+    // the lanes don't depend on each other, so the compiler can keep
+    // them in one vector register
+    uint64_t lane[4] = {P1 + P2, P2, 0, -P1};
+    while (end - p >= 32) {
+        for (int i = 0; i < 4; ++i) {
+            lane[i] = round64(lane[i], load64(p + 8 * i));
+        }
+        p += 32;
+    }
+    uint64_t h = rotl(lane[0], 1) + rotl(lane[1], 7) + rotl(lane[2], 12) + rotl(lane[3], 18);
+    h += len * P3;
+    while (end - p >= 8) {
+        h = rotl(h ^ round64(0, load64(p)), 27) * P1 + P3;
+        p += 8;
+    }
+    while (p < end) {
+        h = rotl(h ^ (*p++ * P3), 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+size_t MessageStore::nlri_offset(const uint8_t *bgp, size_t len)
+{
+    // BGP header: 16 byte marker, 2 byte length, 1 byte type
+    constexpr size_t hdr_len = 19;
+    if (len < hdr_len + 4 || bgp[18] != BGP_UPDATE || (size_t)(bgp[16] << 8 | bgp[17]) != len) {
+        return 0;
+    }
+    size_t withdrawn_len = bgp[hdr_len] << 8 | bgp[hdr_len + 1];
+    size_t attr_off = hdr_len + 2 + withdrawn_len;
+    if (attr_off + 2 > len) {
+        return 0;
+    }
+    size_t attr_len = bgp[attr_off] << 8 | bgp[attr_off + 1];
+    size_t off = attr_off + 2 + attr_len;
+    return off < len ? off : 0;
+}
+
+MessagePtr MessageStore::intern(const void *data, size_t len)
+{
+    uint64_t h = hash(data, len);
+    Shard &shard = shards_[h % N_SHARDS];
+    n_lookups_.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock lock(shard.mutex);
+    auto [first, last] = shard.map.equal_range(h);
+    for (auto it = first; it != last; ++it) {
+        MessagePtr &msg = it->second;
+        if ((size_t)msg->len() == len && memcmp(msg->data(), data, len) == 0) {
+            n_hits_.fetch_add(1, std::memory_order_relaxed);
+            return msg;
+        }
+    }
+    MessagePtr msg = MessagePool::make(len);
+    memcpy(msg->alloc_tail(len), data, len);
+    shard.map.emplace(h, msg);
+    shard.bytes += len;
+    return msg;
+}
+
+size_t MessageStore::sweep()
+{
+    size_t n_left = 0;
+    for (auto &shard : shards_) {
+        std::unique_lock lock(shard.mutex);
+        for (auto it = shard.map.begin(); it != shard.map.end();) {
+            if (it->second.use_count() == 1) {
+                shard.bytes -= it->second->len();
+                it = shard.map.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        n_left += shard.map.size();
+    }
+    return n_left;
+}
+
+void MessageStore::report()
+{
+    size_t n_msgs = 0;
+    long bytes = 0;
+    for (auto &shard : shards_) {
+        std::unique_lock lock(shard.mutex);
+        n_msgs += shard.map.size();
+        bytes += shard.bytes;
+    }
+    long n_lookups = n_lookups_.load(std::memory_order_relaxed);
+    long n_hits = n_hits_.load(std::memory_order_relaxed);
+    std::cout << std::format("msg store: {} pieces, {} bytes, {} of {} lookups shared ({:.1f}%)",
+        n_msgs, bytes, n_hits, n_lookups, n_lookups ? 100.0 * n_hits / n_lookups : 0.0) << std::endl;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "message.hpp"
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+/**
+ * Content-addressed store for the BGP bytes of REAL_PAYLOADs.
+ *
+ * A daemon sends the same UPDATE, or one that differs only in its path
+ * attributes (e.g. NEXT_HOP), to many peers. The history then keeps the
+ * bytes once: intern() returns the message already holding them, or a new
+ * one it remembers. A payload that is a single UPDATE is interned as two
+ * pieces, everything before the NLRI and the NLRI itself, so that peers
+ * with different attributes still share the prefixes.
+ *
+ * Interned messages are only the BGP bytes, without the real_pld_t header,
+ * which is rebuilt per destination when a message is replayed. sweep()
+ * forgets the ones no history entry references anymore.
+ */
+class MessageStore {
+public:
+    // 64-bit hash over four independent lanes, 32 bytes per round
+    static uint64_t hash(const void *data, size_t len);
+    // offset of the NLRI if the bytes are one UPDATE with some, else 0
+    static size_t nlri_offset(const uint8_t *bgp, size_t len);
+
+    MessagePtr intern(const void *data, size_t len);
+    // drops what only the store holds on to, returns the number of messages left
+    size_t sweep();
+    void report();
+private:
+    static constexpr int N_SHARDS = 64;
+    // add_msg() runs on every worker, so the table is sharded by hash
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_multimap<uint64_t, MessagePtr> map;
+        long bytes = 0;
+    };
+    std::array<Shard, N_SHARDS> shards_;
+    std::atomic<long> n_lookups_{0};
+    std::atomic<long> n_hits_{0};
+};
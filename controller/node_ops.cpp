@@ -5,16 +5,19 @@
 #include <chrono>
 #include <cstdlib>
 #include <cstdio>
+#include <cerrno>
 #include <sstream>
 #include <unordered_set>
 #include <set>
 #include <format>
+#include <dirent.h>
 #include "json.hpp"
 #include "node_ops.hpp"
 #include "debug.hpp"
 #include "const.hpp"
 
 extern long gettime_ns(int clock_id = CLOCK_MONOTONIC);
+extern std::string get_mux_path(int id);
 
 struct ExecResult {
     // 2 parts:
@@ -174,6 +177,38 @@ void restart_daemons_crpd(const std::string &node_name, const std::string &logPa
     execInst("./lwc/target/release/lwc exec " + node_name + " sv force-restart rpd", logPath);
 }
 
+// the mux a previous daemon of node bound, try_buildup() would wait for it forever
+static void unlink_mux(int node) {
+    std::string path = get_mux_path(node);
+    if (unlink(path.c_str()) == 0) {
+        LOG("removed stale %s\n", path.c_str());
+    } else {
+        dbg_assert(errno == ENOENT, "unlink(%s) failed, errno = %d", path.c_str(), errno);
+    }
+}
+
+// the trace rings (preload TRACE=1) of the node's previous daemons, which
+// would otherwise pile up in ripc with every restart; shim_trace drains
+// what a removed ring it mapped still holds before letting go of it
+static void unlink_traces(int node) {
+    std::string dir = "/opt/lwc/volumes/ripc/emu-real-" + std::to_string(node) + "/";
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) {
+        return;
+    }
+    while (struct dirent *e = readdir(d)) {
+        std::string name = e->d_name;
+        if (name.rfind("trace_", 0) != 0 || name.size() < 4 || name.compare(name.size() - 4, 4, ".shm") != 0) {
+            continue;
+        }
+        std::string path = dir + name;
+        if (unlink(path.c_str()) != 0) {
+            dbg_assert(errno == ENOENT, "unlink(%s) failed, errno = %d", path.c_str(), errno);
+        }
+    }
+    closedir(d);
+}
+
 void start_nodes(const std::string& image,
                    const std::unordered_set<int>& nodes,
                    const std::unordered_map<int, std::string>& neighborList,
@@ -183,6 +218,8 @@ void start_nodes(const std::string& image,
     for (int node : nodes) {
         threads.emplace_back([&, node]() {
             std::string node_name = "emu-real-" + std::to_string(node);
+            unlink_mux(node);
+            unlink_traces(node);
             if (image == "crpd") {
                 start_daemons_crpd(node_name, logPath);
                 return;
@@ -216,6 +253,8 @@ void restart_nodes(const std::string& image,
     for (int node : nodes) {
         threads.emplace_back([&, node]() {
             std::string node_name = "emu-real-" + std::to_string(node);
+            unlink_mux(node);
+            unlink_traces(node);
             if (image == "crpd") {
                 restart_daemons_crpd(node_name, logPath);
                 return;
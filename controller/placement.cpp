@@ -0,0 +1,137 @@
+#include "placement.hpp"
+#include "const.hpp"
+#include "channel_manager.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <bitset>
+#include <iostream>
+#include <format>
+
+extern int n_nodes;
+extern std::bitset<MAX_CLIENTS> local_nodes;
+
+Placement g_placement;
+
+void Placement::init(const std::string &mode, bool split_hubs, int nthreads)
+{
+    if (mode == "degree") {
+        mode_ = DEGREE;
+    } else if (mode == "rate") {
+        mode_ = RATE;
+    } else {
+        mode_ = MODULO;
+    }
+    split_hubs_ = split_hubs;
+    nthreads_ = nthreads;
+}
+
+const char *Placement::mode_name() const
+{
+    switch (mode_) {
+    case DEGREE: return "degree";
+    case RATE: return "rate";
+    default: return "modulo";
+    }
+}
+
+void Placement::assign(const std::vector<long> &weight)
+{
+    auto t = std::make_shared<Table>();
+    std::vector<int> node_worker(n_nodes + 1);
+    t->channel_worker.assign(g_channel_manager.n_slots(), -1);
+    t->load.assign(nthreads_, 0);
+    if (mode_ == MODULO) {
+        for (int u = 0; u <= n_nodes; ++u) {
+            node_worker[u] = u % nthreads_;
+            if (u > 0 && local_nodes.test(u)) {
+                t->load[u % nthreads_] += weight[u];
+            }
+        }
+    } else {
+        std::vector<int> order;
+        long total = 0;
+        for (int u = 1; u <= n_nodes; ++u) {
+            if (local_nodes.test(u)) {
+                order.push_back(u);
+                total += weight[u];
+            }
+        }
+        // longest processing time first: heaviest node to the least loaded worker
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return weight[a] > weight[b];
+        });
+        auto least_loaded = [&]() {
+            return (int)(std::min_element(t->load.begin(), t->load.end()) - t->load.begin());
+        };
+        long fair_share = (total + nthreads_ - 1) / nthreads_;
+        for (int u : order) {
+            auto [first, last] = g_channel_manager.slots_of(u);
+            int w = least_loaded();
+            node_worker[u] = w;
+            if (!split_hubs_ || nthreads_ == 1 || weight[u] <= fair_share || last - first < 2) {
+                t->load[w] += weight[u];
+                continue;
+            }
+            // hub: spread its channels, the replay stays on w
+            long per_channel = std::max(1L, weight[u] / (last - first));
+            for (int s = first; s < last; ++s) {
+                int cw = least_loaded();
+                t->channel_worker[s] = cw;
+                t->load[cw] += per_channel;
+            }
+            t->n_split++;
+        }
+    }
+
+    long max_load = *std::max_element(t->load.begin(), t->load.end());
+    long sum_load = std::accumulate(t->load.begin(), t->load.end(), 0L);
+    std::cout << std::format("placement: {}, max/avg worker load {:.3f}, {} hubs split",
+        mode_name(), sum_load ? (double)max_load * nthreads_ / sum_load : 1.0, t->n_split) << std::endl;
+
+    std::unique_lock lock(table_mutex_);
+    if (!node_worker_) {
+        n_node_worker_ = n_nodes + 1;
+        node_worker_.reset(new std::atomic<int>[n_node_worker_]);
+    }
+    for (int u = 0; u < n_node_worker_; ++u) {
+        node_worker_[u].store(node_worker[u], std::memory_order_relaxed);
+    }
+    table_ = std::move(t);
+    epoch_.fetch_add(1, std::memory_order_acq_rel);
+}
+
+std::shared_ptr<const Placement::Table> Placement::table()
+{
+    std::unique_lock lock(table_mutex_);
+    return table_;
+}
+
+int Placement::node_worker(int node_id)
+{
+    if (node_id < 0 || node_id >= n_node_worker_) {
+        return node_id % nthreads_;
+    }
+    return node_worker_[node_id].load(std::memory_order_relaxed);
+}
+
+int Placement::channel_worker(int node_id, int peer_id)
+{
+    auto t = table();
+    int s = g_channel_manager.slot(node_id, peer_id);
+    if (s >= 0 && t->channel_worker[s] >= 0) {
+        return t->channel_worker[s];
+    }
+    return node_worker(node_id);
+}
+
+std::vector<int> Placement::managed_nodes(int worker_id)
+{
+    std::vector<int> nodes;
+    for (int u = 1; u <= n_nodes; ++u) {
+        if (local_nodes.test(u) && node_worker(u) == worker_id) {
+            nodes.push_back(u);
+        }
+    }
+    return nodes;
+}
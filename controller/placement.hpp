@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+
+/**
+ * Which worker replays a node and which worker owns a channel.
+ *
+ * MODULO is the historical i % nthreads mapping. DEGREE assigns nodes
+ * greedily, heaviest first, to the least loaded worker, with the node
+ * degree as its weight. RATE starts out as DEGREE and is reassigned with
+ * the message counts of round 0 once iterative convergence enters round 1.
+ *
+ * With hub splitting, a node whose weight alone exceeds a worker's fair
+ * share doesn't move as a whole: each of its channels goes to the least
+ * loaded worker, and sends to channels owned by another worker are handed
+ * over through that worker's command queue.
+ *
+ * Channels created before a reassignment stay with the worker that
+ * created them (see Channel::worker()), the new table only routes new
+ * connections and replays.
+ */
+class Placement {
+public:
+    enum Mode {
+        MODULO,
+        DEGREE,
+        RATE,
+    };
+    // mode is "modulo", "degree" or "rate", unknown names are MODULO
+    void init(const std::string &mode, bool split_hubs, int nthreads);
+    // weight[u] of every local node, 0 for the others; ignored by MODULO
+    void assign(const std::vector<long> &weight);
+
+    Mode mode() const {
+        return mode_;
+    }
+    const char *mode_name() const;
+    int node_worker(int node_id);
+    int channel_worker(int node_id, int peer_id);
+    // bumped by assign(), workers compare it to reload their nodes
+    int epoch() const {
+        return epoch_.load(std::memory_order_acquire);
+    }
+    // local nodes replayed by worker_id, in node order
+    std::vector<int> managed_nodes(int worker_id);
+
+private:
+    struct Table {
+        std::vector<int> channel_worker; // by ChannelManager slot, -1 follows the node
+        std::vector<long> load;
+        int n_split = 0;
+    };
+    Mode mode_ = MODULO;
+    bool split_hubs_ = false;
+    int nthreads_ = 1;
+    std::atomic<int> epoch_{0};
+    // read on every add_msg(), so it's kept out of the locked table
+    int n_node_worker_ = 0;
+    std::unique_ptr<std::atomic<int>[]> node_worker_;
+    std::mutex table_mutex_;
+    std::shared_ptr<const Table> table_;
+    std::shared_ptr<const Table> table();
+};
+
+extern Placement g_placement;
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "const.hpp"
+#include "placement.hpp"
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+extern thread_local int tid;
+extern void post_ready(int worker_id, int node_id);
+
+/**
+ * Nodes that may have a message to replay, per worker.
+ *
+ * A node is marked when a message is appended to it, when one of its
+ * channels becomes established or writable, and by its worker on every
+ * stage or placement change. Workers only call node_replay_one_msg() on
+ * marked nodes instead of scanning all of their nodes on each wakeup.
+ *
+ * A node is queued at most once. Marks from the replaying worker go
+ * straight to its list, marks from other threads are posted as READY
+ * commands, so they also wake the worker up.
+ */
+class ReadyQueue {
+public:
+    void init(int max_node_id) {
+        queued_.reset(new std::atomic<bool>[max_node_id + 1]);
+        for (int u = 0; u <= max_node_id; ++u) {
+            queued_[u].store(false, std::memory_order_relaxed);
+        }
+    }
+    void mark(int node_id) {
+        if (queued_[node_id].exchange(true, std::memory_order_acq_rel)) {
+            return;
+        }
+        int worker_id = g_placement.node_worker(node_id);
+        if (worker_id == tid) {
+            local_[worker_id].nodes.push_back(node_id);
+        } else {
+            post_ready(worker_id, node_id);
+        }
+    }
+    // READY command received by worker_id
+    void on_posted(int worker_id, int node_id) {
+        local_[worker_id].nodes.push_back(node_id);
+    }
+    // hands the marked nodes of worker_id over to the caller, a node
+    // marked again from now on is queued again
+    void take(int worker_id, std::vector<int> &nodes) {
+        nodes.clear();
+        nodes.swap(local_[worker_id].nodes);
+        for (int u : nodes) {
+            queued_[u].store(false, std::memory_order_release);
+        }
+    }
+private:
+    std::unique_ptr<std::atomic<bool>[]> queued_;
+    // only touched by their worker
+    struct alignas(64) Local {
+        std::vector<int> nodes;
+    };
+    std::array<Local, MAX_THREADS> local_;
+};
+
+extern ReadyQueue g_ready_nodes;
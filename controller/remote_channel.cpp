@@ -8,29 +8,10 @@ RemoteChannel::RemoteChannel(int fd, int host_id, int epoll_fd):
     fd_(fd), host_id_(host_id), epoll_fd_(epoll_fd), events_(EPOLLIN),
     rb_in_(1 << 20), rb_out_(1 << 20) {}
 
-void RemoteChannel::send_eos(int stage) {
-    real_hdr_t hdr{};
-    hdr.msg_type = REAL_ENDOFSTAGE;
-    hdr.msg_len = hdrsiz;
-    hdr.seq = stage;
-    auto msg = std::make_shared<Message>(sizeof(hdr));
-    memcpy(msg->data(), &hdr, sizeof(hdr));
-    msg->alloc_tail(sizeof(hdr));
-
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        send_queue_.push_back(msg);
-        epoll_mod_add_out();
-    }
-}
-
-void RemoteChannel::send_keepbusy() {
-    real_hdr_t hdr{};
-    hdr.msg_type = REAL_KEEPBUSY;
-    hdr.msg_len = hdrsiz;
-    auto msg = std::make_shared<Message>(sizeof(hdr));
-    memcpy(msg->data(), &hdr, sizeof(hdr));
-    msg->alloc_tail(sizeof(hdr));
+void RemoteChannel::send_token(const real_token_t &tok) {
+    auto msg = MessagePool::make(sizeof(tok));
+    memcpy(msg->data(), &tok, sizeof(tok));
+    msg->alloc_tail(sizeof(tok));
 
     {
         std::lock_guard<std::mutex> lock(mutex_);
@@ -74,8 +55,9 @@ void RemoteChannel::pollout() {
     }
 }
 
-std::vector<std::shared_ptr<Message>> RemoteChannel::pollin(int ctrl_rev_fd) {
+void RemoteChannel::pollin(std::vector<MessagePtr> &msg_list) {
     std::unique_lock lock(this->mutex_);
+    msg_list.clear();
     // 1. read from fd into ringbuffer
     ssize_t n_read = rb_in_.readFromFd(fd_);
     if (n_read <= 0) {
@@ -85,26 +67,24 @@ std::vector<std::shared_ptr<Message>> RemoteChannel::pollin(int ctrl_rev_fd) {
         } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
             perror("remote channel read()");
         }
-        return {};
+        return;
     }
     // 2. get messages from ringbuffer
-    std::vector<std::shared_ptr<Message>> msg_list;
     while (rb_in_.availableRead() > 0) {
-        real_hdr_t hdr;
-        bool ok = rb_in_.peek(&hdr, sizeof(hdr));
-        if (!ok) break;
-        size_t msglen = hdr.msg_len; // type conversion
+        real_hdr_t scratch;
+        auto *hdr = (const real_hdr_t *)rb_in_.span(sizeof(scratch), &scratch);
+        if (!hdr) break;
+        size_t msglen = hdr->msg_len; // type conversion
         while (msglen > rb_in_.capacity()) {
             rb_in_.expand();
         }
         if (rb_in_.availableRead() < msglen) {
             break;
         }
-        auto msg = std::make_shared<Message>(msglen);
+        auto msg = MessagePool::make(msglen);
         msg->alloc_tail(msglen);
-        ok = rb_in_.get(msg->data(), msglen);
+        bool ok = rb_in_.get(msg->data(), msglen);
         dbg_assert(ok, "rb_in_.get(%p, %ld) failed\n", msg->data(), msglen);
-        msg_list.push_back(msg);
+        msg_list.push_back(std::move(msg));
     }
-    return msg_list;
 }
\ No newline at end of file
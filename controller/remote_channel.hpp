@@ -2,6 +2,7 @@
 
 #include "const.hpp"
 #include "message.hpp"
+#include "message_pool.hpp"
 #include "ring_buffer.hpp"
 
 #include <memory>
@@ -18,9 +19,10 @@ extern "C" {
 class RemoteChannel {
 public:
     RemoteChannel(int fd, int host_id, int epoll_fd);
-    std::vector<std::shared_ptr<Message>> pollin(int ctrl_rev_fd);
+    // appends complete messages to msg_list, which is cleared first
+    void pollin(std::vector<MessagePtr> &msg_list);
     void pollout();
-    void add_msg(std::shared_ptr<Message> &msg) {
+    void add_msg(MessagePtr &msg) {
         std::unique_lock lock(mutex_);
         real_hdr_t *hdr = (real_hdr_t *)msg->data();
         real_hdr_t orig_hdr = *hdr;
@@ -30,19 +32,18 @@ public:
         send_queue_.push_back(msg);
         epoll_mod_add_out();
     }
-    void send_eos(int stage);
-    void send_keepbusy();
+    void send_token(const real_token_t &tok);
     int host_id() {
         return host_id_;
     }
 private:
-    std::deque<std::shared_ptr<Message>> send_queue_;
+    std::deque<MessagePtr> send_queue_;
     int fd_;
     int host_id_;
     int epoll_fd_;
     uint32_t events_;
     std::mutex mutex_;
-    RingBuffer rb_in_, rb_out_;
+    StreamBuffer rb_in_, rb_out_;
     inline void epoll_mod_add_out() {
         if (events_ & EPOLLOUT) {
             return;
@@ -4,6 +4,8 @@
 #include "const.hpp"
 #include "json.hpp"
 #include "replay_manager.hpp"
+#include "cmd_queue.hpp"
+#include "termination.hpp"
 
 #include <format>
 #include <cassert>
@@ -23,8 +25,8 @@ extern long gettime_ns(int clock_id = CLOCK_MONOTONIC);
 
 using json = nlohmann::json;
 
-extern int remote_ctrl_rev_pipe[MAX_THREADS + 1][2];
-extern volatile std::atomic<int> n_ready_host;
+extern std::atomic<long> glb_last_event_ts;
+extern Doorbell main_doorbell;
 extern volatile std::atomic<int> stage;
 
 std::array<std::unique_ptr<RemoteChannel>, MAX_HOSTS> remote_channels;
@@ -131,7 +133,7 @@ std::tuple<std::vector<Host>, int> parse_hosts(std::string filename) {
     return {hosts, self_id};
 }
 
-void remote_worker_main(EpollThread* et);
+void remote_worker_main(EpollThread* et, int host_id);
 
 std::pair<int, int> inter_host_buildup(std::string hosts_file) {
     auto [hosts, self_id] = parse_hosts(hosts_file);
@@ -148,9 +150,6 @@ std::pair<int, int> inter_host_buildup(std::string hosts_file) {
         }
         poll_threads[i] = std::make_unique<EpollThread>();
         poll_threads[i]->epfd = epoll_create1(0);
-        int r = pipe(remote_ctrl_rev_pipe[i]);
-        assert(r == 0);
-        poll_threads[i]->ctrl_rev_fd = remote_ctrl_rev_pipe[i][1];
     }
 
     // 2. create listening socket
@@ -210,22 +209,19 @@ std::pair<int, int> inter_host_buildup(std::string hosts_file) {
         if (i == self_id) {
             continue;
         }
-        std::thread(remote_worker_main, poll_threads[i].get()).detach();
+        std::thread(remote_worker_main, poll_threads[i].get(), i).detach();
     }
 
     return {hosts.size(), self_id};
 }
 
-static void write_int(int fd, int num) {
-    int r = write(fd, &num, sizeof(num));
-    assert(r == sizeof(num));
-    return;
-}
-
-void remote_worker_main(EpollThread* et)
+void remote_worker_main(EpollThread* et, int host_id)
 {
+    // never a worker's, its marks of ready nodes are posted to their workers
+    tid = REMOTE_TID_BASE + host_id;
     constexpr int MAX_EVENTS = 32;
     struct epoll_event events[MAX_EVENTS];
+    std::vector<MessagePtr> msg_list;
 
     while (true) {
         int n = epoll_wait(et->epfd, events, MAX_EVENTS, 100);
@@ -244,25 +240,24 @@ void remote_worker_main(EpollThread* et)
             }
 
             if (ev & EPOLLIN) {
-                auto msg_list = ch->pollin(et->ctrl_rev_fd);
+                ch->pollin(msg_list);
                 bool notify_main = false;
                 for (auto &msg : msg_list) {
                     real_hdr_t hdr;
                     memcpy(&hdr, msg->data(), hdrsiz);
                     switch (hdr.msg_type) {
-                    case REAL_ENDOFSTAGE: {
-                        std::cout << std::format("{:.6f}: recv_eos {} host {}", gettime_ns() / 1e9, stage_name[stage], ch->host_id()) << std::endl;
-                        n_ready_host++;
-                        break;
-                    }
-                    case REAL_KEEPBUSY: {
-                        LOG("recv keepbusy\n");
-                        notify_main = true;
+                    case REAL_TOKEN: {
+                        real_token_t tok;
+                        memcpy(&tok, msg->data(), sizeof(tok));
+                        LOG("recv token from host %d: epoch %ld, count %ld, black %d, decided %d\n",
+                            ch->host_id(), tok.hdr.seq, tok.count, tok.black, tok.decided);
+                        g_termination.on_token(tok);
                         break;
                     }
                     case REAL_PAYLOAD: {
                         real_pld_t pld;
                         memcpy(&pld, (uint8_t *)msg->data(), sizeof(pld));
+                        g_termination.on_payload_received();
                         g_replay_mnger.add_msg(msg, pld.src_id, pld.dst_id);
                         notify_main = true;
                         break;
@@ -273,7 +268,7 @@ void remote_worker_main(EpollThread* et)
                     }
                 }
                 if (notify_main) {
-                    write_int(et->ctrl_rev_fd, 2);
+                    glb_last_event_ts.store(gettime_ns(), std::memory_order_relaxed);
                 }
             }
             if (ev & EPOLLOUT) {
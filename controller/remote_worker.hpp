@@ -11,7 +11,6 @@
 
 struct EpollThread {
     int epfd;
-    int ctrl_rev_fd;
     std::vector<int> host_ids;
     std::unordered_map<int, RemoteChannel *> fd2hostch;
 };
@@ -2,6 +2,9 @@
 #include "channel.hpp"
 #include "channel_manager.hpp"
 #include "remote_channel.hpp"
+#include "ready_queue.hpp"
+#include "termination.hpp"
+#include "bgp_compact.hpp"
 
 #include <fstream>
 #include <algorithm>
@@ -19,8 +22,10 @@ extern int glb_host_idx;
 extern std::array<std::unique_ptr<RemoteChannel>, MAX_HOSTS> remote_channels;
 
 extern long gettime_ns(int clock_id = CLOCK_MONOTONIC);
+extern void post_send(int worker_id, int self_id, int peer_id, MessagePtr &msg);
 
 ReplayManager g_replay_mnger;
+ReadyQueue g_ready_nodes;
 
 /* Caller must take the node_mutex. */
 void ReplayManager::try_flush_delayed_msg(int dst_id)
@@ -28,41 +33,281 @@ void ReplayManager::try_flush_delayed_msg(int dst_id)
     if (stage != STAGE_RESTORE && stage != STAGE_CONVERGE) {
         return;
     }
-    std::vector<history_msg> &lis = delayed_msg_list_[dst_id];
-    if (lis.size() == 0) {
+    History &lis = delayed_msg_list_[dst_id];
+    if (lis.empty()) {
         return;
     }
-    msg_list_[dst_id].insert(
-        msg_list_[dst_id].end(),
-        std::make_move_iterator(lis.begin()),
-        std::make_move_iterator(lis.end())
-    );
-    std::vector<history_msg>().swap(lis);
+    for (size_t i = 0; i < lis.size(); ++i) {
+        msg_list_[dst_id].append(lis, i);
+    }
+    History().swap(lis);
+}
+
+void ReplayManager::node_offline(int node_id)
+{
+    std::unique_lock lock(node_mutex_[node_id]);
+    if (compaction_) {
+        compact_history(node_id);
+    }
+    if (spill_.is_open() && resident_bytes_.load(std::memory_order_relaxed) > spill_budget_) {
+        spill_history(node_id);
+    }
+    restore_until_seq_[node_id] = msg_list_[node_id].size();
+    replayed_seq_[node_id] = 0;
+    acked_seq_[node_id] = 0;
+    // the daemon restarts from scratch
+    received_[node_id] = 0;
+    idle_seen_[node_id] = false;
+    lock.unlock();
+    // restore from the start once it's back
+    g_ready_nodes.mark(node_id);
+}
+
+/* Caller must take the node_mutex. */
+void ReplayManager::compact_history(int node_id)
+{
+    auto &lis = msg_list_[node_id];
+    for (size_t i = 0; i < lis.size(); ++i) {
+        if (!lis.resident(i)) {
+            unspill(node_id, i);
+        }
+    }
+    std::vector<MessagePtr> payloads;
+    std::vector<BgpHistoryMsg> history;
+    payloads.reserve(lis.size());
+    history.reserve(lis.size());
+    for (size_t i = 0; i < lis.size(); ++i) {
+        payloads.push_back(lis.payload(i, node_id));
+        auto *pld = (const uint8_t *)payloads.back()->data();
+        history.push_back({lis.src_id(i), pld + sizeof(real_pld_t), (size_t)lis.len(i) - sizeof(real_pld_t)});
+    }
+    auto keep = bgp_compact(history);
+    History kept;
+    long bytes_before = 0, bytes_after = 0;
+    for (size_t i = 0; i < lis.size(); ++i) {
+        bytes_before += lis.len(i);
+        if (!keep[i]) {
+            compacted_[node_id].push_back({lis.src_id(i), lis.timestamp(i)});
+            resident_bytes_ -= lis.len(i);
+            continue;
+        }
+        bytes_after += lis.len(i);
+        kept.append(lis, i);
+    }
+    size_t n_before = lis.size();
+    size_t n_kept = kept.size();
+    // the kept records are copied into a fresh arena, the old one goes
+    // away with the last replayed view of it
+    payloads.clear();
+    lis.swap(kept);
+    // node_offline() runs on the main thread only
+    static std::ofstream report(logPath + "/compaction.log");
+    report << std::format("{:.6f} node {}: {} -> {} msgs, {} -> {} bytes, ratio {:.3f}\n",
+        gettime_ns() / 1e9, node_id, n_before, n_kept, bytes_before, bytes_after,
+        n_before ? (double)n_kept / n_before : 1.0);
+    report.flush();
+}
+
+/* Caller must take the node_mutex. Runs on the main thread, like every append to spill_. */
+void ReplayManager::spill_history(int node_id)
+{
+    auto &lis = msg_list_[node_id];
+    std::vector<MessagePtr> payloads;
+    std::vector<struct iovec> iov;
+    for (size_t i = 0; i < lis.size(); ++i) {
+        if (lis.resident(i) && lis.spill_off(i) < 0) {
+            payloads.push_back(lis.payload(i, node_id));
+            iov.push_back({payloads.back()->data(), (size_t)lis.len(i)});
+        }
+    }
+    long off = iov.empty() ? 0 : spill_.append(iov);
+    long freed = 0;
+    for (size_t i = 0; i < lis.size(); ++i) {
+        if (!lis.resident(i)) {
+            continue;
+        }
+        if (lis.spill_off(i) < 0) {
+            lis.set_spilled(i, off);
+            off += lis.len(i);
+        }
+        freed += lis.len(i);
+    }
+    payloads.clear();
+    lis.evict();
+    resident_bytes_ -= freed;
+    LOG("spill_history(%d): %ld msgs, %ld bytes freed, %ld bytes resident, log %ld bytes\n",
+        node_id, lis.size(), freed, resident_bytes_.load(), spill_.size());
+}
+
+/* Caller must take the node_mutex. Reads the spilled messages from seq on back, a chunk at a time. */
+void ReplayManager::unspill(int node_id, size_t seq)
+{
+    auto &lis = msg_list_[node_id];
+    long off = lis.spill_off(seq);
+    long end = off;
+    size_t last = seq;
+    // one read as long as the extents are back to back
+    for (; last < lis.size() && !lis.resident(last) && lis.spill_off(last) == end && end - off < SPILL_CHUNK; ++last) {
+        end += lis.len(last);
+    }
+    std::vector<struct iovec> iov;
+    lis.reserve(seq, last, iov);
+    spill_.read(off, iov);
+    resident_bytes_ += end - off;
+    // streams the next chunk in while this one is replayed
+    if (last < lis.size() && !lis.resident(last)) {
+        spill_.readahead(lis.spill_off(last), SPILL_CHUNK);
+    }
 }
 
-void ReplayManager::add_msg(std::shared_ptr<Message> &msg, int src_id, int dst_id)
+void ReplayManager::append_history(History &lis, int src_id, long ts, MessagePtr &msg)
+{
+    if (!dedup_) {
+        lis.append(src_id, ts, msg->data(), msg->len());
+        return;
+    }
+    const uint8_t *bgp = (const uint8_t *)msg->data() + sizeof(real_pld_t);
+    size_t len = msg->len() - sizeof(real_pld_t);
+    size_t split = MessageStore::nlri_offset(bgp, len);
+    History::Pieces pieces;
+    if (split) {
+        pieces.body = store_.intern(bgp, split);
+        pieces.nlri = store_.intern(bgp + split, len - split);
+    } else {
+        pieces.body = store_.intern(bgp, len);
+    }
+    lis.append(src_id, ts, std::move(pieces), msg->len());
+}
+
+void ReplayManager::sweep_store()
+{
+    if (!dedup_) {
+        return;
+    }
+    store_.sweep();
+    store_.report();
+}
+
+void ReplayManager::checkpoint(int node_id, NodeCheckpoint &ck)
+{
+    std::unique_lock lock(node_mutex_[node_id]);
+    ck.node_id = node_id;
+    ck.replayed_seq = replayed_seq_[node_id];
+    ck.restore_until_seq = restore_until_seq_[node_id];
+    auto snapshot = [node_id](const History &lis, std::vector<NodeCheckpoint::Entry> &entries) {
+        entries.reserve(lis.size());
+        for (size_t i = 0; i < lis.size(); ++i) {
+            MessagePtr msg = lis.resident(i) ? lis.payload(i, node_id) : nullptr;
+            entries.push_back({lis.src_id(i), lis.len(i), lis.timestamp(i), std::move(msg), lis.spill_off(i)});
+        }
+    };
+    snapshot(msg_list_[node_id], ck.history);
+    snapshot(delayed_msg_list_[node_id], ck.delayed);
+    ck.compacted = compacted_[node_id];
+}
+
+void ReplayManager::restore(NodeCheckpoint &ck)
+{
+    int node_id = ck.node_id;
+    std::unique_lock lock(node_mutex_[node_id]);
+    auto load = [this](History &lis, std::vector<NodeCheckpoint::Entry> &entries) {
+        for (auto &e : entries) {
+            append_history(lis, e.src_id, e.timestamp, e.msg);
+            resident_bytes_ += e.len;
+        }
+    };
+    load(msg_list_[node_id], ck.history);
+    load(delayed_msg_list_[node_id], ck.delayed);
+    compacted_[node_id] = std::move(ck.compacted);
+    // the daemon restarts from scratch: a node that was offline is restored
+    // as before, one that was online (a cut node) up to what it had consumed
+    restore_until_seq_[node_id] = std::max(ck.restore_until_seq, ck.replayed_seq);
+    replayed_seq_[node_id] = 0;
+    acked_seq_[node_id] = 0;
+    received_[node_id] = 0;
+    idle_seen_[node_id] = false;
+    if (spill_.is_open() && resident_bytes_.load(std::memory_order_relaxed) > spill_budget_) {
+        spill_history(node_id);
+    }
+}
+
+void ReplayManager::drop_src(int node_id, int src_id)
+{
+    std::unique_lock lock(node_mutex_[node_id]);
+    auto &lis = msg_list_[node_id];
+    for (size_t i = 0; i < lis.size(); ++i) {
+        if (!lis.resident(i)) {
+            unspill(node_id, i);
+        }
+    }
+    auto drop = [this, src_id](History &lis, size_t &until) {
+        History kept;
+        size_t n_until = 0;
+        for (size_t i = 0; i < lis.size(); ++i) {
+            if (lis.src_id(i) == src_id) {
+                resident_bytes_ -= lis.len(i);
+                continue;
+            }
+            kept.append(lis, i);
+            n_until += i < until;
+        }
+        until = n_until;
+        lis.swap(kept);
+    };
+    drop(msg_list_[node_id], restore_until_seq_[node_id]);
+    size_t n_delayed = delayed_msg_list_[node_id].size();
+    drop(delayed_msg_list_[node_id], n_delayed);
+}
+
+void ReplayManager::hold(int node_id)
+{
+    std::unique_lock lock(node_mutex_[node_id]);
+    restore_until_seq_[node_id] = replayed_seq_[node_id];
+}
+
+std::vector<int> ReplayManager::take_touched()
+{
+    std::vector<int> nodes;
+    for (size_t u = 0; u < touched_.size(); ++u) {
+        std::unique_lock lock(node_mutex_[u]);
+        if (touched_[u]) {
+            touched_[u] = false;
+            nodes.push_back(u);
+        }
+    }
+    return nodes;
+}
+
+void ReplayManager::add_msg(MessagePtr &msg, int src_id, int dst_id)
 {
     if (!local_nodes.test(dst_id)) {
         // send to remote host
         LOG("add_msg: %d => %d, send to remote\n", src_id, dst_id);
         int host_id = node2host[dst_id];
         auto* ch = remote_channels[host_id].get();
+        g_termination.on_payload_sent();
         ch->add_msg(msg);
         return;
     }
     std::unique_lock lock(node_mutex_[dst_id]);
     this->try_flush_delayed_msg(dst_id);
+    resident_bytes_ += msg->len();
     real_hdr_t *hdr = (real_hdr_t *)msg->data();
     int bgp_type = BGP_TYPE((real_pld_t *)msg->data() + 1);
+    if (stage == STAGE_CONVERGE) {
+        touched_[dst_id] = true;
+    }
     if (stage == STAGE_CONVERGE || bgp_type == BGP_KEEPALIVE || bgp_type == BGP_OPEN) {
-        msg_list_[dst_id].push_back({src_id, gettime_ns(), msg});
+        append_history(msg_list_[dst_id], src_id, gettime_ns(), msg);
         LOG("add_msg: %d => %d, type %s, size %d, seq = %ld\n",
             src_id, dst_id, msg_type_name[hdr->msg_type], hdr->msg_len, msg_list_[dst_id].size());
     } else {
-        delayed_msg_list_[dst_id].push_back({src_id, gettime_ns(), msg});
+        append_history(delayed_msg_list_[dst_id], src_id, gettime_ns(), msg);
         LOG("delayed add_msg: %d => %d, type %s, size %d\n",
             src_id, dst_id, msg_type_name[hdr->msg_type], hdr->msg_len);
     }
+    lock.unlock();
+    g_ready_nodes.mark(dst_id);
 }
 
 bool ReplayManager::node_replay_one_msg(int node_id)
@@ -79,6 +324,10 @@ bool ReplayManager::node_replay_one_msg(int node_id)
         LOG("replay_one_msg(%d) failed because it's already restored in STAGE_RESTORE\n", node_id);
         return false;
     }
+    if (window_ && replayed_seq_[node_id] - acked_seq_[node_id] >= (size_t)window_) {
+        LOG("replay_one_msg(%d) failed because its window is full, acked %ld\n", node_id, acked_seq_[node_id]);
+        return false;
+    }
 
     this->try_flush_delayed_msg(node_id);
     auto &lis = msg_list_[node_id];
@@ -90,15 +339,19 @@ bool ReplayManager::node_replay_one_msg(int node_id)
     }
     dbg_assert(seq < lis.size(), "node_id: %d, last_seq: %ld, siz: %d",
         node_id, seq, (int)lis.size());
-    auto &hist = lis[seq]; // seq starts from 1, use 0 as default value is fine
-    auto &msg = hist.msg;
+    if (!lis.resident(seq)) {
+        unspill(node_id, seq);
+    }
+    // seq starts from 1, use 0 as default value is fine
+    int src_id = lis.src_id(seq);
+    MessagePtr msg = lis.payload(seq, node_id);
 
-    auto ch = g_channel_manager.get(node_id, hist.src_id);
+    auto ch = g_channel_manager.get(node_id, src_id);
     if (!ch || (ch->state() != Channel::CHANNEL_ESTABLISHED && ch->state() != Channel::BGP_ESTABLISHED)) {
         LOG("replay_one_msg(%d) failed because it's offline\n", node_id);
         return false;
     }
-    dbg_assert(ch != nullptr, "invalid g_build_channel pointer at {%d, %d}\n", node_id, hist.src_id);
+    dbg_assert(ch != nullptr, "invalid g_build_channel pointer at {%d, %d}\n", node_id, src_id);
 
     // TODO: this asserts msg->data() conforms to align requirements of real_hdr_t, otherwise it's UB
     real_hdr_t *hdr = (real_hdr_t *)msg->data();
@@ -111,30 +364,144 @@ bool ReplayManager::node_replay_one_msg(int node_id)
             return false;
         }
     }
-    if (!ch->bgp_is_established() && bgp_type == BGP_KEEPALIVE) {
-        ch->on_bgp_established();
-    }
     if (stage == STAGE_CONVERGE) {
         // receiving a new message (i.e. replayed a message in CONVERGE stage)
         // is enough to mark it as busy, even if it don't send message
         has_new_msg_ = true;
     }
     hdr->seq = seq + 1;
-    ch->sendmsg(msg);
+    if (ch->worker() == tid) {
+        deliver(ch.get(), msg);
+    } else {
+        // a split hub, the channel belongs to another worker
+        post_send(ch->worker(), node_id, src_id, msg);
+    }
 
     seq++;
     LOG("replay_one_msg(%d), msg_list_len = %ld, src_id = %d, final seq = %ld\n",
-        node_id, msg_list_[node_id].size(), hist.src_id, seq);
+        node_id, msg_list_[node_id].size(), src_id, seq);
+    return true;
+}
+
+bool ReplayManager::node_replay(int node_id)
+{
+    int budget = std::max(window_, 1);
+    for (int i = 0; i < budget; ++i) {
+        if (!node_replay_one_msg(node_id)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ReplayManager::on_ack(int node_id, size_t seq)
+{
+    std::unique_lock lock(node_mutex_[node_id]);
+    // acks of a previous incarnation may still arrive after node_offline()
+    if (seq <= acked_seq_[node_id] || seq > replayed_seq_[node_id]) {
+        LOG("stale ack(%d, seq=%ld), acked %ld, replayed %ld\n",
+            node_id, seq, acked_seq_[node_id], replayed_seq_[node_id]);
+        return;
+    }
+    bool was_full = window_ && replayed_seq_[node_id] - acked_seq_[node_id] >= (size_t)window_;
+    acked_seq_[node_id] = seq;
+    lock.unlock();
+    if (was_full) {
+        g_ready_nodes.mark(node_id);
+    }
+}
+
+void ReplayManager::on_payload(int node_id)
+{
+    std::unique_lock lock(node_mutex_[node_id]);
+    received_[node_id]++;
+}
+
+void ReplayManager::on_idle(int node_id, size_t seq, size_t n_sent, long timeout_ns)
+{
+    bool timer = timeout_ns >= 0 && timeout_ns <= idle_timer_max_;
+    long until = timer ? gettime_ns() + timeout_ns : 0;
+    std::unique_lock lock(node_mutex_[node_id]);
+    idle_consumed_[node_id] = seq;
+    idle_sent_[node_id] = n_sent;
+    idle_seen_[node_id] = true;
+    idle_until_[node_id] = until;
+}
+
+bool ReplayManager::node_quiescent(int node_id)
+{
+    std::unique_lock lock(node_mutex_[node_id]);
+    size_t target;
+    if (stage == STAGE_RESTORE) {
+        target = restore_until_seq_[node_id];
+    } else {
+        if (!delayed_msg_list_[node_id].empty()) {
+            return false;
+        }
+        target = msg_list_[node_id].size();
+    }
+    return idle_seen_[node_id]
+        && gettime_ns() >= idle_until_[node_id]
+        && replayed_seq_[node_id] == target
+        && idle_consumed_[node_id] == replayed_seq_[node_id]
+        && idle_sent_[node_id] == received_[node_id];
+}
+
+bool ReplayManager::all_quiescent()
+{
+    for (auto u : glb_local_parts[iteration_idx]) {
+        if (!node_quiescent(u)) {
+            LOG("all_quiescent(): node %d is busy\n", u);
+            return false;
+        }
+    }
+    for (auto u : glb_local_cut) {
+        if (!node_quiescent(u)) {
+            LOG("all_quiescent(): node %d is busy\n", u);
+            return false;
+        }
+    }
     return true;
 }
 
+void ReplayManager::deliver(Channel *ch, MessagePtr &msg)
+{
+    u_char bgp_type = BGP_TYPE((real_pld_t *)msg->data() + 1);
+    if (!ch->bgp_is_established() && bgp_type == BGP_KEEPALIVE) {
+        ch->on_bgp_established();
+    }
+    ch->sendmsg(msg);
+}
+
+void ReplayManager::msg_load(std::vector<long> &load)
+{
+    load.assign(msg_list_.size(), 0);
+    for (size_t u = 0; u < msg_list_.size(); ++u) {
+        std::unique_lock lock(node_mutex_[u]);
+        auto &lis = msg_list_[u];
+        load[u] += lis.size();
+        for (size_t i = 0; i < lis.size(); ++i) {
+            load[lis.src_id(i)]++;
+        }
+        for (auto &[src_id, ts] : compacted_[u]) {
+            load[u]++;
+            load[src_id]++;
+        }
+    }
+}
+
 void ReplayManager::export_iolog()
 {
     std::ofstream iolog(logPath + "/io.log");
     std::vector<std::vector<long>> src_msg_list(n_nodes + 1);
-    for (auto &msgs : msg_list_) {
-        for (auto msg : msgs) {
-            src_msg_list[msg.src_id].push_back(msg.timestamp);
+    for (auto &lis : msg_list_) {
+        for (size_t i = 0; i < lis.size(); ++i) {
+            src_msg_list[lis.src_id(i)].push_back(lis.timestamp(i));
+        }
+    }
+    for (auto &msgs : compacted_) {
+        for (auto &[src_id, ts] : msgs) {
+            src_msg_list[src_id].push_back(ts);
         }
     }
     for (auto &lis : src_msg_list) {
@@ -2,6 +2,10 @@
 
 #include "const.hpp"
 #include "message.hpp"
+#include "spill_log.hpp"
+#include "msg_store.hpp"
+#include "history.hpp"
+#include "checkpoint.hpp"
 
 #include <vector>
 #include <queue>
@@ -12,47 +16,135 @@
 #include <mutex>
 #include <unordered_set>
 
+class Channel;
+
 class ReplayManager {
 public:
-    struct history_msg {
-        int src_id;
-        long timestamp;
-        std::shared_ptr<Message> msg;
-    };
     void init(int max_node_id) {
         has_new_msg_ = false;
         delayed_msg_list_.resize(max_node_id + 1);
         msg_list_.resize(max_node_id + 1);
         replayed_seq_.resize(max_node_id + 1);
         restore_until_seq_.resize(max_node_id + 1);
+        acked_seq_.resize(max_node_id + 1);
+        received_.resize(max_node_id + 1);
+        idle_consumed_.resize(max_node_id + 1);
+        idle_sent_.resize(max_node_id + 1);
+        idle_seen_.resize(max_node_id + 1);
+        idle_until_.resize(max_node_id + 1);
+        compacted_.resize(max_node_id + 1);
+        touched_.resize(max_node_id + 1);
+        node_mutex_.reset(new std::mutex[max_node_id + 1]);
     }
-    void add_msg(std::shared_ptr<Message> &msg, int src_id, int dst_id);
+    void add_msg(MessagePtr &msg, int src_id, int dst_id);
     bool has_new_msg() {
         return has_new_msg_;
     }
-    void node_offline(int node_id) {
-        std::unique_lock lock(node_mutex_[node_id]);
-        restore_until_seq_[node_id] = msg_list_[node_id].size();
-        replayed_seq_[node_id] = 0;
-    }
+    void node_offline(int node_id);
     // TODO: maybe we should wait for reactions after a replay,
     // otherwise the app may be not expecting the message yet.
     bool node_replay_one_msg(int node_id);
+    // replays while the node has credits, one message if there's no window;
+    // true if the last attempt succeeded
+    bool node_replay(int node_id);
+    // up to window unacknowledged messages per node, 0 disables REAL_ACK credits
+    void set_window(int window) {
+        window_ = window;
+    }
+    int window() const {
+        return window_;
+    }
+    // a daemon that blocks on a timer due within timeout_ns (coalescing,
+    // MRAI) is not idle yet, one due later is taken for a periodic one
+    void set_idle_timer_max(long timeout_ns) {
+        idle_timer_max_ = timeout_ns;
+    }
+    // drop what a restarted daemon doesn't need from its history before
+    // STAGE_RESTORE, see bgp_compact()
+    void set_compaction(bool on) {
+        compaction_ = on;
+    }
+    // spill the history of nodes going offline to path while the resident
+    // history exceeds budget bytes
+    void set_spill(const std::string &path, long budget) {
+        spill_.open(path);
+        spill_budget_ = budget;
+    }
+    // keep the BGP bytes of the history in a MessageStore, shared between
+    // destinations, instead of one message per REAL_PAYLOAD
+    void set_dedup(bool on) {
+        dedup_ = on;
+    }
+    // forget interned bytes the history dropped, main thread
+    void sweep_store();
+    // the replay state of node_id, payloads by reference, see Checkpoint
+    void checkpoint(int node_id, NodeCheckpoint &ck);
+    // replaces the state of ck.node_id with ck, its daemon starts from scratch
+    void restore(NodeCheckpoint &ck);
+    const SpillLog &spill_log() const {
+        return spill_;
+    }
+    // drops the messages from src_id out of the history of node_id, whose
+    // daemon is offline, when their link fails (see WhatIf)
+    void drop_src(int node_id, int src_id);
+    // node_id stays online into the next STAGE_RESTORE, it's restored as
+    // far as it got
+    void hold(int node_id);
+    // nodes that got a payload in STAGE_CONVERGE since the last call
+    std::vector<int> take_touched();
+    // the node's shim consumed every message up to seq
+    void on_ack(int node_id, size_t seq);
+    // a REAL_PAYLOAD written by the node's shim arrived
+    void on_payload(int node_id);
+    // the node's daemon went idle after consuming seq and sending n_sent
+    // payloads, with a timer due in timeout_ns (-1: none)
+    void on_idle(int node_id, size_t seq, size_t n_sent, long timeout_ns);
+    // true if every online node has nothing left to replay in this stage,
+    // consumed all it was sent, and went idle after its last payload arrived
+    bool all_quiescent();
     void new_iteration()
     {
         has_new_msg_ = false;
     }
     void export_iolog();
+    // messages replayed to and recorded from each node so far
+    void msg_load(std::vector<long> &load);
+    // send a replayed message on a channel of the calling worker
+    static void deliver(Channel *ch, MessagePtr &msg);
 private:
     /* per dst_node */
-    std::vector<std::vector<history_msg>> delayed_msg_list_;
-    std::vector<std::vector<history_msg>> msg_list_;
+    std::vector<History> delayed_msg_list_;
+    std::vector<History> msg_list_;
     std::vector<size_t> replayed_seq_;
     std::vector<size_t> restore_until_seq_;
+    std::vector<size_t> acked_seq_;
+    std::vector<size_t> received_;
+    std::vector<size_t> idle_consumed_;
+    std::vector<size_t> idle_sent_;
+    std::vector<char> idle_seen_;
+    // the node's daemon is busy until then, see set_idle_timer_max()
+    std::vector<long> idle_until_;
+    // (src_id, timestamp) of the messages compaction dropped, for the stats
+    std::vector<std::vector<std::pair<int, long>>> compacted_;
+    std::vector<char> touched_;
+    int window_ = 0;
+    long idle_timer_max_ = IDLE_TIMER_MAX;
+    bool compaction_ = false;
+    bool dedup_ = false;
+    MessageStore store_;
+    SpillLog spill_;
+    long spill_budget_ = 0;
+    // bytes of the messages held in msg_list_ and delayed_msg_list_
+    std::atomic<long> resident_bytes_{0};
     // std::vector<std::mutex> doesn't compile: std::mutex cannot be moved/copied around
-    std::array<std::mutex, MAX_CLIENTS> node_mutex_;
+    std::unique_ptr<std::mutex[]> node_mutex_;
     bool has_new_msg_;
     void try_flush_delayed_msg(int dst_id);
+    bool node_quiescent(int node_id);
+    void compact_history(int node_id);
+    void spill_history(int node_id);
+    void unspill(int node_id, size_t seq);
+    void append_history(History &lis, int src_id, long ts, MessagePtr &msg);
 };
 
 extern ReplayManager g_replay_mnger;
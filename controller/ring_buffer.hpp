@@ -1,13 +1,20 @@
 #pragma once
 
+#include "debug.hpp"
+
 #include <cstdint>
 #include <cstddef>
+#include <cstdio>
+#include <ctime>
 #include <vector>
 #include <utility>
+#include <bit>
+#include <algorithm>
 #include <cstring>
 #include <cerrno>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 
 constexpr int RINGBUFFER_IN_SIZ = (1 << 12);
 constexpr int RINGBUFFER_OUT_SIZ = (1 << 12);
@@ -136,6 +143,15 @@ public:
         return writev(fd, out, 2);
     }
 
+    // len readable bytes in place, or copied to scratch if they wrap around
+    const void* span(size_t len, void* scratch) const {
+        if (len > availableRead()) return nullptr;
+        size_t rmod = static_cast<size_t>(r_ % cap_);
+        if (cap_ - rmod >= len) return &buf_[rmod];
+        peek(scratch, len);
+        return scratch;
+    }
+
     void expand() {
         const size_t used = availableRead();
         size_t new_cap = cap_ * 2;
@@ -171,3 +187,135 @@ private:
     uint64_t             r_;   // monotonically increasing
     uint64_t             w_;   // monotonically increasing
 };
+
+/**
+ * RingBuffer with the same interface, backed by a memfd mapped twice back
+ * to back: byte i and byte i + cap_ are the same memory, so every readable
+ * or writable range is contiguous. Messages are parsed in place and copied
+ * out with one memcpy, and reads and writes on the fd take one syscall.
+ *
+ * The capacity is a power of two of at least a page. Each buffer costs two
+ * mappings, hence opt-in (MIRROR_RING=1): vm.max_map_count (65530 by
+ * default) runs out with tens of thousands of channels.
+ */
+class MirrorRingBuffer {
+public:
+    explicit MirrorRingBuffer(size_t capacity) : r_(0), w_(0) {
+        map(capacity);
+    }
+    ~MirrorRingBuffer() { unmap(); }
+    MirrorRingBuffer(const MirrorRingBuffer&) = delete;
+    MirrorRingBuffer& operator=(const MirrorRingBuffer&) = delete;
+
+    size_t capacity() const noexcept { return cap_; }
+
+    size_t availableRead()  const noexcept { return static_cast<size_t>(w_ - r_); }
+    size_t availableWrite() const noexcept { return cap_ - availableRead(); }
+
+    // availableRead() bytes start here
+    const uint8_t* readPtr() const noexcept { return base_ + (r_ & (cap_ - 1)); }
+    // availableWrite() bytes start here
+    uint8_t* writePtr() noexcept { return base_ + (w_ & (cap_ - 1)); }
+
+    size_t write(const void* src, size_t len) {
+        if (src == nullptr) return 0;
+        size_t to_write = std::min(len, availableWrite());
+        std::memcpy(writePtr(), src, to_write);
+        w_ += to_write;
+        return to_write;
+    }
+
+    bool put(const void* src, size_t len) {
+        if (len == 0) return true;
+        if (src == nullptr) return false;
+        if (availableWrite() < len) return false;
+        std::memcpy(writePtr(), src, len);
+        w_ += len;
+        return true;
+    }
+
+    ssize_t readFromFd(int fd) {
+        size_t n = availableWrite();
+        if (n == 0) { errno = EAGAIN; return -1; }
+        ssize_t r;
+        do { r = ::read(fd, writePtr(), n); } while (r == -1 && errno == EINTR);
+        if (r > 0) w_ += static_cast<size_t>(r);
+        return r;
+    }
+
+    bool peek(void* dst, size_t len) const {
+        if (len > availableRead() || dst == nullptr) return false;
+        std::memcpy(dst, readPtr(), len);
+        return true;
+    }
+
+    const void* span(size_t len, void* /* scratch */) const {
+        if (len > availableRead()) return nullptr;
+        return readPtr();
+    }
+
+    bool consume(size_t len) {
+        if (len > availableRead()) return false;
+        r_ += len;
+        return true;
+    }
+
+    bool get(void* dst, size_t len) {
+        if (!peek(dst, len)) return false;
+        return consume(len);
+    }
+
+    ssize_t writeToFd(int fd) const {
+        return ::write(fd, readPtr(), availableRead());
+    }
+
+    void expand() {
+        const size_t used = availableRead();
+        uint8_t* old_base = base_;
+        size_t old_cap = cap_;
+        const uint8_t* old_data = readPtr();
+        map(old_cap * 2);
+        std::memcpy(base_, old_data, used);
+        ::munmap(old_base, old_cap * 2);
+        r_ = 0;
+        w_ = used;
+    }
+
+private:
+    void map(size_t capacity) {
+        static const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        size_t cap = std::bit_ceil(std::max(capacity, page));
+        int fd = ::memfd_create("ring", MFD_CLOEXEC);
+        dbg_assert(fd >= 0, "memfd_create failed");
+        int r = ::ftruncate(fd, cap);
+        dbg_assert(r == 0, "ftruncate(%d, %zu) failed", fd, cap);
+        // reserve both halves, then map the file over each
+        void* p = ::mmap(nullptr, 2 * cap, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        dbg_assert(p != MAP_FAILED, "mmap(%zu) failed", 2 * cap);
+        uint8_t* base = static_cast<uint8_t*>(p);
+        for (int half = 0; half < 2; ++half) {
+            void* q = ::mmap(base + half * cap, cap, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0);
+            dbg_assert(q != MAP_FAILED, "mmap(memfd, %zu) failed, vm.max_map_count?", cap);
+        }
+        ::close(fd);
+        base_ = base;
+        cap_ = cap;
+    }
+    void unmap() {
+        if (base_) ::munmap(base_, 2 * cap_);
+        base_ = nullptr;
+    }
+
+    uint8_t*             base_ = nullptr;
+    size_t               cap_ = 0;
+    uint64_t             r_;   // monotonically increasing
+    uint64_t             w_;   // monotonically increasing
+};
+
+// byte stream buffer of the channels
+#ifdef MIRROR_RING
+using StreamBuffer = MirrorRingBuffer;
+#else
+using StreamBuffer = RingBuffer;
+#endif
@@ -0,0 +1,235 @@
+#pragma once
+
+#include "debug.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+/**
+ * Shared memory transport of a session (CTRL_SHM_TRANSPORT=1).
+ *
+ * The controller maps /opt/lwc/volumes/ripc/emu-real-<node>/shm_<peer>,
+ * the shim the same file as /ripc/emu-real-<node>/shm_<peer>. It holds one
+ * byte pipe per direction carrying exactly what the socket would, i.e.
+ * real_hdr_t framed messages. A producer copies in and bumps head, the
+ * consumer copies out and bumps tail, no syscall either way.
+ *
+ * The session's unix socket stays: it is what the worker's epoll and the
+ * daemon's ppoll() wait on, and it carries doorbells, single bytes with
+ * no meaning. A consumer that runs out of bytes sets rx_waiting before it
+ * sleeps and the producer only sends a doorbell if it finds the flag set,
+ * so a busy session sends none. Only the controller waits for room the
+ * same way (tx_waiting); the shim never holds a full pipe for long, the
+ * worker drains it as soon as it's rung.
+ *
+ * Keep in sync with preload/shm_pipe.h.
+ */
+
+constexpr uint64_t SHM_PIPE_MAGIC = 0x31455049504d4853; // "SHMPIPE1"
+constexpr uint32_t SHM_PIPE_SIZ = 1 << 16;              // bytes per direction, a power of 2
+
+struct shm_pipe {
+    alignas(64) std::atomic<uint64_t> head; // bytes written, by the producer
+    std::atomic<uint32_t> tx_waiting;       // the producer found the pipe full
+    alignas(64) std::atomic<uint64_t> tail; // bytes read, by the consumer
+    std::atomic<uint32_t> rx_waiting;       // the consumer sleeps on the doorbell
+};
+
+struct shm_session_hdr {
+    uint64_t magic;
+    uint32_t capacity;
+    int32_t node;
+    int32_t peer;
+    shm_pipe up;   // shim -> controller
+    shm_pipe down; // controller -> shim
+};
+
+constexpr size_t SHM_SESSION_MAPSIZ = sizeof(shm_session_hdr) + 2 * SHM_PIPE_SIZ;
+
+// copies up to n bytes in, returns how many fit
+inline size_t shm_pipe_put(shm_pipe *p, char *data, const void *buf, size_t n)
+{
+    uint64_t head = p->head.load(std::memory_order_relaxed);
+    n = std::min(n, (size_t)(SHM_PIPE_SIZ - (head - p->tail.load(std::memory_order_acquire))));
+    size_t off = head & (SHM_PIPE_SIZ - 1);
+    size_t first = std::min(n, SHM_PIPE_SIZ - off);
+    memcpy(data + off, buf, first);
+    memcpy(data, (const char *)buf + first, n - first);
+    p->head.store(head + n, std::memory_order_release);
+    return n;
+}
+
+// the readable bytes up to the end of the data, nullptr if there are none
+inline const char *shm_pipe_front(shm_pipe *p, const char *data, size_t *len)
+{
+    uint64_t tail = p->tail.load(std::memory_order_relaxed);
+    size_t n = p->head.load(std::memory_order_acquire) - tail;
+    if (n == 0) {
+        return nullptr;
+    }
+    size_t off = tail & (SHM_PIPE_SIZ - 1);
+    *len = std::min(n, SHM_PIPE_SIZ - off);
+    return data + off;
+}
+
+inline void shm_pipe_consume(shm_pipe *p, size_t n)
+{
+    p->tail.store(p->tail.load(std::memory_order_relaxed) + n, std::memory_order_release);
+}
+
+/**
+ * Before sleeping on the doorbell: false if bytes came in meanwhile, the
+ * consumer goes on reading instead. Pairs with shm_pipe_wake_rx(), one of
+ * the two sides sees the other's store.
+ */
+inline bool shm_pipe_arm_rx(shm_pipe *p)
+{
+    p->rx_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (p->head.load(std::memory_order_relaxed) != p->tail.load(std::memory_order_relaxed)) {
+        p->rx_waiting.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+// after a put: whether the consumer sleeps and needs a doorbell
+inline bool shm_pipe_wake_rx(shm_pipe *p)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return p->rx_waiting.load(std::memory_order_relaxed) && p->rx_waiting.exchange(0);
+}
+
+// same pair for a producer waiting for room
+inline bool shm_pipe_arm_tx(shm_pipe *p)
+{
+    p->tx_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (p->head.load(std::memory_order_relaxed) - p->tail.load(std::memory_order_relaxed) < SHM_PIPE_SIZ) {
+        p->tx_waiting.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+inline bool shm_pipe_wake_tx(shm_pipe *p)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return p->tx_waiting.load(std::memory_order_relaxed) && p->tx_waiting.exchange(0);
+}
+
+/**
+ * Controller end of a session's pipes. The worker owning the channel is
+ * the only thread touching it, so both pipes are single producer single
+ * consumer across the two processes.
+ */
+class ShmSession {
+public:
+    // a fresh session file, nullptr if it can't be set up
+    static std::unique_ptr<ShmSession> create(int node, int peer, int fd) {
+        char path[128];
+        snprintf(path, sizeof(path), "/opt/lwc/volumes/ripc/emu-real-%d/shm_%d", node, peer);
+        // a stale file may still be mapped by a daemon of the last session
+        unlink(path);
+        int shm_fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (shm_fd < 0) {
+            LOG("shm: open %s failed: %s\n", (const char *)path, strerror(errno));
+            return nullptr;
+        }
+        struct stat st;
+        void *addr = MAP_FAILED;
+        if (fchmod(shm_fd, 0666) == 0 && ftruncate(shm_fd, SHM_SESSION_MAPSIZ) == 0 && fstat(shm_fd, &st) == 0) {
+            addr = mmap(nullptr, SHM_SESSION_MAPSIZ, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        }
+        close(shm_fd);
+        if (addr == MAP_FAILED) {
+            LOG("shm: map %s failed: %s\n", (const char *)path, strerror(errno));
+            unlink(path);
+            return nullptr;
+        }
+        auto *hdr = (shm_session_hdr *)addr;
+        hdr->capacity = SHM_PIPE_SIZ;
+        hdr->node = node;
+        hdr->peer = peer;
+        // the worker sleeps in epoll until the shim's first message
+        hdr->up.rx_waiting.store(1, std::memory_order_relaxed);
+        __atomic_store_n(&hdr->magic, SHM_PIPE_MAGIC, __ATOMIC_RELEASE);
+        return std::unique_ptr<ShmSession>(new ShmSession(hdr, fd, path, st.st_ino));
+    }
+    ~ShmSession() {
+        munmap(hdr_, SHM_SESSION_MAPSIZ);
+        // the shim unlinks the file once it mapped it, unless it never did
+        struct stat st;
+        if (stat(path_, &st) == 0 && st.st_ino == ino_) {
+            unlink(path_);
+        }
+    }
+    ShmSession(const ShmSession &) = delete;
+    ShmSession &operator=(const ShmSession &) = delete;
+
+    // from the shim
+    bool readable() {
+        size_t len;
+        return shm_pipe_front(&hdr_->up, up_data(), &len) != nullptr;
+    }
+    const char *front(size_t *len) {
+        return shm_pipe_front(&hdr_->up, up_data(), len);
+    }
+    void consume(size_t n) {
+        shm_pipe_consume(&hdr_->up, n);
+    }
+    bool arm_rx() {
+        return shm_pipe_arm_rx(&hdr_->up);
+    }
+    // to the shim
+    size_t put(const void *buf, size_t n) {
+        return shm_pipe_put(&hdr_->down, down_data(), buf, n);
+    }
+    bool arm_tx() {
+        return shm_pipe_arm_tx(&hdr_->down);
+    }
+    // after puts, rings the shim if it sleeps
+    void wake_rx() {
+        if (shm_pipe_wake_rx(&hdr_->down)) {
+            ring();
+        }
+    }
+    // the socket is edge-triggered, doorbells are read until it would block
+    void drain_doorbells() {
+        char bells[64];
+        while (recv(fd_, bells, sizeof(bells), MSG_DONTWAIT) > 0) {
+        }
+    }
+private:
+    ShmSession(shm_session_hdr *hdr, int fd, const char *path, ino_t ino) : hdr_(hdr), fd_(fd), ino_(ino) {
+        snprintf(path_, sizeof(path_), "%s", path);
+    }
+    char *up_data() {
+        return (char *)(hdr_ + 1);
+    }
+    char *down_data() {
+        return (char *)(hdr_ + 1) + SHM_PIPE_SIZ;
+    }
+    void ring() {
+        char bell = 0;
+        // EAGAIN: the socket is full of doorbells already
+        (void)!send(fd_, &bell, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    shm_session_hdr *hdr_;
+    int fd_; // the session's socket, owned by the Channel
+    ino_t ino_;
+    char path_[128];
+};
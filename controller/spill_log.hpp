@@ -0,0 +1,94 @@
+#pragma once
+
+#include "debug.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+}
+
+/**
+ * Append-only file the replay history of offline nodes is spilled to.
+ *
+ * Appends come from node_offline() on the main thread, reads from the
+ * workers restoring a node, with pread so they don't share a file offset.
+ * A message is written once and keeps its extent, so spilling a node again
+ * only appends what arrived since. The file is unlinked right away and
+ * goes away with the controller.
+ */
+class SpillLog {
+public:
+    ~SpillLog() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+    void open(const std::string &path) {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        dbg_assert(fd_ >= 0, "open(%s) failed", path.c_str());
+        ::unlink(path.c_str());
+    }
+    bool is_open() const {
+        return fd_ >= 0;
+    }
+    // appends the iovecs, returns the offset they start at
+    long append(std::vector<struct iovec> iov) {
+        long off = end_;
+        for (size_t i = 0; i < iov.size();) {
+            int cnt = (int)std::min(iov.size() - i, (size_t)IOV_MAX);
+            ssize_t n = ::pwritev(fd_, &iov[i], cnt, end_);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            dbg_assert(n > 0, "pwritev(spill, offset %ld) failed", end_);
+            end_ += n;
+            advance(iov, i, n);
+        }
+        return off;
+    }
+    // fills the iovecs from off on
+    void read(long off, std::vector<struct iovec> iov) const {
+        for (size_t i = 0; i < iov.size();) {
+            int cnt = (int)std::min(iov.size() - i, (size_t)IOV_MAX);
+            ssize_t n = ::preadv(fd_, &iov[i], cnt, off);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            dbg_assert(n > 0, "preadv(spill, offset %ld) failed", off);
+            off += n;
+            advance(iov, i, n);
+        }
+    }
+    // [off, off + len) is read soon
+    void readahead(long off, size_t len) const {
+        ::posix_fadvise(fd_, off, len, POSIX_FADV_WILLNEED);
+    }
+    long size() const {
+        return end_;
+    }
+private:
+    int fd_ = -1;
+    long end_ = 0;
+
+    // skips n transferred bytes, iov[i] is the first one not done
+    static void advance(std::vector<struct iovec> &iov, size_t &i, size_t n) {
+        while (i < iov.size() && n >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            ++i;
+        }
+        if (n > 0) {
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
+};
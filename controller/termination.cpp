@@ -0,0 +1,109 @@
+#include "termination.hpp"
+#include "remote_channel.hpp"
+#include "cmd_queue.hpp"
+
+#include <array>
+#include <memory>
+
+extern Doorbell main_doorbell;
+extern std::array<std::unique_ptr<RemoteChannel>, MAX_HOSTS> remote_channels;
+
+Termination g_termination;
+
+void Termination::on_token(const real_token_t &tok)
+{
+    {
+        std::unique_lock lock(mailbox_mutex_);
+        mailbox_.push_back(tok);
+    }
+    main_doorbell.ring();
+}
+
+void Termination::send_next(int64_t count, bool black, bool decided)
+{
+    int next = (host_idx_ + 1) % nhosts_;
+    real_token_t tok{};
+    tok.hdr.msg_type = REAL_TOKEN;
+    tok.hdr.msg_len = sizeof(tok);
+    tok.hdr.seq = epoch_;
+    tok.count = count;
+    tok.black = black;
+    tok.decided = decided;
+    LOG("send token to host %d: epoch %ld, count %ld, black %d, decided %d\n",
+        next, epoch_, count, black, decided);
+    remote_channels[next]->send_token(tok);
+}
+
+bool Termination::finish()
+{
+    epoch_++;
+    wave_out_ = false;
+    holding_.reset();
+    return true;
+}
+
+bool Termination::poll(bool passive, bool count_payloads)
+{
+    if (nhosts_ == 1) {
+        return passive && finish();
+    }
+    {
+        std::unique_lock lock(mailbox_mutex_);
+        while (!mailbox_.empty()) {
+            real_token_t tok = mailbox_.front();
+            if (tok.hdr.seq > epoch_) {
+                // next stage's, tokens follow the decided one on each link
+                break;
+            }
+            mailbox_.pop_front();
+            if (tok.hdr.seq < epoch_) {
+                continue;
+            }
+            if (tok.decided) {
+                lock.unlock();
+                if ((host_idx_ + 1) % nhosts_ != 0) {
+                    send_next(0, false, true);
+                }
+                return finish();
+            }
+            holding_ = tok;
+        }
+    }
+    if (!passive) {
+        return false;
+    }
+    // the color is taken before the count, a payload received in between
+    // is either counted or blackens the next wave
+    auto local_count = [&]() -> long {
+        if (!count_payloads) {
+            return 0;
+        }
+        return sent_.load(std::memory_order_acquire) - received_.load(std::memory_order_acquire);
+    };
+    if (host_idx_ != 0) {
+        if (holding_) {
+            bool black = count_payloads && black_.exchange(false, std::memory_order_acq_rel);
+            send_next(holding_->count + local_count(), holding_->black || black, false);
+            holding_.reset();
+        }
+        return false;
+    }
+    if (wave_out_ && !holding_) {
+        return false;
+    }
+    if (holding_) {
+        bool black = holding_->black || (count_payloads && black_.load(std::memory_order_acquire));
+        if (!black && holding_->count + local_count() == 0) {
+            send_next(0, false, true);
+            return finish();
+        }
+        holding_.reset();
+    }
+    // a new wave, this host is white from here on
+    if (count_payloads) {
+        black_.store(false, std::memory_order_release);
+    }
+    send_next(0, false, false);
+    wave_out_ = true;
+    return false;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "const.hpp"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+/**
+ * Stage termination across hosts, Safra style: a token circulates on the
+ * ring of hosts 0 -> 1 -> ... -> nhosts-1 -> 0 over the remote channels.
+ *
+ * Every host counts the REAL_PAYLOADs it sent to and received from other
+ * hosts, and turns black when it receives one. A host holds the token
+ * until it is locally idle, then adds its sent - received count, blackens
+ * the token if it is black itself, turns white and passes it on. Host 0
+ * starts a wave whenever it is idle and has no token out; a wave that
+ * comes back white with a total count of 0 proves that all hosts are idle
+ * and no payload is in flight. Host 0 then sends a decided token once
+ * around the ring, and every host ends the stage when it sees it.
+ *
+ * That costs nhosts tokens per wave and nothing while a host is busy.
+ * Stages that end on a latched local condition (BUILDUP, TEARDOWN) don't
+ * count payloads, so their first wave is the barrier.
+ *
+ * The tokens of a stage carry its epoch in hdr.seq; every host goes
+ * through the same stages, so the epochs agree and a late token of an
+ * earlier stage is dropped.
+ */
+class Termination {
+public:
+    void init(int nhosts, int host_idx) {
+        nhosts_ = nhosts;
+        host_idx_ = host_idx;
+    }
+    // REAL_PAYLOAD queued to another host, any thread
+    void on_payload_sent() {
+        sent_.fetch_add(1, std::memory_order_relaxed);
+    }
+    // REAL_PAYLOAD received from another host, any thread
+    void on_payload_received() {
+        received_.fetch_add(1, std::memory_order_relaxed);
+        black_.store(true, std::memory_order_release);
+    }
+    // REAL_TOKEN received by a remote worker, handled by the main thread
+    void on_token(const real_token_t &tok);
+    /**
+     * Main thread, from stage_transition(): passive tells if this host is
+     * locally done with the stage right now, count_payloads if payloads in
+     * flight keep the stage going. Returns true once, when every host is
+     * done, and moves on to the next stage's epoch.
+     */
+    bool poll(bool passive, bool count_payloads);
+private:
+    int nhosts_ = 1;
+    int host_idx_ = 0;
+    std::atomic<long> sent_{0};
+    std::atomic<long> received_{0};
+    std::atomic<bool> black_{false};
+    std::mutex mailbox_mutex_;
+    std::deque<real_token_t> mailbox_;
+    // main thread only
+    int64_t epoch_ = 0;
+    bool wave_out_ = false;
+    std::optional<real_token_t> holding_;
+
+    void send_next(int64_t count, bool black, bool decided);
+    bool finish();
+};
+
+extern Termination g_termination;
@@ -0,0 +1,137 @@
+#include "trace.hpp"
+#include "debug.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+/**
+ * Owns the rings and drains them. The rings live until the process exits,
+ * so a thread that's done can still be flushed.
+ */
+class TraceFlusher {
+public:
+    ~TraceFlusher() {
+        {
+            std::unique_lock lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_one();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        flush();
+    }
+    void add(TraceRing *ring) {
+        std::unique_lock flush_lock(flush_mutex_);
+        // threads that don't set tid share 0, their files get a suffix
+        int n_same = 0;
+        for (auto &out : outputs_) {
+            n_same += out.ring->tid_ == ring->tid_;
+        }
+        Output &out = outputs_.emplace_back();
+        out.ring = ring;
+        out.path = n_same ? std::format("{}/ctrl/T{}-{}.trace", logPath, ring->tid_, n_same)
+                          : std::format("{}/ctrl/T{}.trace", logPath, ring->tid_);
+        flush_lock.unlock();
+        std::unique_lock lock(mutex_);
+        if (!thread_.joinable()) {
+            thread_ = std::thread([this]() {
+                run();
+            });
+        }
+    }
+    void flush() {
+        std::unique_lock lock(flush_mutex_);
+        for (auto &out : outputs_) {
+            drain(out, out.ring);
+        }
+    }
+private:
+    struct Output {
+        TraceRing *ring;
+        std::string path;
+        FILE *file = nullptr;
+        std::unordered_set<const char *> formats;
+        long dropped = 0;
+    };
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::thread thread_;
+    std::mutex flush_mutex_;
+    std::deque<Output> outputs_;
+
+    void run() {
+        std::unique_lock lock(mutex_);
+        while (!stop_) {
+            cv_.wait_for(lock, std::chrono::milliseconds(TRACE_FLUSH_MS));
+            lock.unlock();
+            flush();
+            lock.lock();
+        }
+    }
+
+    void drain(Output &out, TraceRing *ring) {
+        uint64_t tail = ring->tail_.load(std::memory_order_relaxed);
+        uint64_t head = ring->head_.load(std::memory_order_acquire);
+        if (tail == head) {
+            return;
+        }
+        if (out.file == nullptr) {
+            out.file = fopen(out.path.c_str(), "w");
+            if (out.file == nullptr) {
+                // nowhere to go, keep the producer running
+                ring->tail_.store(head, std::memory_order_release);
+                return;
+            }
+        }
+        while (tail != head) {
+            auto *hdr = (TraceHdr *)(ring->buf_ + (tail & (TRACE_RING_SIZE - 1)));
+            if (hdr->kind == TRACE_EVENT) {
+                if (out.formats.insert(hdr->fmt).second) {
+                    write_format(out.file, hdr->fmt);
+                }
+                fwrite(hdr, 1, hdr->len, out.file);
+            }
+            tail += hdr->len;
+        }
+        ring->tail_.store(tail, std::memory_order_release);
+        long dropped = ring->dropped_.load(std::memory_order_relaxed);
+        if (dropped != out.dropped) {
+            out.dropped = dropped;
+            TraceHdr note = {sizeof(TraceHdr), TRACE_DROPPED, 0, 0, nullptr, dropped};
+            fwrite(&note, 1, sizeof(note), out.file);
+        }
+        fflush(out.file);
+    }
+
+    static void write_format(FILE *file, const char *fmt) {
+        size_t n = strlen(fmt) + 1;
+        size_t padded = (n + 7) & ~(size_t)7;
+        TraceHdr def = {(uint32_t)(sizeof(TraceHdr) + padded), TRACE_FORMAT, 0, 0, fmt, 0};
+        static const char zeros[8] = {};
+        fwrite(&def, 1, sizeof(def), file);
+        fwrite(fmt, 1, n, file);
+        fwrite(zeros, 1, padded - n, file);
+    }
+};
+
+static TraceFlusher flusher;
+
+TraceRing *TraceRing::create()
+{
+    auto *ring = new TraceRing;
+    ring->tid_ = tid;
+    flusher.add(ring);
+    return ring;
+}
+
+void trace_flush()
+{
+    flusher.flush();
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+extern "C" {
+#include <time.h>
+}
+
+/**
+ * Binary trace behind LOG() when built with TRACE=1.
+ *
+ * A LOG() call only copies its format string pointer, a timestamp and its
+ * arguments into a ring of the calling thread: integers and pointers as 64
+ * bits, doubles as their bits, strings truncated to TRACE_STR_MAX bytes.
+ * Nothing is formatted and nothing blocks; a full ring drops the record
+ * and counts it. A background thread drains the rings every
+ * TRACE_FLUSH_MS into logPath/ctrl/T<tid>.trace, together with each
+ * format string the first time a file sees it, and trace_decode turns
+ * such a file back into the text LOG() used to write.
+ *
+ * Record layout, 8-byte aligned: TraceHdr, then one 8-byte slot per
+ * argument; a string's slot holds its length and its bytes follow.
+ */
+struct TraceHdr {
+    uint32_t len;    // of the whole record
+    uint8_t kind;    // TRACE_EVENT, TRACE_FORMAT or TRACE_PAD
+    uint8_t nargs;
+    uint16_t types;  // 2 bits per argument, TRACE_ARG_*
+    const char *fmt;
+    int64_t ts;      // CLOCK_MONOTONIC, ns
+};
+
+enum : uint8_t {
+    TRACE_EVENT = 1,
+    TRACE_FORMAT = 2, // in files only: fmt is defined by the len - sizeof(TraceHdr) bytes that follow
+    TRACE_PAD = 3,    // in rings only: skip to the start of the ring
+    TRACE_DROPPED = 4, // in files only: ts is the number of records dropped so far
+};
+
+enum : uint16_t {
+    TRACE_ARG_INT = 0,
+    TRACE_ARG_DOUBLE = 1,
+    TRACE_ARG_STR = 2,
+};
+
+constexpr int TRACE_MAX_ARGS = 8;
+constexpr size_t TRACE_STR_MAX = 64;
+constexpr size_t TRACE_RING_SIZE = 4 << 20;
+constexpr int TRACE_FLUSH_MS = 10;
+
+class TraceRing {
+public:
+    // room for len bytes, nullptr if the ring is full
+    uint8_t *reserve(size_t len) {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        uint64_t tail = tail_.load(std::memory_order_acquire);
+        size_t off = head & (TRACE_RING_SIZE - 1);
+        size_t pad = TRACE_RING_SIZE - off < len ? TRACE_RING_SIZE - off : 0;
+        if (head + pad + len - tail > TRACE_RING_SIZE) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        if (pad) {
+            auto *hdr = (TraceHdr *)(buf_ + off);
+            hdr->len = pad;
+            hdr->kind = TRACE_PAD;
+            head_.store(head + pad, std::memory_order_release);
+            off = 0;
+        }
+        return buf_ + off;
+    }
+    void commit(size_t len) {
+        head_.store(head_.load(std::memory_order_relaxed) + len, std::memory_order_release);
+    }
+
+    // the calling thread's ring, registered on first use
+    static TraceRing *local() {
+        thread_local TraceRing *ring = create();
+        return ring;
+    }
+private:
+    friend class TraceFlusher;
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
+    std::atomic<long> dropped_{0};
+    int tid_;
+    uint8_t buf_[TRACE_RING_SIZE];
+
+    static TraceRing *create();
+};
+
+// drains every ring now, from any thread, e.g. before abort()
+void trace_flush();
+
+namespace trace_detail {
+
+template <typename T>
+constexpr bool is_str = std::is_same_v<std::decay_t<T>, char *> || std::is_same_v<std::decay_t<T>, const char *>;
+
+template <typename T>
+inline size_t arg_size(const T &arg)
+{
+    if constexpr (is_str<T>) {
+        size_t n = arg ? strnlen(arg, TRACE_STR_MAX) : 0;
+        return 8 + ((n + 7) & ~(size_t)7);
+    } else {
+        return 8;
+    }
+}
+
+template <typename T>
+inline uint8_t *put_arg(uint8_t *p, uint16_t &types, int i, const T &arg)
+{
+    if constexpr (is_str<T>) {
+        uint64_t n = arg ? strnlen(arg, TRACE_STR_MAX) : 0;
+        memcpy(p, &n, 8);
+        memcpy(p + 8, arg, n);
+        types |= TRACE_ARG_STR << (2 * i);
+        return p + 8 + ((n + 7) & ~(uint64_t)7);
+    } else if constexpr (std::is_floating_point_v<T>) {
+        double v = arg;
+        memcpy(p, &v, 8);
+        types |= TRACE_ARG_DOUBLE << (2 * i);
+        return p + 8;
+    } else if constexpr (std::is_pointer_v<T>) {
+        uint64_t v = (uintptr_t)arg;
+        memcpy(p, &v, 8);
+        return p + 8;
+    } else {
+        int64_t v = (int64_t)arg;
+        memcpy(p, &v, 8);
+        return p + 8;
+    }
+}
+
+} // namespace trace_detail
+
+template <typename... Args>
+inline void trace_event(const char *fmt, const Args &...args)
+{
+    static_assert(sizeof...(Args) <= TRACE_MAX_ARGS, "too many LOG() arguments to trace");
+    size_t len = sizeof(TraceHdr) + (0 + ... + trace_detail::arg_size(args));
+    TraceRing *ring = TraceRing::local();
+    uint8_t *p = ring->reserve(len);
+    if (p == nullptr) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    auto *hdr = (TraceHdr *)p;
+    hdr->len = len;
+    hdr->kind = TRACE_EVENT;
+    hdr->nargs = sizeof...(Args);
+    hdr->types = 0;
+    hdr->fmt = fmt;
+    hdr->ts = ts.tv_sec * 1'000'000'000L + ts.tv_nsec;
+    uint8_t *q = p + sizeof(TraceHdr);
+    int i = 0;
+    ((q = trace_detail::put_arg(q, hdr->types, i++, args)), ...);
+    ring->commit(q - p);
+}
@@ -0,0 +1,119 @@
+/**
+ * Turns a controller trace (see trace.hpp) back into the text LOG() writes
+ * without TRACE=1:
+ *     ./trace_decode <logPath>/ctrl/T3.trace > T3.log
+ */
+#include "trace.hpp"
+
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// one conversion of fmt at i, with the argument, appended to out
+static size_t format_one(const std::string &fmt, size_t i, const uint8_t *&arg, int type, std::string &out)
+{
+    size_t j = i + 1;
+    while (j < fmt.size() && strchr("-+ #0123456789.", fmt[j])) {
+        j++;
+    }
+    std::string spec = fmt.substr(i, j - i);
+    while (j < fmt.size() && strchr("hlqjzt", fmt[j])) {
+        j++;
+    }
+    char conv = j < fmt.size() ? fmt[j] : 'd';
+    char buf[256];
+    if (type == TRACE_ARG_STR) {
+        uint64_t n;
+        memcpy(&n, arg, 8);
+        std::string s((const char *)arg + 8, n);
+        arg += 8 + ((n + 7) & ~(uint64_t)7);
+        snprintf(buf, sizeof(buf), (spec + "s").c_str(), s.c_str());
+    } else if (type == TRACE_ARG_DOUBLE) {
+        double v;
+        memcpy(&v, arg, 8);
+        arg += 8;
+        snprintf(buf, sizeof(buf), (spec + conv).c_str(), v);
+    } else {
+        long long v;
+        memcpy(&v, arg, 8);
+        arg += 8;
+        if (conv == 'c') {
+            snprintf(buf, sizeof(buf), (spec + "c").c_str(), (int)v);
+        } else if (conv == 'p') {
+            snprintf(buf, sizeof(buf), (spec + "p").c_str(), (void *)v);
+        } else {
+            snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(), v);
+        }
+    }
+    out += buf;
+    return j + 1;
+}
+
+static std::string format(const std::string &fmt, const TraceHdr *hdr)
+{
+    std::string out;
+    const uint8_t *arg = (const uint8_t *)(hdr + 1);
+    int n = 0;
+    for (size_t i = 0; i < fmt.size();) {
+        if (fmt[i] != '%') {
+            out += fmt[i++];
+        } else if (i + 1 < fmt.size() && fmt[i + 1] == '%') {
+            out += '%';
+            i += 2;
+        } else if (n < hdr->nargs) {
+            i = format_one(fmt, i, arg, (hdr->types >> (2 * n)) & 3, out);
+            n++;
+        } else {
+            out += fmt[i++];
+        }
+    }
+    return out;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "r");
+    if (f == nullptr) {
+        perror(argv[1]);
+        return 1;
+    }
+    std::unordered_map<const char *, std::string> formats;
+    std::vector<uint8_t> rec;
+    TraceHdr hdr;
+    while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+        if (hdr.len < sizeof(hdr)) {
+            fprintf(stderr, "%s: corrupt record\n", argv[1]);
+            return 1;
+        }
+        rec.resize(hdr.len);
+        memcpy(rec.data(), &hdr, sizeof(hdr));
+        if (fread(rec.data() + sizeof(hdr), 1, hdr.len - sizeof(hdr), f) != hdr.len - sizeof(hdr)) {
+            fprintf(stderr, "%s: truncated record\n", argv[1]);
+            break;
+        }
+        switch (hdr.kind) {
+        case TRACE_FORMAT:
+            formats[hdr.fmt] = (const char *)rec.data() + sizeof(hdr);
+            break;
+        case TRACE_EVENT: {
+            auto it = formats.find(hdr.fmt);
+            std::string text = it == formats.end() ? "<unknown format>\n" : format(it->second, (TraceHdr *)rec.data());
+            printf("%018ld: %s", hdr.ts / 1000, text.c_str());
+            break;
+        }
+        case TRACE_DROPPED:
+            printf("# %ld records dropped so far\n", hdr.ts);
+            break;
+        default:
+            fprintf(stderr, "%s: unknown record kind %d\n", argv[1], hdr.kind);
+            return 1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,297 @@
+#ifdef IO_URING
+
+#include "uring.hpp"
+#include "channel.hpp"
+#include "channel_manager.hpp"
+
+#include <climits>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+extern "C" {
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+}
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool UringLoop::init(unsigned entries, unsigned nbufs, unsigned bufsiz)
+{
+    struct io_uring_params p = {};
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * 4;
+    ring_fd_ = io_uring_setup(entries, &p);
+    if (ring_fd_ < 0 && errno == EINVAL) {
+        // kernel older than 6.1
+        p = {};
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        ring_fd_ = io_uring_setup(entries, &p);
+    }
+    if (ring_fd_ < 0) {
+        LOG("io_uring_setup failed: %s\n", strerror(errno));
+        return false;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        LOG("io_uring lacks IORING_FEAT_EXT_ARG\n");
+        return false;
+    }
+
+    sq_sz_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_sz_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_sz_ = cq_sz_ = std::max(sq_sz_, cq_sz_);
+    }
+    sq_ptr_ = mmap(nullptr, sq_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+        sq_ptr_ = nullptr;
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr_ = sq_ptr_;
+    } else {
+        cq_ptr_ = mmap(nullptr, cq_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ptr_ == MAP_FAILED) {
+            cq_ptr_ = nullptr;
+            return false;
+        }
+    }
+    sqes_sz_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, sqes_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    sq_.sqes = (struct io_uring_sqe *)sqes;
+    char *sq = (char *)sq_ptr_, *cq = (char *)cq_ptr_;
+    sq_.head = (unsigned *)(sq + p.sq_off.head);
+    sq_.tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_.mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sq_.array = (unsigned *)(sq + p.sq_off.array);
+    cq_.head = (unsigned *)(cq + p.cq_off.head);
+    cq_.tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_.mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cq_.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    // identity mapping, sqe i always sits in slot i
+    for (unsigned i = 0; i < p.sq_entries; ++i) {
+        sq_.array[i] = i;
+    }
+    sq_tail_ = *sq_.tail;
+
+    // registered buffer ring for multishot recv, nbufs is a power of two
+    nbufs_ = nbufs;
+    bufsiz_ = bufsiz;
+    br_sz_ = nbufs * sizeof(struct io_uring_buf);
+    void *br = mmap(nullptr, br_sz_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (br == MAP_FAILED) {
+        return false;
+    }
+    br_ = (struct io_uring_buf *)br;
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)br_;
+    reg.ring_entries = nbufs;
+    reg.bgid = BGID;
+    if (io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        LOG("IORING_REGISTER_PBUF_RING failed: %s\n", strerror(errno));
+        return false;
+    }
+    bufs_.reset(new char[(size_t)nbufs * bufsiz]);
+    for (unsigned bid = 0; bid < nbufs; ++bid) {
+        recycle_buf(bid);
+    }
+    return true;
+}
+
+UringLoop::~UringLoop()
+{
+    // dropping the ring cancels whatever is still in flight
+    retired_.clear();
+    if (br_) {
+        munmap(br_, br_sz_);
+    }
+    if (sq_.sqes) {
+        munmap(sq_.sqes, sqes_sz_);
+    }
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_) {
+        munmap(cq_ptr_, cq_sz_);
+    }
+    if (sq_ptr_) {
+        munmap(sq_ptr_, sq_sz_);
+    }
+    if (ring_fd_ >= 0) {
+        close(ring_fd_);
+    }
+}
+
+struct io_uring_sqe *UringLoop::get_sqe()
+{
+    unsigned head = __atomic_load_n(sq_.head, __ATOMIC_ACQUIRE);
+    if (sq_tail_ - head > *sq_.mask) {
+        // SQ full, hand what we have to the kernel first
+        int r = io_uring_enter(ring_fd_, to_submit_, 0, 0, nullptr, 0);
+        dbg_assert(r >= 0, "io_uring_enter(submit) failed");
+        to_submit_ = 0;
+        head = __atomic_load_n(sq_.head, __ATOMIC_ACQUIRE);
+        dbg_assert(sq_tail_ - head <= *sq_.mask, "SQ still full after submit");
+    }
+    struct io_uring_sqe *sqe = &sq_.sqes[sq_tail_ & *sq_.mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_tail_++;
+    to_submit_++;
+    __atomic_store_n(sq_.tail, sq_tail_, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+void UringLoop::recycle_buf(int bid)
+{
+    struct io_uring_buf *buf = &br_[br_tail_ & (nbufs_ - 1)];
+    buf->addr = (uint64_t)(bufs_.get() + (size_t)bid * bufsiz_);
+    buf->len = bufsiz_;
+    buf->bid = bid;
+    br_tail_++;
+    // the tail overlays bufs[0].resv
+    __atomic_store_n(&br_[0].resv, br_tail_, __ATOMIC_RELEASE);
+}
+
+void UringLoop::arm_ctrl(int ctrl_fd)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ctrl_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = tag(nullptr, OP_CTRL);
+}
+
+void UringLoop::arm_connect(Channel *ch)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ch->fd_;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = tag(ch, OP_CONNECT);
+    ch->uring_ops_++;
+}
+
+void UringLoop::arm_recv(Channel *ch)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = ch->fd_;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    sqe->user_data = tag(ch, OP_RECV);
+    ch->uring_ops_++;
+}
+
+void UringLoop::want_send(Channel *ch)
+{
+    if (ch->send_listed_) {
+        return;
+    }
+    ch->send_listed_ = true;
+    send_list_.push_back(ch);
+}
+
+void UringLoop::prep_send(Channel *ch)
+{
+    ch->send_listed_ = false;
+    if (ch->send_inflight_ || ch->pending_out_msgs_.empty() || is_retired(ch)) {
+        // on_sent() lists it again once the writev in flight is done
+        return;
+    }
+    ch->uring_iov_.resize(std::min<size_t>(ch->pending_out_msgs_.size(), IOV_MAX));
+    int iovcnt = ch->fill_iov(ch->uring_iov_.data(), ch->uring_iov_.size());
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = ch->fd_;
+    sqe->addr = (uint64_t)ch->uring_iov_.data();
+    sqe->len = iovcnt;
+    sqe->user_data = tag(ch, OP_SEND);
+    ch->send_inflight_ = true;
+    ch->uring_ops_++;
+}
+
+void UringLoop::retire(Channel *channel)
+{
+    auto ch = g_channel_manager.release(channel);
+    if (!ch) {
+        return;
+    }
+    if (ch->send_listed_) {
+        std::erase(send_list_, ch.get());
+        ch->send_listed_ = false;
+    }
+    if (ch->uring_ops_ == 0) {
+        return;
+    }
+    for (Op op : {OP_CONNECT, OP_RECV, OP_SEND}) {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = tag(ch.get(), op);
+        sqe->user_data = tag(nullptr, OP_CANCEL);
+    }
+    retired_[ch.get()] = ch;
+}
+
+int UringLoop::submit_and_wait(int timeout_ms)
+{
+    for (size_t i = 0; i < send_list_.size(); ++i) {
+        prep_send(send_list_[i]);
+    }
+    send_list_.clear();
+
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1'000'000L,
+    };
+    struct io_uring_getevents_arg arg = {};
+    arg.ts = (uint64_t)&ts;
+    int r = io_uring_enter(ring_fd_, to_submit_, 1,
+        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    // submissions are consumed even if the wait times out
+    to_submit_ = sq_tail_ - __atomic_load_n(sq_.head, __ATOMIC_ACQUIRE);
+    if (r < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY)) {
+        r = 0;
+    }
+    return r;
+}
+
+void UringLoop::complete(const struct io_uring_cqe *cqe)
+{
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        recycle_buf(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    Op op = op_of(cqe);
+    if (op == OP_CTRL || op == OP_CANCEL || (cqe->flags & IORING_CQE_F_MORE)) {
+        return;
+    }
+    Channel *ch = channel_of(cqe);
+    ch->uring_ops_--;
+    if (op == OP_SEND) {
+        ch->send_inflight_ = false;
+    }
+    if (ch->uring_ops_ == 0) {
+        // last reference, closes the fd
+        retired_.erase(ch);
+    }
+}
+
+#endif // IO_URING
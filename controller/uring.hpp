@@ -0,0 +1,122 @@
+#pragma once
+
+#ifdef IO_URING
+
+#include "debug.hpp"
+
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+extern "C" {
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+}
+
+class Channel;
+
+/**
+ * io_uring backend of a worker thread, driven by worker_main_uring().
+ *
+ * Talks to the kernel with raw syscalls (liburing is not required).
+ * Each channel gets one multishot recv fed from a registered buffer ring,
+ * and at most one writev in flight that gathers all its pending messages,
+ * so the per-message epoll_wait/read/writev/epoll_ctl sequence collapses
+ * into one io_uring_enter() per loop iteration.
+ *
+ * The user_data of every request is the Channel pointer tagged with the
+ * operation in its low bits. A channel torn down with requests still in
+ * flight is retired here until their last completion arrives, only then
+ * is it destroyed and its fd closed.
+ */
+class UringLoop {
+public:
+    enum Op {
+        OP_CTRL = 0,    // multishot poll on the ctrl pipe
+        OP_CONNECT = 1, // POLLOUT of a controller connect() in progress
+        OP_RECV = 2,    // multishot recv
+        OP_SEND = 3,    // gathered writev
+        OP_CANCEL = 4,
+    };
+
+    UringLoop() = default;
+    ~UringLoop();
+    // false if io_uring is unavailable (old kernel, seccomp, sysctl)
+    bool init(unsigned entries, unsigned nbufs, unsigned bufsiz);
+
+    void arm_ctrl(int ctrl_fd);
+    void arm_connect(Channel *ch);
+    void arm_recv(Channel *ch);
+    // queue ch for a writev on the next flush()
+    void want_send(Channel *ch);
+    // take ch out of the channel table, cancel its requests and keep it
+    // alive until they complete
+    void retire(Channel *ch);
+
+    // issue pending sends, submit and wait up to timeout_ms for completions
+    int submit_and_wait(int timeout_ms);
+    template <class F>
+    void for_each_cqe(F &&handle) {
+        unsigned head = *cq_.head;
+        unsigned tail = __atomic_load_n(cq_.tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &cq_.cqes[head & *cq_.mask];
+            handle(cqe);
+            complete(cqe);
+        }
+        __atomic_store_n(cq_.head, head, __ATOMIC_RELEASE);
+    }
+
+    static Op op_of(const struct io_uring_cqe *cqe) {
+        return (Op)(cqe->user_data & OP_MASK);
+    }
+    static Channel *channel_of(const struct io_uring_cqe *cqe) {
+        return (Channel *)(cqe->user_data & ~OP_MASK);
+    }
+    bool is_retired(Channel *ch) {
+        return retired_.count(ch) > 0;
+    }
+    // payload of a recv completion, valid until the cqe is consumed
+    const void *recv_buf(const struct io_uring_cqe *cqe) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        return bufs_.get() + (size_t)bid * bufsiz_;
+    }
+
+private:
+    static constexpr uint64_t OP_MASK = 7;
+    static constexpr int BGID = 0;
+
+    struct {
+        unsigned *head, *tail, *mask, *array;
+        struct io_uring_sqe *sqes;
+    } sq_ = {};
+    struct {
+        unsigned *head, *tail, *mask;
+        struct io_uring_cqe *cqes;
+    } cq_ = {};
+    int ring_fd_ = -1;
+    void *sq_ptr_ = nullptr, *cq_ptr_ = nullptr;
+    size_t sq_sz_ = 0, cq_sz_ = 0, sqes_sz_ = 0;
+    unsigned sq_tail_ = 0, to_submit_ = 0;
+
+    // provided buffers for multishot recv
+    struct io_uring_buf *br_ = nullptr;
+    size_t br_sz_ = 0;
+    unsigned nbufs_ = 0, bufsiz_ = 0;
+    uint16_t br_tail_ = 0;
+    std::unique_ptr<char[]> bufs_;
+
+    std::vector<Channel *> send_list_;
+    std::unordered_map<Channel *, std::shared_ptr<Channel>> retired_;
+
+    struct io_uring_sqe *get_sqe();
+    void prep_send(Channel *ch);
+    void recycle_buf(int bid);
+    void complete(const struct io_uring_cqe *cqe);
+    static uint64_t tag(Channel *ch, Op op) {
+        return (uint64_t)ch | op;
+    }
+};
+
+#endif // IO_URING
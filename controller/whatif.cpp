@@ -0,0 +1,69 @@
+#include "whatif.hpp"
+#include "debug.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+WhatIf g_whatif;
+
+void WhatIf::load(const std::string &path, int n_nodes)
+{
+    std::ifstream delta(path);
+    dbg_assert(delta.is_open(), "what-if: cannot open %s", path.c_str());
+    std::string line;
+    int lineno = 0;
+    while (std::getline(delta, line)) {
+        lineno++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream in(line);
+        std::string op;
+        if (!(in >> op)) {
+            continue;
+        }
+        int u = 0, v = 0;
+        if (op == "link-down") {
+            in >> u >> v;
+            dbg_assert(u > 0 && u <= n_nodes && v > 0 && v <= n_nodes && u != v,
+                "what-if: %s:%d: bad link %d-%d", path.c_str(), lineno, u, v);
+            down_links_.insert({std::min(u, v), std::max(u, v)});
+        } else if (op == "node-down") {
+            in >> u;
+            dbg_assert(u > 0 && u <= n_nodes, "what-if: %s:%d: bad node %d", path.c_str(), lineno, u);
+            down_nodes_.insert(u);
+        } else {
+            dbg_assert(false, "what-if: %s:%d: unknown change '%s'", path.c_str(), lineno, op.c_str());
+        }
+    }
+    active_ = true;
+}
+
+void WhatIf::apply(std::vector<std::vector<int>> &G)
+{
+    for (auto u : down_nodes_) {
+        for (auto v : G[u]) {
+            down_links_.insert({std::min(u, v), std::max(u, v)});
+        }
+    }
+    for (int u = 1; u < (int)G.size(); ++u) {
+        std::erase_if(G[u], [&](int v) {
+            return link_down(u, v);
+        });
+    }
+}
+
+std::unordered_set<int> WhatIf::seeds(const std::vector<std::vector<int>> &G) const
+{
+    std::unordered_set<int> nodes;
+    for (auto [u, v] : down_links_) {
+        for (auto w : {u, v}) {
+            if (node_down(w)) {
+                continue;
+            }
+            nodes.insert(w);
+            nodes.insert(G[w].begin(), G[w].end());
+        }
+    }
+    return nodes;
+}
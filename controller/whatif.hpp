@@ -0,0 +1,54 @@
+#pragma once
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/**
+ * What-if run: "converge, then fail link X" without converging again from
+ * scratch. The run starts from the checkpoint of a converged run (see
+ * Checkpoint), removes the failed links from glb_G, and drops what crossed
+ * them from the histories. Only the endpoints of the failed links and
+ * their neighbors are started and restored; the controller stands in for
+ * every other node from its history, as it does for the nodes off the
+ * current partition in iterative convergence.
+ *
+ * A node that is still offline but gets a payload during CONVERGE is on
+ * the frontier and joins the next RESTORE/CONVERGE round, until a round
+ * reaches no new node.
+ *
+ * The delta file has one change per line, # starts a comment:
+ *     link-down <u> <v>
+ *     node-down <u>
+ */
+class WhatIf {
+public:
+    void load(const std::string &path, int n_nodes);
+    bool active() const {
+        return active_;
+    }
+    // removes the failed links from G, a failed node takes all its links down
+    void apply(std::vector<std::vector<int>> &G);
+    bool link_down(int u, int v) const {
+        return down_links_.count({std::min(u, v), std::max(u, v)});
+    }
+    bool node_down(int u) const {
+        return down_nodes_.count(u);
+    }
+    // (u, v) with u < v
+    const std::set<std::pair<int, int>> &down_links() const {
+        return down_links_;
+    }
+    // the nodes of the first round: endpoints of the failed links, and
+    // their neighbors in G once the delta is applied
+    std::unordered_set<int> seeds(const std::vector<std::vector<int>> &G) const;
+private:
+    bool active_ = false;
+    std::set<std::pair<int, int>> down_links_;
+    std::unordered_set<int> down_nodes_;
+};
+
+extern WhatIf g_whatif;
@@ -149,6 +149,36 @@ int fdesc_set::poll_slowpath(
     return r;
 }
 
+void fdesc_set::report_idle(long timeout_ns)
+{
+    std::shared_lock lock(mutex_);
+    // the last thread to block needn't poll a session itself
+    for (size_t fd = managed_._Find_first(); fd < MAX_NFDS; fd = managed_._Find_next(fd)) {
+        if (fd2ptr_[fd] == nullptr) {
+            continue;
+        }
+        // one session of the daemon is enough
+        if (fd2ptr_[fd]->report_idle(timeout_ns)) {
+            return;
+        }
+    }
+}
+
+bool fdesc_set::polls_mux(const struct pollfd *kfds, const nfds_t nfds)
+{
+    std::shared_lock lock(mutex_);
+    for (nfds_t i = 0; i < nfds; ++i) {
+        int fd = kfds[i].fd;
+        if (fd < 0 || fd >= MAX_NFDS || kfds[i].events == 0 || !managed_.test(fd) || fd2ptr_[fd] == nullptr) {
+            continue;
+        }
+        if (fd2ptr_[fd]->on_mux()) {
+            return true;
+        }
+    }
+    return false;
+}
+
 int fdesc::listen(int backlog)
 {
     PRELOAD_ORIG(listen);
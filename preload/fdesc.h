@@ -65,6 +65,17 @@ public:
     // slow path to be skipped for this fd.
     virtual bool poll_fastpath(struct pollfd *ufd);
     virtual void poll_slowpath(struct pollfd *ufd, const struct pollfd *kfd);
+    // Tell the controller that the daemon is going idle, until
+    // timeout_ns passed (-1: until an fd gets ready).
+    // Returns false if the fd can't carry the report.
+    virtual bool report_idle(long timeout_ns) {
+        return false;
+    }
+    // Whether the fd is fed by the mux (mux.h), a kernel
+    // poll on it must wait on the mux as well.
+    virtual bool on_mux() const {
+        return false;
+    }
     fdesc_type_t type() const { return fdesc_type; }
 
     friend class fdesc_set;
@@ -102,6 +113,13 @@ public:
         const nfds_t nfds
     );
 
+    // every thread of the daemon is going to block in poll (idle.h), the
+    // earliest for timeout_ns; reported on any BGP session
+    void report_idle(long timeout_ns);
+
+    // whether any fd the kernel is going to poll is fed by the mux
+    bool polls_mux(const struct pollfd *kfds, const nfds_t nfds);
+
     void set_nht_ready(int peerid) {
         std::shared_lock lock(mutex_);
         nht_ready_.insert(peerid);
@@ -0,0 +1,101 @@
+#include "idle.h"
+#include "debug.h"
+#include "preload.h"
+
+#include <climits>
+#include <mutex>
+#include <set>
+
+namespace {
+
+struct idle_state {
+    std::mutex mutex;
+    int n_threads = 0;
+    // deadlines of the blocked threads, LONG_MAX for no timeout
+    std::multiset<long> blocked;
+};
+
+// never freed, threads still exit after the library's statics are gone
+idle_state *glb_idle = new idle_state;
+
+struct idle_slot {
+    bool counted = false;
+    bool blocked = false; // only ever changed by its own thread
+    std::multiset<long>::iterator deadline;
+
+    ~idle_slot()
+    {
+        if (!counted) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(glb_idle->mutex);
+        if (blocked) {
+            glb_idle->blocked.erase(deadline);
+        }
+        glb_idle->n_threads--;
+    }
+};
+
+thread_local idle_slot tls_idle;
+
+long now_ns()
+{
+    struct timespec ts;
+    clock_gettime_orig(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1'000'000'000L + ts.tv_nsec;
+}
+
+// with glb_idle->mutex held
+void count_locked()
+{
+    if (!tls_idle.counted) {
+        tls_idle.counted = true;
+        glb_idle->n_threads++;
+    }
+}
+
+} // namespace
+
+bool idle_threads::block(long &timeout_ns)
+{
+    long now = now_ns();
+    long deadline = timeout_ns < 0 ? LONG_MAX : now + timeout_ns;
+    std::lock_guard<std::mutex> lock(glb_idle->mutex);
+    count_locked();
+    if (tls_idle.blocked) {
+        glb_idle->blocked.erase(tls_idle.deadline);
+    }
+    tls_idle.deadline = glb_idle->blocked.insert(deadline);
+    tls_idle.blocked = true;
+    if ((int)glb_idle->blocked.size() < glb_idle->n_threads) {
+        return false;
+    }
+    long earliest = *glb_idle->blocked.begin();
+    if (earliest <= now) {
+        // that thread's ppoll() timed out, it just didn't tell yet
+        return false;
+    }
+    timeout_ns = earliest == LONG_MAX ? -1 : earliest - now;
+    return true;
+}
+
+void idle_threads::busy()
+{
+    if (tls_idle.counted && !tls_idle.blocked) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(glb_idle->mutex);
+    count_locked();
+    if (tls_idle.blocked) {
+        glb_idle->blocked.erase(tls_idle.deadline);
+        tls_idle.blocked = false;
+    }
+}
+
+void idle_threads::atfork()
+{
+    // the parent's threads, and whoever held the mutex, aren't here
+    glb_idle = new idle_state;
+    tls_idle.counted = false;
+    tls_idle.blocked = false;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+/**
+ * Tells when the whole daemon is idle, not just the thread at hand: in
+ * FRR, bgpd's I/O pthread blocks on the sessions as soon as it read a
+ * message while the main thread still has the best path run and the
+ * update-group timers ahead.
+ *
+ * Every thread that goes through ppoll_impl() is counted. One is blocked
+ * from the moment it found nothing to handle and commits to a ppoll() with
+ * a nonzero timeout until that ppoll() returns. The daemon is idle while
+ * all of them are blocked and none of their timeouts has passed; the
+ * thread that completes the set sends the report (REAL_IDLE), with the
+ * earliest timeout among them.
+ *
+ * A thread waiting anywhere else (a condition variable, a blocking read,
+ * an io_waiter) counts as busy, so a report may come late or not at all,
+ * leaving the stage to CONVERGE_TIMEOUT, but never early. Threads stop
+ * being counted when they exit.
+ */
+class idle_threads {
+public:
+    // the calling thread is going to block for timeout_ns (-1: no
+    // timeout); true if that leaves every counted thread blocked,
+    // timeout_ns is then the earliest timeout of them
+    static bool block(long &timeout_ns);
+    // the calling thread's ppoll() returned, or it's about to look for work
+    static void busy();
+    // the child's only thread is the one that forked
+    static void atfork();
+};
@@ -0,0 +1,66 @@
+#include "io_wait.h"
+#include "debug.h"
+#include "preload.h"
+#include "trace.h"
+
+#include <sched.h>
+
+io_wait_path glb_io_wait[IO_WAIT_MAX_PATH];
+
+io_waiter::~io_waiter()
+{
+    if (spins_ > 0 && !blocked_) {
+        auto &limit = glb_io_wait[path_].spin_limit;
+        limit.store(std::min(limit.load(std::memory_order_relaxed) * 2, IO_WAIT_SPIN_MAX), std::memory_order_relaxed);
+    }
+}
+
+void io_waiter::wait(int fd, short events)
+{
+    struct pollfd pfd = {.fd = fd, .events = events, .revents = 0};
+    wait(&pfd, 1);
+}
+
+void io_waiter::wait(struct pollfd *fds, int nfds)
+{
+    PRELOAD_ORIG_NOINIT(poll);
+    io_wait_path &path = glb_io_wait[path_];
+    path.n_waits.fetch_add(1, std::memory_order_relaxed);
+    if (!blocked_ && spins_ < path.spin_limit.load(std::memory_order_relaxed)) {
+        spins_++;
+        sched_yield();
+        return;
+    }
+    if (!blocked_) {
+        blocked_ = true;
+        path.spin_limit.store(std::max(path.spin_limit.load(std::memory_order_relaxed) / 2, IO_WAIT_SPIN_MIN),
+                              std::memory_order_relaxed);
+        path.n_blocks.fetch_add(1, std::memory_order_relaxed);
+    }
+#ifdef PRELOAD_TRACE
+    struct timespec t0, t1;
+    clock_gettime_orig(CLOCK_MONOTONIC, &t0);
+#endif
+    int r = poll_orig(fds, nfds, -1);
+    LOG("%s: poll_orig(fd=%d, events=%x, nfds=%d) = %d, revents=%x\n", io_wait_path_name(path_),
+        fds[0].fd, fds[0].events, nfds, r, fds[0].revents);
+#ifdef PRELOAD_TRACE
+    clock_gettime_orig(CLOCK_MONOTONIC, &t1);
+    TRACE(SHIM_TR_BLOCK, fds[0].fd, (t1.tv_sec - t0.tv_sec) * 1'000'000'000L + t1.tv_nsec - t0.tv_nsec,
+          path.n_blocks.load(std::memory_order_relaxed), path_);
+#endif
+    (void)r;
+}
+
+#ifdef PRELOAD_DEBUG
+__attribute__((destructor)) static void io_wait_report()
+{
+    if (log_file == nullptr) {
+        return;
+    }
+    for (int i = 0; i < IO_WAIT_MAX_PATH; ++i) {
+        LOG("%s: %ld waits, %ld blocks, spin limit %d\n", io_wait_path_name(i),
+            glb_io_wait[i].n_waits.load(), glb_io_wait[i].n_blocks.load(), glb_io_wait[i].spin_limit.load());
+    }
+}
+#endif
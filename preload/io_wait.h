@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+
+struct pollfd;
+
+/**
+ * What READ_UNTIL and friends do on EAGAIN. A waiter first retries after
+ * sched_yield(), up to the spin limit of its path, then blocks in poll()
+ * on the fd until it's ready. The limit adapts per path: it halves when
+ * spinning ends in poll() anyway and doubles when a spin pays off, so a
+ * path that always waits for the controller (e.g. SYNACK) goes straight
+ * to poll(), one that only hits a short burst keeps spinning.
+ *
+ * Each path counts its waits and blocks; blocks are traced with TRACE=1
+ * and the counts are logged at exit with DEBUG=1.
+ *
+ * Kept free of the rest of the shim, shim_trace uses the path names.
+ */
+
+enum io_wait_path_id {
+    IO_WAIT_READ,   // READ_UNTIL: SYN, SYNACK
+    IO_WAIT_WRITE,  // WRITE_UNTIL: SYN, acks, idle reports
+    IO_WAIT_WRITEV, // writev_until: payloads
+    IO_WAIT_RCV,    // rcv_need: rest of a payload being read
+    IO_WAIT_MAX_PATH
+};
+
+inline const char *io_wait_path_name(int path)
+{
+    static const char *names[] = {"READ_UNTIL", "WRITE_UNTIL", "writev_until", "rcv_need"};
+    return path >= 0 && path < IO_WAIT_MAX_PATH ? names[path] : "?";
+}
+
+constexpr int IO_WAIT_SPIN_MIN = 1;
+constexpr int IO_WAIT_SPIN_MAX = 256;
+
+struct io_wait_path {
+    std::atomic<long> n_waits{0};   // EAGAINs
+    std::atomic<long> n_blocks{0};  // transfers that ended up in poll()
+    std::atomic<int> spin_limit{16};
+};
+
+extern io_wait_path glb_io_wait[IO_WAIT_MAX_PATH];
+
+// one per transfer, i.e. per READ_UNTIL
+class io_waiter {
+public:
+    explicit io_waiter(int path) : path_(path), spins_(0), blocked_(false) {}
+    ~io_waiter();
+    // on EAGAIN: returns when the transfer is worth retrying
+    void wait(int fd, short events);
+    // the same, when any of fds may make it worth retrying
+    void wait(struct pollfd *fds, int nfds);
+private:
+    int path_;
+    int spins_;
+    bool blocked_;
+};
@@ -0,0 +1,361 @@
+#include "mux.h"
+#include "debug.h"
+#include "preload.h"
+
+extern "C" {
+#include <sys/eventfd.h>
+}
+
+shim_mux *glb_mux = nullptr;
+
+constexpr size_t MUX_IN_SIZ = 1 << 16;
+
+/**
+ * Bound to its own path, the controller's acceptor tells the mux from a
+ * session's socket by it (MUX_SOCKET_NAME). Blocks until the controller
+ * took the connection, as a session's connect() does.
+ */
+shim_mux *shim_mux::get()
+{
+#ifdef PRELOAD_MUX
+    static std::mutex open_mutex;
+    std::lock_guard<std::mutex> lock(open_mutex);
+    if (glb_mux != nullptr) {
+        return glb_mux;
+    }
+    int fd = syscall(SYS_socket, AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert(fd >= 0);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "/ripc/emu-real-%d/mux", tls_selfid);
+    int r = unlink(addr.sun_path);
+    if (r < 0 && errno != ENOENT) {
+        fprintf(stderr, "mux: unlink [%s] before bind failed: %s\n", addr.sun_path, strerror(errno));
+        assert(0);
+    }
+    r = syscall(SYS_bind, fd, (struct sockaddr *)&addr, sizeof(addr));
+    assert(r == 0);
+    struct sockaddr_un mng_addr = {.sun_family = AF_UNIX};
+    strncpy(mng_addr.sun_path, MNG_SOCKET_PATH, sizeof(mng_addr.sun_path) - 1);
+    r = syscall(SYS_connect, fd, (struct sockaddr *)&mng_addr, sizeof(mng_addr));
+    if (r != 0) {
+        fprintf(stderr, "mux: connect(%s) failed: %s\n", MNG_SOCKET_PATH, strerror(errno));
+    }
+    assert(r == 0);
+    syscall(SYS_fcntl, fd, F_SETFL, O_NONBLOCK);
+    glb_mux = new shim_mux(fd, tls_selfid);
+    LOG("mux: %s connected, fd=%d\n", (const char *)addr.sun_path, fd);
+#endif
+    return glb_mux;
+}
+
+/**
+ * The child keeps the sessions' fds but none of them carries anything:
+ * the connection is the parent's, and so are the eventfds' counters, which
+ * the child leaves alone. Its reads see the end of every session.
+ */
+void shim_mux::atfork()
+{
+    if (glb_mux == nullptr || glb_mux->fd_ < 0) {
+        return;
+    }
+    syscall(SYS_close, glb_mux->fd_);
+    glb_mux->fd_ = -1;
+}
+
+shim_mux::shim_mux(int fd, int self) :
+    fd_(fd), self_(self), accept_signalled_(false), eof_(false), in_(MUX_IN_SIZ), in_len_(0)
+{
+    accept_efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(accept_efd_ >= 0);
+}
+
+std::shared_ptr<mux_session> shim_mux::connect(int fd, int peer)
+{
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(efd >= 0);
+    int r = syscall(SYS_dup3, efd, fd, O_CLOEXEC);
+    assert(r == fd);
+    syscall(SYS_close, efd);
+    auto s = std::make_shared<mux_session>(peer, fd);
+    std::lock_guard<std::mutex> lock(mutex_);
+    connecting_[peer] = s;
+    return s;
+}
+
+void shim_mux::listen(int fd)
+{
+    int r = syscall(SYS_dup3, accept_efd_, fd, O_CLOEXEC);
+    assert(r == fd);
+    LOG("mux: listener fd=%d on the accept queue\n", fd);
+}
+
+std::shared_ptr<mux_session> shim_mux::accept()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    pump_locked();
+    if (accept_q_.empty()) {
+        return nullptr;
+    }
+    auto s = std::move(accept_q_.front());
+    accept_q_.pop_front();
+    update_accept();
+    return s;
+}
+
+bool shim_mux::acceptable()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    pump_locked();
+    return !accept_q_.empty();
+}
+
+ssize_t shim_mux::recv(mux_session &s, void *buf, size_t n)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fd_ < 0) {
+        return 0;
+    }
+    if (s.rx.size() == s.rx_off) {
+        pump_locked();
+    }
+    size_t avail = s.rx.size() - s.rx_off;
+    if (avail == 0) {
+        if (s.eof) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    n = std::min(n, avail);
+    memcpy(buf, s.rx.data() + s.rx_off, n);
+    s.rx_off += n;
+    if (s.rx_off == s.rx.size()) {
+        s.rx.clear();
+        s.rx_off = 0;
+    } else if (s.rx_off >= MUX_IN_SIZ) {
+        s.rx.erase(s.rx.begin(), s.rx.begin() + s.rx_off);
+        s.rx_off = 0;
+    }
+    update(s);
+    return n;
+}
+
+void shim_mux::read_until(mux_session &s, void *buf, size_t n)
+{
+    io_waiter waiter(IO_WAIT_READ);
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = recv(s, (char *)buf + got, n - got);
+        LOG("mux: read_until(peer=%d, %zu) = %ld\n", s.peer, n - got, r);
+        assert(r > 0 || (r < 0 && errno == EAGAIN));
+        if (r > 0) {
+            got += r;
+        } else {
+            wait(s, waiter);
+        }
+    }
+}
+
+// whichever comes first: another thread pumps bytes of s, or the connection has some
+void shim_mux::wait(mux_session &s, io_waiter &waiter)
+{
+    struct pollfd fds[2] = {
+        {.fd = s.efd, .events = POLLIN, .revents = 0},
+        {.fd = poll_fd(), .events = POLLIN, .revents = 0},
+    };
+    waiter.wait(fds, 2);
+}
+
+void shim_mux::close(mux_session &s)
+{
+    bool fin;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto *m : {&sessions_, &connecting_}) {
+            auto it = m->find(s.peer);
+            if (it != m->end() && it->second.get() == &s) {
+                m->erase(it);
+            }
+        }
+        fin = s.open && !s.eof && fd_ >= 0;
+        s.open = false;
+        s.eof = true;
+    }
+    if (!fin) {
+        return;
+    }
+    real_pld_t msg = (real_pld_t) {
+        .hdr = (real_hdr_t) {
+            .msg_type = REAL_FIN,
+            .msg_len = pldhdrsiz
+        },
+        .src_id = self_,
+        .dst_id = s.peer
+    };
+    LOG("mux: session of %d closed\n", s.peer);
+    auto lock = lock_tx();
+    WRITE_UNTIL(fd_, &msg, pldhdrsiz);
+}
+
+void shim_mux::pump()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    pump_locked();
+}
+
+int shim_mux::poll_fd()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return eof_ ? -1 : fd_;
+}
+
+/**
+ * Reads until the connection is drained, a short read tells it is, and
+ * hands every complete message to its session.
+ */
+void shim_mux::pump_locked()
+{
+    while (fd_ >= 0 && !eof_) {
+        size_t space = in_.size() - in_len_;
+        ssize_t r = syscall(SYS_read, fd_, in_.data() + in_len_, space);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (r <= 0) {
+            LOG("mux: fd=%d closed by the controller: %s\n", fd_, r < 0 ? strerror(errno) : "eof");
+            eof_ = true;
+            for (auto &[peer, s] : sessions_) {
+                s->eof = true;
+                update(*s);
+            }
+            for (auto &[peer, s] : connecting_) {
+                s->eof = true;
+                update(*s);
+            }
+            break;
+        }
+        in_len_ += r;
+        size_t off = 0;
+        while (in_len_ - off >= (size_t)hdrsiz) {
+            real_hdr_t hdr;
+            memcpy(&hdr, in_.data() + off, hdrsiz);
+            assert(hdr.msg_len >= hdrsiz && (size_t)hdr.msg_len <= in_.size());
+            if (in_len_ - off < (size_t)hdr.msg_len) {
+                break;
+            }
+            dispatch(in_.data() + off, hdr.msg_len);
+            off += hdr.msg_len;
+        }
+        memmove(in_.data(), in_.data() + off, in_len_ - off);
+        in_len_ -= off;
+        if ((size_t)r < space) {
+            break;
+        }
+    }
+}
+
+void shim_mux::dispatch(const char *msg, size_t len)
+{
+    real_hdr_t hdr;
+    memcpy(&hdr, msg, hdrsiz);
+    switch (hdr.msg_type) {
+    case REAL_PAYLOAD: {
+        real_pld_t pld;
+        memcpy(&pld, msg, pldhdrsiz);
+        auto it = sessions_.find(pld.src_id);
+        if (it == sessions_.end()) {
+            LOG("mux: payload of %d dropped, no such session\n", pld.src_id);
+            return;
+        }
+        deliver(*it->second, msg, len);
+        break;
+    }
+    case REAL_SYNACK: {
+        real_synack_t synack;
+        memcpy(&synack, msg, synacksiz);
+        auto it = connecting_.find(synack.svr_id);
+        if (it == connecting_.end()) {
+            LOG("mux: REAL_SYNACK of %d dropped, no such connect()\n", synack.svr_id);
+            return;
+        }
+        auto s = std::move(it->second);
+        connecting_.erase(it);
+        if (synack.cli_port != 0) {
+            adopt(s);
+        }
+        deliver(*s, msg, len);
+        break;
+    }
+    case REAL_SYN: {
+        // the controller connects to our listener
+        real_syn_t syn;
+        memcpy(&syn, msg, synsiz);
+        int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        assert(efd >= 0);
+        auto s = std::make_shared<mux_session>(syn.cli_id, efd);
+        adopt(s);
+        deliver(*s, msg, len);
+        accept_q_.push_back(std::move(s));
+        update_accept();
+        break;
+    }
+    default:
+        LOG("mux: unexpected msg_type %d dropped\n", hdr.msg_type);
+        break;
+    }
+}
+
+void shim_mux::deliver(mux_session &s, const char *msg, size_t len)
+{
+    s.rx.insert(s.rx.end(), msg, msg + len);
+    update(s);
+}
+
+// s is established, an older session to the same peer ends
+void shim_mux::adopt(std::shared_ptr<mux_session> s)
+{
+    auto &slot = sessions_[s->peer];
+    if (slot) {
+        LOG("mux: session of %d superseded\n", s->peer);
+        // its REAL_FIN would close the new one
+        slot->open = false;
+        slot->eof = true;
+        update(*slot);
+    }
+    s->open = true;
+    slot = std::move(s);
+}
+
+// the eventfd's counter is nonzero exactly while the session has something to read
+void shim_mux::update(mux_session &s)
+{
+    bool ready = s.rx.size() > s.rx_off || s.eof;
+    if (ready == s.signalled) {
+        return;
+    }
+    uint64_t v = 1;
+    if (ready) {
+        syscall(SYS_write, s.efd, &v, sizeof(v));
+    } else {
+        syscall(SYS_read, s.efd, &v, sizeof(v));
+    }
+    s.signalled = ready;
+}
+
+void shim_mux::update_accept()
+{
+    bool ready = !accept_q_.empty();
+    if (ready == accept_signalled_) {
+        return;
+    }
+    uint64_t v = 1;
+    if (ready) {
+        syscall(SYS_write, accept_efd_, &v, sizeof(v));
+    } else {
+        syscall(SYS_read, accept_efd_, &v, sizeof(v));
+    }
+    accept_signalled_ = ready;
+}
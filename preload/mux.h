@@ -0,0 +1,111 @@
+#pragma once
+
+#include "io_wait.h"
+
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+/**
+ * One connection to the controller for all BGP sessions of the daemon,
+ * when built with MUX=1: /ripc/emu-real-<node>/mux, opened by the first
+ * bind() to port 179 or BGP connect(). Sessions are opened by a REAL_SYN
+ * from either side and told apart by the peer they name: src_id of a
+ * payload, svr_id of a REAL_SYNACK, cli_id of the controller's REAL_SYN.
+ * Closing one sends a REAL_FIN.
+ *
+ * Whichever thread reads the connection (pump()) sorts what it got into
+ * the sessions' queues. The fd the daemon holds for a session is an
+ * eventfd that is readable exactly while its queue holds bytes or the
+ * session ended, so a ppoll() on it sees what any thread pumped; a ppoll()
+ * on sessions also waits on the connection itself (see ppoll_impl()). The
+ * BGP listener's fd is the eventfd of the accept queue.
+ *
+ * The eventfds and the connection never reach glb_fdset: they are made
+ * and signalled by syscall(), the daemon's fds are dup2()ed over.
+ */
+
+struct mux_session {
+    int peer;
+    int efd;          // the daemon's fd of the session
+    bool signalled;   // efd is readable
+    bool open;        // established, the controller is told when it's closed
+    bool eof;         // the controller closed it, or the connection
+    std::vector<char> rx;
+    size_t rx_off;
+
+    mux_session(int _peer, int _efd) : peer(_peer), efd(_efd), signalled(false), open(false), eof(false), rx_off(0) {}
+};
+
+class shim_mux {
+public:
+    // the daemon's mux, opened on first use; nullptr unless built with MUX=1
+    static shim_mux *get();
+    // a forked child must not read or write its parent's connection
+    static void atfork();
+
+    // a session to peer whose REAL_SYN is about to go, fd becomes its eventfd
+    std::shared_ptr<mux_session> connect(int fd, int peer);
+    // fd becomes the eventfd of the accept queue
+    void listen(int fd);
+    // the oldest session the controller opened, nullptr if there's none
+    std::shared_ptr<mux_session> accept();
+    // whether accept() has a session to return
+    bool acceptable();
+    // held while a message of any session is written to fd()
+    std::unique_lock<std::mutex> lock_tx()
+    {
+        return std::unique_lock<std::mutex>(tx_mutex_);
+    }
+    int fd() const
+    {
+        return fd_;
+    }
+    // like read(): -1 and EAGAIN while nothing is queued, 0 once the session ended
+    ssize_t recv(mux_session &s, void *buf, size_t n);
+    // n bytes, as READ_UNTIL reads a socket
+    void read_until(mux_session &s, void *buf, size_t n);
+    // recv() found nothing on a read that must complete
+    void wait(mux_session &s, io_waiter &waiter);
+    // the daemon closed the session's fd
+    void close(mux_session &s);
+    // sorts whatever the connection holds into the sessions
+    void pump();
+    // what a ppoll() on sessions waits on too, -1 once the connection is gone
+    int poll_fd();
+
+private:
+    shim_mux(int fd, int self);
+    void pump_locked();
+    void dispatch(const char *msg, size_t len);
+    void deliver(mux_session &s, const char *msg, size_t len);
+    void adopt(std::shared_ptr<mux_session> s);
+    void update(mux_session &s);
+    void update_accept();
+
+    int fd_; // -1 in a forked child
+    int self_;
+    int accept_efd_;
+    bool accept_signalled_;
+    bool eof_;
+    // established sessions and the ones waiting for a REAL_SYNACK, by peer
+    std::map<int, std::shared_ptr<mux_session>> sessions_;
+    std::map<int, std::shared_ptr<mux_session>> connecting_;
+    std::deque<std::shared_ptr<mux_session>> accept_q_;
+    // bytes read off the connection, not sorted yet
+    std::vector<char> in_;
+    size_t in_len_;
+    // everything above
+    std::mutex mutex_;
+    // messages of different threads must not interleave on the connection
+    std::mutex tx_mutex_;
+};
+
+extern shim_mux *glb_mux;
@@ -4,6 +4,9 @@
 #include "tcp.h"
 #include "udp.h"
 #include "util.h"
+#include "trace.h"
+#include "mux.h"
+#include "idle.h"
 
 #include <atomic>
 #include <memory>
@@ -321,6 +324,7 @@ PRELOAD3(write, ssize_t, int, fd, const void *, buf, size_t, count)
     } else{
         int ret = glb_fdset.at(fd)->write(buf, count);;
         LOG("fdset write(%d, %p, %ld)=%d\n", fd, buf, count, ret);
+        TRACE(SHIM_TR_WRITE, fd, ret, 0, 0);
         return ret;
     }
 }
@@ -343,7 +347,9 @@ PRELOAD3(read, ssize_t, int, fd, void *, buf, size_t, count)
         LOG("Original read(%d, %p, %ld)=%ld\n", fd, buf, count, ret);
         return ret;
     } else {
-        return glb_fdset.at(fd)->read(buf, count);
+        ssize_t ret = glb_fdset.at(fd)->read(buf, count);
+        TRACE(SHIM_TR_READ, fd, ret, 0, 0);
+        return ret;
     }
 }
 
@@ -630,6 +636,9 @@ PRELOAD0(fork, pid_t)
     if (ret == 0) {
         // child process
         thread_id = gettid();
+        TRACE_ATFORK();
+        shim_mux::atfork();
+        idle_threads::atfork();
 #ifdef PRELOAD_DEBUG
         static char fname[1024];
         fname[sprintf(fname, "/var/log/real/preload_%s_%d.log", __progname, gettid())] = 0;
@@ -665,6 +674,7 @@ PRELOAD3(readv, ssize_t, int, fd, const struct iovec *, iov, int, iovcnt)
         ssize_t ret = glb_fdset.at(fd)->readv(iov, iovcnt);
         LOG("fdset readv(%d, %p, %d)=%ld [buflen=%lu]\n",
             fd, iov, iovcnt, ret, buflen);
+        TRACE(SHIM_TR_READV, fd, ret, 0, 0);
         return ret;
     }
 }
@@ -697,6 +707,7 @@ PRELOAD3(writev, ssize_t, int, fd, const struct iovec *, iov, int, iovcnt)
         ssize_t ret = glb_fdset.at(fd)->writev(iov, iovcnt);
         LOG("fdset writev(%d, %p, %d)=%ld [buflen=%lu]\n",
             fd, iov, iovcnt, ret, buflen);
+        TRACE(SHIM_TR_WRITEV, fd, ret, 0, 0);
         return ret;
     }
 }
@@ -1389,25 +1400,81 @@ ppoll_impl(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p, const
     PRELOAD_ORIG(ppoll);
     PRELOAD_ORIG(recvfrom);
     PRELOAD_ORIG(recvmsg);
+    PRELOAD_ORIG(clock_gettime);
 
     int r;
     thread_local static struct pollfd kfds[1024];
+    nfds_t knfds;
+    shim_mux *mux = glb_mux;
+    bool mux_woke;
+    struct timespec start, left;
 
     // malloc_trim(0);
 
+    TRACE(SHIM_TR_PPOLL_ENTER, nfds, tmo_p ? tmo_p->tv_sec * 1'000'000'000 + tmo_p->tv_nsec : -1, 0, 0);
+    if (tmo_p != NULL && mux != nullptr) {
+        clock_gettime_orig(CLOCK_MONOTONIC, &start);
+    }
+
+ppoll_again:
+    idle_threads::busy();
     r = glb_fdset.poll_fastpath(fds, kfds, nfds);
     if (r != 0) {
         LOG("poll_fastpath\n");
+        TRACE(SHIM_TR_PPOLL_FAST, nfds, r, 0, 0);
         goto ppoll_return;
     }
 
-    r = ppoll_orig(kfds, nfds, tmo_p, sigmask);
+    if (tmo_p == NULL || tmo_p->tv_sec != 0 || tmo_p->tv_nsec != 0) {
+        // nothing to handle, this thread is going to block; the daemon is
+        // idle once all its threads are
+        long idle_timeout_ns = tmo_p ? tmo_p->tv_sec * 1'000'000'000L + tmo_p->tv_nsec : -1;
+        if (idle_threads::block(idle_timeout_ns)) {
+            glb_fdset.report_idle(idle_timeout_ns);
+        }
+    }
+
+    knfds = nfds;
+    if (mux != nullptr && glb_fdset.polls_mux(kfds, nfds)) {
+        // the sessions' eventfds only turn readable once someone reads the mux
+        assert(nfds < 1024);
+        kfds[knfds++] = (struct pollfd) {.fd = mux->poll_fd(), .events = POLLIN, .revents = 0};
+    }
+
+    r = ppoll_orig(kfds, knfds, tmo_p, sigmask);
+    idle_threads::busy();
     if (r < 0) {
         return r;
     }
+    mux_woke = knfds > nfds && kfds[nfds].revents != 0;
+    if (mux_woke) {
+        mux->pump();
+    }
 
     r = glb_fdset.poll_slowpath(fds, kfds, nfds);
     LOG("poll_slowpath\n");
+    TRACE(SHIM_TR_PPOLL, nfds, r, 0, 0);
+#ifdef PRELOAD_TRACE
+    for (nfds_t i = 0; i < nfds; ++i) {
+        if (fds[i].revents || kfds[i].revents) {
+            TRACE(SHIM_TR_POLLFD, fds[i].fd, kfds[i].revents, 0, fds[i].revents);
+        }
+    }
+#endif
+    if (r == 0 && mux_woke) {
+        // what the mux brought is for the fastpath to see, in what is left of the timeout
+        if (tmo_p != NULL) {
+            struct timespec now;
+            clock_gettime_orig(CLOCK_MONOTONIC, &now);
+            long ns = (tmo_p->tv_sec - (now.tv_sec - start.tv_sec)) * 1'000'000'000L
+                + tmo_p->tv_nsec - (now.tv_nsec - start.tv_nsec);
+            ns = std::max(ns, 0L);
+            left = (struct timespec) {.tv_sec = ns / 1'000'000'000, .tv_nsec = ns % 1'000'000'000};
+            start = now;
+            tmo_p = &left;
+        }
+        goto ppoll_again;
+    }
 
 ppoll_return:
 
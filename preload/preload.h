@@ -2,6 +2,7 @@
 #define PRELOAD_H
 
 #include "fdesc.h"
+#include "io_wait.h"
 
 #include <pthread.h>
 #include <set>
@@ -75,6 +76,9 @@ enum RealMsgType {
     REAL_SYNACK, // body: 4 byte, 0 stands for ok, other value indicates errno
     REAL_PAYLOAD,
     REAL_ACK,
+    REAL_TOKEN, // controller to controller only
+    REAL_IDLE,
+    REAL_FIN, // a session of the mux connection (mux.h) is closed
     REAL_MAX_MSGTYPE
 };
 
@@ -91,23 +95,41 @@ typedef struct {
     // ignored by controller, only used by
     // listener's shim
     uint16_t cli_port;
+    uint16_t flags; // REAL_SYN_*, in what used to be padding
 } real_syn_t;
 
 typedef struct {
     real_hdr_t hdr;
     uint16_t cli_port;
+    uint16_t flags;
+    int32_t svr_id; // of the REAL_SYN answered, names the session on the mux
 } real_synack_t;
 
+// the session's shm pipes (shm_pipe.h): offered in a REAL_SYN, taken in the REAL_SYNACK
+#define REAL_SYN_SHM 1
+// the controller replays in a window (CTRL_REPLAY_WINDOW): a REAL_ACK per message consumed
+#define REAL_SYN_ACKS 2
+
 typedef struct {
     real_hdr_t hdr;
     int32_t src_id;
     int32_t dst_id;
 } real_pld_t;
 
+// the daemon is about to block, hdr.seq is the last consumed seq
+typedef struct {
+    real_hdr_t hdr;
+    int64_t n_sent;     // REAL_PAYLOADs written so far
+    int64_t timeout_ns; // until the daemon's ppoll() times out, -1 if it has no timer
+} real_idle_t;
+
 constexpr int hdrsiz = sizeof(real_hdr_t);
 constexpr int synsiz = sizeof(real_syn_t);
 constexpr int synacksiz = sizeof(real_synack_t);
 constexpr int pldhdrsiz = sizeof(real_pld_t);
+constexpr int idlesiz = sizeof(real_idle_t);
+// deadlines of REAL_IDLE reports this close are taken for the same timer
+constexpr long IDLE_TIMER_SLACK = 1'000'000;
 
 #define PCASEB(name) case name: str += #name; break;
 #define PCASE(name) case name: str += #name;
@@ -326,9 +348,11 @@ PRELOAD0_DECL(if_nameindex, struct if_nameindex *)
 PRELOAD1_DECL(if_freenameindex, void, struct if_nameindex *, ptr)
 // TODO: int getifaddrs(struct ifaddrs **ifap);
 
+// blocking transfers on a kernel fd, EAGAIN is waited out by io_waiter
 #define READ_UNTIL(fd, buf, goal)\
     {\
         PRELOAD_ORIG(read);\
+        io_waiter _waiter(IO_WAIT_READ);\
         int _n_bytes = 0;\
         int _ret;\
         while (_n_bytes < (goal)) {\
@@ -342,45 +366,15 @@ PRELOAD1_DECL(if_freenameindex, void, struct if_nameindex *, ptr)
             if (_ret > 0) {\
                 _n_bytes += _ret;\
             } else {\
-                struct timespec min_tmo = {\
-                    .tv_sec = 0,\
-                    .tv_nsec =1'000'000\
-                };\
-                nanosleep(&min_tmo, NULL);\
-            }\
-        }\
-    }
-
-#define PEEK_UNTIL(fd, buf, goal)\
-    {\
-        PRELOAD_ORIG(recv);\
-        int _n_bytes = 0;\
-        int _ret;\
-        while (_n_bytes < (goal)) {\
-            _ret = recv_orig((fd), (char *)(buf), (goal), MSG_PEEK);\
-            LOG("PEEK_UNTIL: recv_orig(%d, %p, %d) = %d\n",\
-                (int)(fd), (char *)(buf), (int)(goal), _ret);\
-            if (_ret < 0) {\
-                LOG("err = %d: %s\n", errno, strerror(errno));\
-            }\
-            assert(_ret > 0 || errno == EAGAIN);\
-            if (_ret > 0) {\
-                _n_bytes = _ret;\
-            } else {\
-                struct timespec min_tmo = {\
-                    .tv_sec = 0,\
-                    .tv_nsec =1'000'000\
-                };\
-                nanosleep(&min_tmo, NULL);\
+                _waiter.wait((fd), POLLIN);\
             }\
         }\
     }
 
-// TODO: check for EAGAIN
-// TODO: WRITEV_UNTIL
 #define WRITE_UNTIL(fd, buf, goal)\
     {\
         PRELOAD_ORIG(write);\
+        io_waiter _waiter(IO_WAIT_WRITE);\
         int _n_bytes = 0;\
         int _ret;\
         while (_n_bytes < (goal)) {\
@@ -394,11 +388,7 @@ PRELOAD1_DECL(if_freenameindex, void, struct if_nameindex *, ptr)
             if (_ret > 0) {\
                 _n_bytes += _ret;\
             } else {\
-                struct timespec min_tmo = {\
-                    .tv_sec = 0,\
-                    .tv_nsec =1'000'000\
-                };\
-                nanosleep(&min_tmo, NULL);\
+                _waiter.wait((fd), POLLOUT);\
             }\
         }\
     }
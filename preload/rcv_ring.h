@@ -0,0 +1,85 @@
+#pragma once
+
+#include "debug.h"
+
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+
+constexpr size_t RCV_RING_SIZ = 1 << 16;
+
+/**
+ * Receive buffer of a BGP session. Like the controller's MirrorRingBuffer
+ * it is a memfd mapped twice back to back: byte i and byte i + cap are the
+ * same memory, so what is buffered is one contiguous range and so is the
+ * free space, one read() fills it and headers are parsed in place.
+ */
+class rcv_ring {
+public:
+    explicit rcv_ring(size_t capacity) : r_(0), w_(0)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        cap_ = page;
+        while (cap_ < capacity) {
+            cap_ <<= 1;
+        }
+        int fd = memfd_create("rcv_ring", MFD_CLOEXEC);
+        assert(fd >= 0);
+        int r = ftruncate(fd, cap_);
+        assert(r == 0);
+        // reserve both halves, then map the file over each
+        void *p = mmap(nullptr, 2 * cap_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(p != MAP_FAILED);
+        base_ = (char *)p;
+        for (int half = 0; half < 2; ++half) {
+            p = mmap(base_ + half * cap_, cap_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+            assert(p != MAP_FAILED);
+        }
+        // close() is ours, the fd never was in glb_fdset
+        syscall(SYS_close, fd);
+        (void)r;
+    }
+    ~rcv_ring()
+    {
+        munmap(base_, 2 * cap_);
+    }
+    rcv_ring(const rcv_ring &) = delete;
+    rcv_ring &operator=(const rcv_ring &) = delete;
+
+    size_t size() const
+    {
+        return w_ - r_;
+    }
+    size_t space() const
+    {
+        return cap_ - size();
+    }
+    // size() bytes start here
+    const char *data() const
+    {
+        return base_ + (r_ & (cap_ - 1));
+    }
+    // space() bytes start here
+    char *tail()
+    {
+        return base_ + (w_ & (cap_ - 1));
+    }
+    void commit(size_t n)
+    {
+        w_ += n;
+    }
+    void consume(size_t n)
+    {
+        r_ += n;
+    }
+private:
+    char *base_;
+    size_t cap_;
+    uint64_t r_;
+    uint64_t w_;
+};
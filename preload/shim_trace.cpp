@@ -0,0 +1,343 @@
+/**
+ * Host side of the shim trace (see trace.h).
+ *
+ * Drains the rings of every node into one file per daemon thread until
+ * SIGINT/SIGTERM, run it next to the controller:
+ *     ./shim_trace drain /opt/lwc/volumes/ripc <out dir> [interval ms]
+ * and turns such files back into text, or shows what a ring still holds
+ * without draining it, e.g. after a daemon crashed:
+ *     ./shim_trace decode <out dir>/3_1234_1240_<start>.trace
+ *     ./shim_trace decode /opt/lwc/volumes/ripc/emu-real-3/trace_1234_1240_<start>.shm
+ */
+#include "trace.h"
+#include "io_wait.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+namespace fs = std::filesystem;
+
+// starts every drained file
+struct file_hdr {
+    uint64_t magic;
+    int32_t node;
+    int32_t pid;
+    int32_t tid;
+    int32_t pad;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static shim_trace_hdr *map_ring(const std::string &path, bool writable, ino_t *ino = nullptr)
+{
+    int fd = open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    void *addr = MAP_FAILED;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= SHIM_TRACE_MAPSIZ) {
+        addr = mmap(nullptr, SHIM_TRACE_MAPSIZ, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (ino != nullptr) {
+            *ino = st.st_ino;
+        }
+    }
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+    auto *ring = (shim_trace_hdr *)addr;
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != SHIM_TRACE_MAGIC || ring->capacity != SHIM_TRACE_RECORDS) {
+        // not initialized yet, or not a ring of this build
+        munmap(addr, SHIM_TRACE_MAPSIZ);
+        return nullptr;
+    }
+    return ring;
+}
+
+// passes without a record after which a ring's file is closed, so the
+// drainer holds an fd per busy thread rather than per thread ever seen
+constexpr int DRAIN_IDLE_PASSES = 50;
+
+struct Drained {
+    shim_trace_hdr *ring;
+    std::string path; // of the drained file
+    FILE *out;        // nullptr while idle
+    bool created;     // path has its file_hdr
+    bool failed;      // the last open failed, and said so
+    int idle;
+    uint64_t dropped;
+    ino_t ino; // of the file mapped
+};
+
+// the path still names the ring that was mapped, with the magic it had
+static bool still_mapped(const std::string &path, const Drained &d)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && st.st_ino == d.ino
+        && __atomic_load_n(&d.ring->magic, __ATOMIC_ACQUIRE) == SHIM_TRACE_MAGIC;
+}
+
+// appends to what earlier passes wrote, the header only goes into a new file
+static bool open_out(Drained &d)
+{
+    d.out = fopen(d.path.c_str(), d.created ? "a" : "w");
+    if (d.out == nullptr) {
+        if (!d.failed) {
+            perror(d.path.c_str());
+        }
+        d.failed = true;
+        return false;
+    }
+    d.failed = false;
+    if (!d.created) {
+        file_hdr hdr = {SHIM_TRACE_MAGIC, d.ring->node, d.ring->pid, d.ring->tid, 0};
+        fwrite(&hdr, sizeof(hdr), 1, d.out);
+        d.created = true;
+    }
+    return true;
+}
+
+static void close_out(Drained &d)
+{
+    if (d.out != nullptr) {
+        fclose(d.out);
+        d.out = nullptr;
+    }
+}
+
+static void drain_one(Drained &d)
+{
+    shim_trace_hdr *ring = d.ring;
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    if (tail == head && ring->dropped.load(std::memory_order_relaxed) == d.dropped) {
+        if (d.out != nullptr && ++d.idle >= DRAIN_IDLE_PASSES) {
+            close_out(d);
+        }
+        return;
+    }
+    d.idle = 0;
+    if (d.out == nullptr && !open_out(d)) {
+        // the records wait in the ring for the next pass
+        return;
+    }
+    shim_trace_rec *recs = shim_trace_recs(ring);
+    while (tail != head) {
+        uint64_t off = tail & (SHIM_TRACE_RECORDS - 1);
+        uint64_t n = std::min(head - tail, SHIM_TRACE_RECORDS - off);
+        fwrite(recs + off, sizeof(shim_trace_rec), n, d.out);
+        tail += n;
+    }
+    ring->tail.store(tail, std::memory_order_release);
+    uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+    if (dropped != d.dropped) {
+        d.dropped = dropped;
+        shim_trace_rec note = {};
+        note.event = SHIM_TR_DROPPED;
+        note.bytes = dropped;
+        fwrite(&note, sizeof(note), 1, d.out);
+    }
+    fflush(d.out);
+}
+
+static int drain(const std::string &ripc, const std::string &outdir, int interval_ms)
+{
+    signal(SIGINT, [](int) { stop = 1; });
+    signal(SIGTERM, [](int) { stop = 1; });
+    fs::create_directories(outdir);
+    std::map<std::string, Drained> rings;
+    bool last = false;
+    while (!last) {
+        last = stop;
+        std::error_code ec;
+        for (auto &node : fs::directory_iterator(ripc, ec)) {
+            if (node.path().filename().string().rfind("emu-real-", 0) != 0) {
+                continue;
+            }
+            for (auto &f : fs::directory_iterator(node.path(), ec)) {
+                std::string name = f.path().filename().string();
+                if (name.rfind("trace_", 0) != 0 || f.path().extension() != ".shm" || rings.count(f.path().string())) {
+                    continue;
+                }
+                ino_t ino = 0;
+                shim_trace_hdr *ring = map_ring(f.path().string(), true, &ino);
+                if (ring == nullptr) {
+                    continue;
+                }
+                std::string path = outdir + "/" + std::to_string(ring->node) + "_" + std::to_string(ring->pid)
+                                 + "_" + std::to_string(ring->tid) + "_" + std::to_string(ring->start) + ".trace";
+                // opened by the first pass that finds records
+                rings[f.path().string()] = {ring, path, nullptr, false, false, 0, 0, ino};
+            }
+        }
+        for (auto it = rings.begin(); it != rings.end();) {
+            auto &[path, d] = *it;
+            bool mapped = still_mapped(path, d);
+            if (mapped || __atomic_load_n(&d.ring->magic, __ATOMIC_ACQUIRE) == SHIM_TRACE_MAGIC) {
+                // the mapping outlives the name, what the old ring holds is still ours
+                drain_one(d);
+            }
+            if (mapped) {
+                ++it;
+                continue;
+            }
+            // removed or replaced (start_nodes() and restart_nodes() remove a
+            // node's rings), a new file under the name is picked up next round
+            close_out(d);
+            munmap(d.ring, SHIM_TRACE_MAPSIZ);
+            it = rings.erase(it);
+        }
+        if (!last) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+        }
+    }
+    for (auto &[path, d] : rings) {
+        close_out(d);
+        munmap(d.ring, SHIM_TRACE_MAPSIZ);
+    }
+    return 0;
+}
+
+static std::string pevents(int ev)
+{
+    static const std::pair<int, const char *> names[] = {
+        {POLLIN, "IN"}, {POLLPRI, "PRI"}, {POLLOUT, "OUT"}, {POLLERR, "ERR"},
+        {POLLHUP, "HUP"}, {POLLNVAL, "NVAL"}, {POLLRDHUP, "RDHUP"},
+    };
+    std::string str;
+    for (auto [bit, name] : names) {
+        if (ev & bit) {
+            str += str.empty() ? "" : "|";
+            str += name;
+            ev &= ~bit;
+        }
+    }
+    if (ev || str.empty()) {
+        str += (str.empty() ? "" : "|") + std::to_string(ev);
+    }
+    return str;
+}
+
+static void print(const file_hdr &f, const shim_trace_rec &r)
+{
+    if (r.event == SHIM_TR_DROPPED) {
+        printf("# %ld records dropped so far\n", r.bytes);
+        return;
+    }
+    printf("%018ld N%d S%d: ", r.ts / 1000, f.node, f.tid);
+    switch (r.event) {
+    case SHIM_TR_READ:
+        printf("read(%d) = %ld\n", r.fd, r.bytes);
+        break;
+    case SHIM_TR_WRITE:
+        printf("write(%d) = %ld\n", r.fd, r.bytes);
+        break;
+    case SHIM_TR_READV:
+        printf("readv(%d) = %ld\n", r.fd, r.bytes);
+        break;
+    case SHIM_TR_WRITEV:
+        printf("writev(%d) = %ld\n", r.fd, r.bytes);
+        break;
+    case SHIM_TR_PPOLL_ENTER:
+        printf("ppoll(nfds=%d, timeout=%ld(ns))\n", r.fd, r.bytes);
+        break;
+    case SHIM_TR_PPOLL_FAST:
+        printf("ppoll fastpath = %ld\n", r.bytes);
+        break;
+    case SHIM_TR_PPOLL:
+        printf("ppoll slowpath = %ld\n", r.bytes);
+        break;
+    case SHIM_TR_POLLFD:
+        printf("- fd=%d, revents=%s, kernel=%s\n", r.fd, pevents(r.revents).c_str(), pevents(r.bytes).c_str());
+        break;
+    case SHIM_TR_HOLD:
+        printf("hold fd=%d, seq=%ld, nxt_seq=%ld\n", r.fd, r.seq, r.bytes);
+        break;
+    case SHIM_TR_PLD_RECV:
+        printf("recv payload fd=%d, seq=%ld, len=%ld\n", r.fd, r.seq, r.bytes);
+        break;
+    case SHIM_TR_PLD_SEND:
+        printf("send payload fd=%d, n_sent=%ld, len=%ld\n", r.fd, r.seq, r.bytes);
+        break;
+    case SHIM_TR_ACK:
+        printf("ack fd=%d, seq=%ld\n", r.fd, r.seq);
+        break;
+    case SHIM_TR_IDLE:
+        printf("idle fd=%d, consumed=%ld, n_sent=%ld\n", r.fd, r.seq, r.bytes);
+        break;
+    case SHIM_TR_BLOCK:
+        printf("block fd=%d, path=%s, waited=%ld(ns), n_blocks=%ld\n", r.fd, io_wait_path_name(r.revents), r.bytes, r.seq);
+        break;
+    default:
+        printf("unknown event %d\n", r.event);
+    }
+}
+
+static int decode(const std::string &path)
+{
+    if (fs::path(path).extension() == ".shm") {
+        shim_trace_hdr *ring = map_ring(path, false);
+        if (ring == nullptr) {
+            fprintf(stderr, "%s: not a trace ring\n", path.c_str());
+            return 1;
+        }
+        file_hdr f = {SHIM_TRACE_MAGIC, ring->node, ring->pid, ring->tid, 0};
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        for (uint64_t i = ring->tail.load(std::memory_order_acquire); i != head; ++i) {
+            print(f, shim_trace_recs(ring)[i & (SHIM_TRACE_RECORDS - 1)]);
+        }
+        printf("# %ld records dropped\n", ring->dropped.load());
+        munmap(ring, SHIM_TRACE_MAPSIZ);
+        return 0;
+    }
+    FILE *in = fopen(path.c_str(), "r");
+    if (in == nullptr) {
+        perror(path.c_str());
+        return 1;
+    }
+    file_hdr f;
+    if (fread(&f, sizeof(f), 1, in) != 1 || f.magic != SHIM_TRACE_MAGIC) {
+        fprintf(stderr, "%s: not a drained shim trace\n", path.c_str());
+        fclose(in);
+        return 1;
+    }
+    shim_trace_rec r;
+    while (fread(&r, sizeof(r), 1, in) == 1) {
+        print(f, r);
+    }
+    fclose(in);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 4 && argc <= 5 && strcmp(argv[1], "drain") == 0) {
+        return drain(argv[2], argv[3], argc == 5 ? atoi(argv[4]) : 10);
+    }
+    if (argc >= 3 && strcmp(argv[1], "decode") == 0) {
+        int ret = 0;
+        for (int i = 2; i < argc; ++i) {
+            ret |= decode(argv[i]);
+        }
+        return ret;
+    }
+    fprintf(stderr, "usage: %s drain <ripc dir> <out dir> [interval ms]\n"
+                    "       %s decode <.trace or .shm file>...\n", argv[0], argv[0]);
+    return 1;
+}
@@ -0,0 +1,116 @@
+#include "shm_pipe.h"
+#include "debug.h"
+#include "preload.h"
+
+extern "C" {
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sched.h>
+}
+
+/**
+ * open() and close() go straight to the kernel, the fd must not reach
+ * glb_fdset. The controller waits for us to map the file, so nothing can
+ * go without it; the file is unlinked once both ends have it.
+ */
+shm_session::shm_session(int fd, int node, int peer) : fd_(fd), eof_(false)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/ripc/emu-real-%d/shm_%d", node, peer);
+    int shm_fd = syscall(SYS_openat, AT_FDCWD, path, O_RDWR | O_CLOEXEC);
+    if (shm_fd < 0) {
+        fprintf(stderr, "shm: open %s failed: %s\n", path, strerror(errno));
+        assert(0);
+    }
+    void *addr = mmap(nullptr, SHM_SESSION_MAPSIZ, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    syscall(SYS_close, shm_fd);
+    assert(addr != MAP_FAILED);
+    hdr_ = (shm_session_hdr *)addr;
+    assert(__atomic_load_n(&hdr_->magic, __ATOMIC_ACQUIRE) == SHM_PIPE_MAGIC);
+    assert(hdr_->capacity == SHM_PIPE_SIZ && hdr_->node == node && hdr_->peer == peer);
+    unlink(path);
+    LOG("shm: session %d -> %d mapped, fd=%d\n", node, peer, fd);
+}
+
+shm_session::~shm_session()
+{
+    munmap(hdr_, SHM_SESSION_MAPSIZ);
+}
+
+void shm_session::ring()
+{
+    PRELOAD_ORIG(send);
+    char bell = 0;
+    // EAGAIN: the socket is full of doorbells already
+    send_orig(fd_, &bell, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void shm_session::send(const struct iovec *iov, int iovcnt)
+{
+    std::lock_guard<std::mutex> lock(tx_mutex_);
+    for (int i = 0; i < iovcnt; ++i) {
+        const char *buf = (const char *)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            size_t n = shm_pipe_put(&hdr_->up, up_data(), buf, left);
+            buf += n;
+            left -= n;
+            if (left > 0) {
+                // full, the worker drains it once it's rung
+                if (shm_pipe_wake_rx(&hdr_->up)) {
+                    ring();
+                }
+                sched_yield();
+            }
+        }
+    }
+    if (shm_pipe_wake_rx(&hdr_->up)) {
+        ring();
+    }
+}
+
+ssize_t shm_session::recv(void *buf, size_t n)
+{
+    size_t copied = 0;
+    size_t len;
+    const char *data;
+    while (copied < n && (data = shm_pipe_front(&hdr_->down, down_data(), &len)) != nullptr) {
+        size_t step = std::min(len, n - copied);
+        memcpy((char *)buf + copied, data, step);
+        shm_pipe_consume(&hdr_->down, step);
+        copied += step;
+    }
+    if (copied == 0) {
+        if (eof_) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    // the worker may have a backlog waiting for room
+    if (shm_pipe_wake_tx(&hdr_->down)) {
+        ring();
+    }
+    return copied;
+}
+
+void shm_session::drain_doorbells()
+{
+    PRELOAD_ORIG(recv);
+    char bells[64];
+    ssize_t r;
+    while ((r = recv_orig(fd_, bells, sizeof(bells), MSG_DONTWAIT)) > 0) {
+    }
+    if (r == 0) {
+        LOG("shm: fd=%d closed by the controller\n", fd_);
+        eof_ = true;
+    }
+}
+
+void shm_session::wait(io_waiter &waiter)
+{
+    if (arm_rx()) {
+        waiter.wait(fd_, POLLIN);
+    }
+    drain_doorbells();
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "io_wait.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+extern "C" {
+#include <sys/types.h>
+#include <sys/uio.h>
+}
+
+/**
+ * Shared memory transport of a BGP session, offered by the controller
+ * with CTRL_SHM_TRANSPORT=1 and negotiated in the REAL_SYN handshake.
+ *
+ * /ripc/emu-real-<node>/shm_<peer> holds one byte pipe per direction that
+ * carries exactly what the socket would, real_hdr_t framed messages. The
+ * socket stays as the fd the daemon polls and only carries doorbells: a
+ * consumer out of bytes sets rx_waiting before it sleeps on it, and the
+ * producer sends a byte only if it finds the flag set. The controller also
+ * waits for room that way (tx_waiting), the shim yields until the worker
+ * it rang made some.
+ *
+ * Keep in sync with the controller's shm_pipe.hpp.
+ */
+
+constexpr uint64_t SHM_PIPE_MAGIC = 0x31455049504d4853; // "SHMPIPE1"
+constexpr uint32_t SHM_PIPE_SIZ = 1 << 16;              // bytes per direction, a power of 2
+
+struct shm_pipe {
+    alignas(64) std::atomic<uint64_t> head; // bytes written, by the producer
+    std::atomic<uint32_t> tx_waiting;       // the producer found the pipe full
+    alignas(64) std::atomic<uint64_t> tail; // bytes read, by the consumer
+    std::atomic<uint32_t> rx_waiting;       // the consumer sleeps on the doorbell
+};
+
+struct shm_session_hdr {
+    uint64_t magic;
+    uint32_t capacity;
+    int32_t node;
+    int32_t peer;
+    shm_pipe up;   // shim -> controller
+    shm_pipe down; // controller -> shim
+};
+
+constexpr size_t SHM_SESSION_MAPSIZ = sizeof(shm_session_hdr) + 2 * SHM_PIPE_SIZ;
+
+// copies up to n bytes in, returns how many fit
+inline size_t shm_pipe_put(shm_pipe *p, char *data, const void *buf, size_t n)
+{
+    uint64_t head = p->head.load(std::memory_order_relaxed);
+    n = std::min(n, (size_t)(SHM_PIPE_SIZ - (head - p->tail.load(std::memory_order_acquire))));
+    size_t off = head & (SHM_PIPE_SIZ - 1);
+    size_t first = std::min(n, SHM_PIPE_SIZ - off);
+    memcpy(data + off, buf, first);
+    memcpy(data, (const char *)buf + first, n - first);
+    p->head.store(head + n, std::memory_order_release);
+    return n;
+}
+
+// the readable bytes up to the end of the data, nullptr if there are none
+inline const char *shm_pipe_front(shm_pipe *p, const char *data, size_t *len)
+{
+    uint64_t tail = p->tail.load(std::memory_order_relaxed);
+    size_t n = p->head.load(std::memory_order_acquire) - tail;
+    if (n == 0) {
+        return nullptr;
+    }
+    size_t off = tail & (SHM_PIPE_SIZ - 1);
+    *len = std::min(n, SHM_PIPE_SIZ - off);
+    return data + off;
+}
+
+inline void shm_pipe_consume(shm_pipe *p, size_t n)
+{
+    p->tail.store(p->tail.load(std::memory_order_relaxed) + n, std::memory_order_release);
+}
+
+/**
+ * Before sleeping on the doorbell: false if bytes came in meanwhile, the
+ * consumer goes on reading instead. Pairs with shm_pipe_wake_rx(), one of
+ * the two sides sees the other's store.
+ */
+inline bool shm_pipe_arm_rx(shm_pipe *p)
+{
+    p->rx_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (p->head.load(std::memory_order_relaxed) != p->tail.load(std::memory_order_relaxed)) {
+        p->rx_waiting.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+// after a put: whether the consumer sleeps and needs a doorbell
+inline bool shm_pipe_wake_rx(shm_pipe *p)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return p->rx_waiting.load(std::memory_order_relaxed) && p->rx_waiting.exchange(0);
+}
+
+// same pair for a producer waiting for room
+inline bool shm_pipe_arm_tx(shm_pipe *p)
+{
+    p->tx_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (p->head.load(std::memory_order_relaxed) - p->tail.load(std::memory_order_relaxed) < SHM_PIPE_SIZ) {
+        p->tx_waiting.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+inline bool shm_pipe_wake_tx(shm_pipe *p)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return p->tx_waiting.load(std::memory_order_relaxed) && p->tx_waiting.exchange(0);
+}
+
+// shim end of a session's pipes
+class shm_session {
+public:
+    // maps the file the controller offered, fd is the session's socket
+    shm_session(int fd, int node, int peer);
+    ~shm_session();
+    shm_session(const shm_session &) = delete;
+    shm_session &operator=(const shm_session &) = delete;
+
+    // all of iov to the controller
+    void send(const struct iovec *iov, int iovcnt);
+    // like read(): -1 and EAGAIN while the pipe is empty, 0 once the controller closed the session
+    ssize_t recv(void *buf, size_t n);
+    // the daemon is going to sleep on the socket: false if bytes came in meanwhile
+    bool arm_rx()
+    {
+        return shm_pipe_arm_rx(&hdr_->down);
+    }
+    // after the kernel reported POLLIN: reads the doorbells, notes the end of the session
+    void drain_doorbells();
+    // the pipe is empty on a read that must complete, as READ_UNTIL waits on EAGAIN
+    void wait(io_waiter &waiter);
+private:
+    int fd_;
+    shm_session_hdr *hdr_;
+    bool eof_;
+    // acks and idle reports may come from other threads than the payloads
+    std::mutex tx_mutex_;
+    char *up_data()
+    {
+        return (char *)(hdr_ + 1);
+    }
+    char *down_data()
+    {
+        return (char *)(hdr_ + 1) + SHM_PIPE_SIZ;
+    }
+    void ring();
+};
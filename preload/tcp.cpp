@@ -1,69 +1,307 @@
 #include "tcp.h"
 #include "preload.h"
+#include "trace.h"
 #include <set>
 #include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+extern "C" {
+#include <limits.h>
+}
 
 std::atomic<size_t> nxt_seq = 1;
+std::atomic<size_t> n_sent_msgs = 0;
 
 bool tcp_fdesc::is_bgp_conn() const {
     return is_bgp_ && !is_listener;
 }
 
-static void send_one_msg(int fd, int peer_id, const void *buf, size_t count)
+// BGP header: 16 bytes of marker, 2 bytes of length, 1 byte of type
+constexpr int BGP_HDRSIZ = 19;
+constexpr int BGP_MAXSIZ = 4096;
+
+// walks the caller's buffers of one write()/writev()
+struct iov_cursor {
+    const struct iovec *iov;
+    int iovcnt;
+    size_t off;
+    size_t remaining;
+
+    iov_cursor(const struct iovec *_iov, int _iovcnt) : iov(_iov), iovcnt(_iovcnt), off(0), remaining(0)
+    {
+        for (int i = 0; i < iovcnt; ++i) {
+            remaining += iov[i].iov_len;
+        }
+        skip_empty();
+    }
+    void skip_empty()
+    {
+        while (iovcnt > 0 && off == iov->iov_len) {
+            iov++;
+            iovcnt--;
+            off = 0;
+        }
+    }
+    const char *ptr() const
+    {
+        return (const char *)iov->iov_base + off;
+    }
+    size_t contiguous() const
+    {
+        return iovcnt > 0 ? iov->iov_len - off : 0;
+    }
+    void advance(size_t n)
+    {
+        remaining -= n;
+        while (n > 0) {
+            size_t step = std::min(n, iov->iov_len - off);
+            off += step;
+            n -= step;
+            skip_empty();
+        }
+    }
+    // copies n bytes without consuming them
+    void peek(void *dst, size_t n) const
+    {
+        iov_cursor c = *this;
+        while (n > 0) {
+            size_t step = std::min(n, c.contiguous());
+            memcpy(dst, c.ptr(), step);
+            dst = (char *)dst + step;
+            n -= step;
+            c.advance(step);
+        }
+    }
+    // appends the next n bytes to out as slices of the caller's buffers
+    void take(std::vector<struct iovec> &out, size_t n)
+    {
+        while (n > 0) {
+            size_t step = std::min(n, contiguous());
+            out.push_back({(void *)ptr(), step});
+            n -= step;
+            advance(step);
+        }
+    }
+};
+
+/**
+ * Writes all of iov, IOV_MAX entries at a time, waiting out EAGAIN the way
+ * WRITE_UNTIL does. iov is consumed.
+ */
+static void writev_until(int fd, struct iovec *iov, int iovcnt)
 {
     PRELOAD_ORIG(writev);
-    real_pld_t pld = (real_pld_t) {
-        .hdr = (real_hdr_t) {
-            .msg_type = REAL_PAYLOAD,
-            .msg_len = (int)count + pldhdrsiz
-            // seq is filled by controller
-        },
-        .src_id = tls_selfid,
-        .dst_id = peer_id
-    };
-    struct iovec iov_out[2];
-    iov_out[0].iov_base = &pld;
-    iov_out[0].iov_len = pldhdrsiz;
-    iov_out[1].iov_base = (void *)buf;
-    iov_out[1].iov_len = count;
-    int r = writev_orig(fd, iov_out, 2);
-    if (r == (ssize_t)(pldhdrsiz + count)) {
+    io_waiter waiter(IO_WAIT_WRITEV);
+    while (iovcnt > 0) {
+        ssize_t r = writev_orig(fd, iov, std::min(iovcnt, IOV_MAX));
+        LOG("writev_until: writev_orig(fd=%d, iovcnt=%d) = %ld\n", fd, iovcnt, r);
+        if (r < 0) {
+            LOG("err = %d: %s\n", errno, strerror(errno));
+            assert(errno == EAGAIN);
+            waiter.wait(fd, POLLOUT);
+            continue;
+        }
+        while (iovcnt > 0 && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (r > 0) {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+}
+
+// IMAGE_CRPD daemons wait on the kernel fd behind our back, which a shm session only rings;
+// the controller offers no shm on the mux
+#if defined(IMAGE_CRPD) || defined(PRELOAD_MUX)
+constexpr uint16_t SHM_CAPABLE = 0;
+#else
+constexpr uint16_t SHM_CAPABLE = REAL_SYN_SHM;
+#endif
+
+// a message of our own to the controller, in order with the payloads
+void tcp_fdesc::ctrl_write(const void *buf, size_t len)
+{
+    if (shm) {
+        struct iovec iov = {(void *)buf, len};
+        shm->send(&iov, 1);
         return;
     }
-    if (r < 0) {
-        r = 0;
+    if (msess) {
+        auto lock = glb_mux->lock_tx();
+        WRITE_UNTIL(glb_mux->fd(), buf, len);
+        return;
     }
-    int len1 = std::max(pldhdrsiz - r, 0);
-    int len2 = std::min(count + pldhdrsiz - r, count);
-    if (len1) {
-        WRITE_UNTIL(fd, (char *)(&pld) + pldhdrsiz - len1, len1);
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    WRITE_UNTIL(fd, buf, len);
+}
+
+// the message seq is consumed, which returns a replay credit to the controller
+void tcp_fdesc::send_ack(int64_t seq)
+{
+    real_hdr_t ack = (real_hdr_t) {
+        .msg_type = REAL_ACK,
+        .msg_len = hdrsiz,
+        .seq = seq
+    };
+    TRACE(SHIM_TR_ACK, fd, 0, seq, 0);
+    ctrl_write(&ack, hdrsiz);
+}
+
+/**
+ * Reports (consumed seq, sent messages, ppoll() timeout) when every thread
+ * of the daemon blocks (idle.h), so the controller can tell a converged
+ * daemon from a slow one or one waiting for a timer to send. Nothing is
+ * sent if none changed since the last report, a timeout counts as changed
+ * when the timer it ends at does.
+ */
+bool tcp_fdesc::report_idle(long timeout_ns)
+{
+    static std::mutex report_mutex;
+    static size_t last_consumed = SIZE_MAX, last_sent = SIZE_MAX;
+    static long last_deadline = -1;
+    if (!is_bgp_conn() || sock_state_ != REAL_TCP_ESTABLISHED) {
+        return false;
     }
-    if (len2) {
-        WRITE_UNTIL(fd, (char *)buf + count - len2, len2);
+    long deadline = -1;
+    if (timeout_ns >= 0) {
+        struct timespec now;
+        clock_gettime_orig(CLOCK_MONOTONIC, &now);
+        deadline = now.tv_sec * 1'000'000'000L + now.tv_nsec + timeout_ns;
     }
+    std::unique_lock lock(report_mutex);
+    size_t consumed = nxt_seq - 1, sent = n_sent_msgs;
+    // a ppoll() that got interrupted and resumes waits for the same timer
+    bool same_timer = (deadline < 0) == (last_deadline < 0)
+        && std::abs(deadline - last_deadline) < IDLE_TIMER_SLACK;
+    if (consumed == last_consumed && sent == last_sent && same_timer) {
+        return true;
+    }
+    real_idle_t idle = (real_idle_t) {
+        .hdr = (real_hdr_t) {
+            .msg_type = REAL_IDLE,
+            .msg_len = idlesiz,
+            .seq = (int64_t)consumed
+        },
+        .n_sent = (int64_t)sent,
+        .timeout_ns = timeout_ns
+    };
+    TRACE(SHIM_TR_IDLE, fd, sent, consumed, 0);
+    ctrl_write(&idle, idlesiz);
+    last_consumed = consumed;
+    last_sent = sent;
+    last_deadline = deadline;
+    return true;
 }
 
-static int fill_until(BgpMessage &msg, const char *buf, int count, int goal)
+// copies from in until msg holds goal bytes, or in is exhausted
+static void fill_until(BgpMessage &msg, iov_cursor &in, int goal)
 {
-    if (msg.len >= goal) {
-        return 0;
+    if (msg.cap < goal) {
+        msg.cap = std::max(goal, BGP_MAXSIZ);
+        msg.buf = (char *)realloc(msg.buf, msg.cap);
     }
-    int filled = std::min(count, goal - msg.len);
-    if (msg.buf == nullptr) {
-        msg.buf = (char *)malloc(goal);
-        msg.cap = goal;
+    while (msg.len < goal && in.remaining > 0) {
+        int filled = std::min((size_t)(goal - msg.len), in.contiguous());
+        memcpy(msg.buf + msg.len, in.ptr(), filled);
+        msg.len += filled;
+        in.advance(filled);
+    }
+}
 
-        memcpy(msg.buf, buf, filled);
-        msg.len = filled;
-    } else {
-        if (msg.len + filled > msg.cap) {
-            msg.cap = msg.len + filled;
-            msg.buf = (char *)realloc(msg.buf, msg.cap);
+/**
+ * Frames the BGP messages of one write()/writev() as REAL_PAYLOADs and
+ * sends them with a single writev. Complete messages go out straight from
+ * the caller's buffers; only a message cut at either end of the call is
+ * copied, into msg, whose buffer is kept for the next one.
+ */
+ssize_t tcp_fdesc::send_bgp(const struct iovec *iov, int iovcnt)
+{
+    thread_local std::vector<real_pld_t> hdrs;
+    thread_local std::vector<struct iovec> out;
+    hdrs.clear();
+    out.clear();
+    iov_cursor in(iov, iovcnt);
+    ssize_t ret = in.remaining;
+
+    auto frame = [&](int bgplen) {
+        hdrs.push_back((real_pld_t) {
+            .hdr = (real_hdr_t) {
+                .msg_type = REAL_PAYLOAD,
+                .msg_len = bgplen + pldhdrsiz
+                // seq is filled by controller
+            },
+            .src_id = tls_selfid,
+            .dst_id = peer_id
+        });
+        // hdrs may still move, its entries are filled in before sending
+        out.push_back({nullptr, (size_t)pldhdrsiz});
+        n_sent_msgs++;
+        TRACE(SHIM_TR_PLD_SEND, fd, bgplen, n_sent_msgs.load(), 0);
+    };
+
+    // 1. complete the message the last call left partial
+    bool pending_done = false;
+    if (msg.len > 0) {
+        fill_until(msg, in, BGP_HDRSIZ);
+        if (msg.len >= BGP_HDRSIZ) {
+            int bgplen = ntohs(((short *)msg.buf)[8]);
+            debug_assert(bgplen >= BGP_HDRSIZ);
+            fill_until(msg, in, bgplen);
+            if (msg.len == bgplen) {
+                LOG("Send BGP Message bgplen %d, type %d\n", bgplen, ((char *)msg.buf)[18]);
+                frame(bgplen);
+                out.push_back({msg.buf, (size_t)bgplen});
+                pending_done = true;
+            }
         }
-        memcpy(msg.buf + msg.len, buf, filled);
-        msg.len += filled;
     }
-    return filled;
+    // 2. complete messages from the caller's buffers
+    while (in.remaining >= BGP_HDRSIZ) {
+        char bgphdr[BGP_HDRSIZ];
+        in.peek(bgphdr, BGP_HDRSIZ);
+        int bgplen = ntohs(((short *)bgphdr)[8]);
+        debug_assert(bgplen >= BGP_HDRSIZ);
+        if (in.remaining < (size_t)bgplen) {
+            break;
+        }
+        LOG("Send BGP Message bgplen %d, type %d\n", bgplen, bgphdr[18]);
+        frame(bgplen);
+        in.take(out, bgplen);
+    }
+
+    if (!out.empty()) {
+        size_t k = 0;
+        for (auto &v : out) {
+            if (v.iov_base == nullptr) {
+                v.iov_base = &hdrs[k++];
+            }
+        }
+        if (shm) {
+            shm->send(out.data(), out.size());
+        } else if (msess) {
+            auto lock = glb_mux->lock_tx();
+            writev_until(glb_mux->fd(), out.data(), out.size());
+        } else {
+            std::lock_guard<std::mutex> lock(tx_mutex);
+            writev_until(fd, out.data(), out.size());
+        }
+    }
+    // the message of step 1 is out, msg now takes the trailing one
+    if (pending_done) {
+        msg.len = 0;
+    }
+    // 3. keep the trailing partial message
+    if (in.remaining > 0) {
+        debug_assert(msg.len == 0);
+        fill_until(msg, in, in.remaining);
+    }
+    return ret;
 }
 
 ssize_t tcp_fdesc::write(const void *buf, size_t count)
@@ -76,39 +314,8 @@ ssize_t tcp_fdesc::write(const void *buf, size_t count)
         errno = ENOTCONN;
         return -1;
     }
-    int eaten = 0;
-    int filled = 0;
-    while (eaten < count) {
-        int remlen = count - eaten;
-        char *rembuf = ((char *)buf + eaten);
-
-        // 1. fill until bgp_hdr can be parsed
-        filled = fill_until(msg, rembuf, remlen, 19);
-        eaten += filled;
-        rembuf += filled;
-        remlen -= filled;
-        if (msg.len < 19) {
-            debug_assert(eaten == count);
-            break;
-        }
-
-        int bgplen = ntohs(((short *)msg.buf)[8]);
-        int bgptype = ((char *)msg.buf)[18];
-
-        // 2. fill until bgp msg is complete
-        filled = fill_until(msg, rembuf, remlen, bgplen);
-        eaten += filled;
-        rembuf += filled;
-        remlen -= filled;
-
-        if (msg.len == bgplen) {
-            LOG("Send BGP Message bgplen %d, type %d\n", bgplen, bgptype);
-            send_one_msg(this->fd, this->peer_id, msg.buf, msg.len);
-            free(msg.buf);
-            msg = {nullptr, 0, 0};
-        }
-    }
-    return count;
+    struct iovec iov = {(void *)buf, count};
+    return send_bgp(&iov, 1);
 }
 
 ssize_t tcp_fdesc::send(const void *buf, size_t len, int flags)
@@ -123,7 +330,6 @@ ssize_t tcp_fdesc::send(const void *buf, size_t len, int flags)
 ssize_t tcp_fdesc::writev(const struct iovec *iov, int iovcnt)
 {
     PRELOAD_ORIG(writev);
-    PRELOAD_ORIG(write);
     if (!this->is_bgp_) {
         return writev_orig(this->fd, iov, iovcnt);
     }
@@ -131,89 +337,150 @@ ssize_t tcp_fdesc::writev(const struct iovec *iov, int iovcnt)
         errno = ENOTCONN;
         return -1;
     }
-    int ret = 0;
-    for (int i = 0; i < iovcnt; ++i) {
-        ret += iov[i].iov_len;
-    }
-    for (int i = 0; i < iovcnt; ++i) {
-        int eaten = 0;
-        int filled = 0;
-        while (eaten < iov[i].iov_len) {
-            int remlen = iov[i].iov_len - eaten;
-            char *rembuf = ((char *)iov[i].iov_base + eaten);
-
-            // 1. fill until bgp_hdr can be parsed
-            filled = fill_until(msg, rembuf, remlen, 19);
-            eaten += filled;
-            rembuf += filled;
-            remlen -= filled;
-            if (msg.len < 19) {
-                debug_assert(eaten == iov[i].iov_len);
-                break;
-            }
-
-            int bgplen = ntohs(((short *)msg.buf)[8]);
-            int bgptype = ((char *)msg.buf)[18];
+    return send_bgp(iov, iovcnt);
+}
 
-            // 2. fill until bgp msg is complete
-            filled = fill_until(msg, rembuf, remlen, bgplen);
-            eaten += filled;
-            rembuf += filled;
-            remlen -= filled;
+/**
+ * One read() of whatever the socket holds into rcv_buf, or a copy out of
+ * the shm pipe or the session's mux queue, which costs no syscall. Daemons that may wait on the
+ * kernel fd behind our back (IMAGE_CRPD) get nothing past the end of the
+ * current message, the kernel must keep reporting the rest. 0 marks the
+ * end of the stream.
+ */
+ssize_t tcp_fdesc::rcv_fill()
+{
+    PRELOAD_ORIG(read);
+    if (!rcv_buf) {
+        rcv_buf = std::make_unique<rcv_ring>(RCV_RING_SIZ);
+    }
+    size_t n = rcv_buf->space();
+#ifdef IMAGE_CRPD
+    size_t goal = rcv_pending ? rcv_hdr.hdr.msg_len - pldhdrsiz - rcv_offset : pldhdrsiz;
+    n = goal > rcv_buf->size() ? std::min(n, goal - rcv_buf->size()) : 0;
+#endif
+    if (n == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t r = shm ? shm->recv(rcv_buf->tail(), n) :
+                msess ? glb_mux->recv(*msess, rcv_buf->tail(), n) : read_orig(fd, rcv_buf->tail(), n);
+    LOG("rcv_fill: read_orig(%d, %zu) = %ld, buffered %zu\n", fd, n, r, rcv_buf->size() + std::max(r, (ssize_t)0));
+    if (r > 0) {
+        rcv_buf->commit(r);
+    } else if (r == 0) {
+        rcv_eof = true;
+    }
+    return r;
+}
 
-            if (msg.len == bgplen) {
-                LOG("Send BGP Message bgplen %d, type %d\n", bgplen, bgptype);
-                send_one_msg(this->fd, this->peer_id, msg.buf, msg.len);
-                free(msg.buf);
-                msg = {nullptr, 0, 0};
-            }
+// waits until rcv_buf holds n bytes as READ_UNTIL does, false at the end of the stream
+bool tcp_fdesc::rcv_need(size_t n)
+{
+    io_waiter waiter(IO_WAIT_RCV);
+    while (rcv_buf->size() < n) {
+        if (rcv_eof) {
+            return false;
+        }
+        ssize_t r = rcv_fill();
+        if (r < 0) {
+            LOG("err = %d: %s\n", errno, strerror(errno));
+        }
+        assert(r >= 0 || errno == EAGAIN);
+        if (r < 0 && shm) {
+            shm->wait(waiter);
+        } else if (r < 0 && msess) {
+            glb_mux->wait(*msess, waiter);
+        } else if (r < 0) {
+            waiter.wait(fd, POLLIN);
         }
     }
-    return ret;
+    return true;
 }
 
-ssize_t tcp_fdesc::read_internal(char *buf, int buflen)
+// header of the next message, if it's buffered and no message is half read
+bool tcp_fdesc::rcv_front(real_pld_t &hdr) const
 {
-    PRELOAD_ORIG(read);
-    PRELOAD_ORIG(recv);
-    ssize_t ret;
-    LOG("tcp_fdesc::read_internal(buf=%p, buflen=%d)\n",buf, buflen);
+    if (rcv_pending || !rcv_buf || rcv_buf->size() < pldhdrsiz) {
+        return false;
+    }
+    memcpy(&hdr, rcv_buf->data(), pldhdrsiz);
+    return true;
+}
 
-    /* Check is there any data to read */
-    ret = recv_orig(fd, NULL, 0, MSG_PEEK);
-    if (ret == -1 && !rcv_pending) {
-        errno = EAGAIN;
-        return -1;
+// whether a read() now returns data of message nxt_seq, or the end of the stream
+bool tcp_fdesc::rcv_ready() const
+{
+    if (rcv_eof) {
+        return true;
+    }
+    if (rcv_pending) {
+        return rcv_buf->size() > 0;
+    }
+    real_pld_t hdr;
+    return rcv_front(hdr) && hdr.hdr.seq == (int64_t)nxt_seq;
+}
+
+/**
+ * Serves a read of at most one message out of rcv_buf: the header is taken
+ * first, then as much payload as iov holds. The whole message is acked
+ * once it is read.
+ */
+ssize_t tcp_fdesc::read_internal(const struct iovec *iov, int iovcnt)
+{
+    size_t buflen = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        buflen += iov[i].iov_len;
     }
+    LOG("tcp_fdesc::read_internal(iovcnt=%d, buflen=%zu)\n", iovcnt, buflen);
 
-    /* 1. read the header */
+    /* 1. take the header */
     if (!this->rcv_pending) {
-        READ_UNTIL(fd, &this->rcv_hdr, pldhdrsiz);
+        if (!rcv_buf || rcv_buf->size() < pldhdrsiz) {
+            rcv_fill();
+        }
+        if (rcv_buf->size() == 0) {
+            if (rcv_eof) {
+                return 0;
+            }
+            errno = EAGAIN;
+            return -1;
+        }
+        if (!rcv_need(pldhdrsiz)) {
+            return 0;
+        }
+        memcpy(&this->rcv_hdr, rcv_buf->data(), pldhdrsiz);
+        rcv_buf->consume(pldhdrsiz);
         this->rcv_offset = 0;
         this->rcv_pending = true;
+#ifndef IMAGE_CRPD
+        assert(nxt_seq == rcv_hdr.hdr.seq);
+#endif
     }
 
-    /**
-     * 1.5 read the payload up to buflen.
-     * Note that we must not read the entire message,
-     * otherwise epoll_wait() won't return this fd.
-     */
-    int n_copy = std::min((int)(this->rcv_hdr.hdr.msg_len - pldhdrsiz - rcv_offset), (int)buflen);
-    READ_UNTIL(fd, buf, n_copy);
-
-    /* 2. read the payload*/
+    /* 2. copy the payload up to buflen */
+    size_t n_copy = std::min((size_t)(this->rcv_hdr.hdr.msg_len - pldhdrsiz - rcv_offset), buflen);
+    n_copy = std::min(n_copy, RCV_RING_SIZ);
+    if (!rcv_need(n_copy)) {
+        return 0;
+    }
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt && copied < n_copy; ++i) {
+        size_t step = std::min(iov[i].iov_len, n_copy - copied);
+        memcpy(iov[i].iov_base, rcv_buf->data() + copied, step);
+        copied += step;
+    }
+    rcv_buf->consume(n_copy);
     rcv_offset += n_copy;
 
-#ifndef IMAGE_CRPD
-    assert(nxt_seq == rcv_hdr.hdr.seq);
-#endif
-    nxt_msghdr_seen = false;
-
     if (rcv_offset == this->rcv_hdr.hdr.msg_len - pldhdrsiz) {
         // complete message
         rcv_pending = false;
         rcv_offset = 0;
         nxt_seq++;
+        TRACE(SHIM_TR_PLD_RECV, fd, rcv_hdr.hdr.msg_len - pldhdrsiz, rcv_hdr.hdr.seq, 0);
+        if (acks) {
+            send_ack(rcv_hdr.hdr.seq);
+        }
     }
 
     return n_copy;
@@ -222,41 +489,16 @@ ssize_t tcp_fdesc::read_internal(char *buf, int buflen)
 ssize_t tcp_fdesc::read(void *buf, size_t count)
 {
     PRELOAD_ORIG(read);
-    PRELOAD_ORIG(recv);
     if (!this->is_bgp_) {
         return read_orig(this->fd, buf, count);
     }
-    if (this->sock_state_ != REAL_TCP_ESTABLISHED) {
-        errno = ENOTCONN;
-        return -1;
-    }
-
-    ssize_t ret;
-    LOG("tcp_fdesc::read(buf=%p, count=%d)\n", buf, (int)count);
-
-    if (this->pollhup) {
-        LOG("pollhup\n");
-        return 0;
-    }
-
-#ifndef IMAGE_CRPD
-    if (!nxt_msghdr_seen) {
-        // second read, not allowed by ppoll() yet
-        errno = EAGAIN;
-        return -1;
-    }
-#endif
-
-    ret = read_internal((char *)buf, count);
-    LOG("tcp_fdesc::read(buf=%p, count=%d) = %ld\n", buf, (int)count, ret);
-    return ret;
+    struct iovec iov = {buf, count};
+    return readv(&iov, 1);
 }
 
 ssize_t tcp_fdesc::readv(const struct iovec *iov, int iovcnt)
 {
-    PRELOAD_ORIG(read);
     PRELOAD_ORIG(readv);
-    PRELOAD_ORIG(recv);
     if (!this->is_bgp_) {
         return readv_orig(this->fd, iov, iovcnt);
     }
@@ -269,18 +511,24 @@ ssize_t tcp_fdesc::readv(const struct iovec *iov, int iovcnt)
     LOG("tcp_fdesc::readv(iovcnt=%d)\n", iovcnt);
 
     if (this->pollhup) {
+        LOG("pollhup\n");
         return 0;
     }
 
+    if (shm || msess) {
+        // no syscall, take what the controller put in the pipe
+        rcv_fill();
+    }
 #ifndef IMAGE_CRPD
-    if (!nxt_msghdr_seen) {
-        // second read, not allowed by ppoll() yet
+    if (!rcv_ready()) {
+        // nothing of message nxt_seq is buffered, ppoll() first
         errno = EAGAIN;
         return -1;
     }
 #endif
 
-    ret = read_internal((char *)iov[0].iov_base, iov[0].iov_len);
+    ret = read_internal(iov, iovcnt);
+    LOG("tcp_fdesc::readv(iovcnt=%d) = %ld\n", iovcnt, ret);
     return ret;
 }
 
@@ -426,28 +674,32 @@ int tcp_fdesc::connect(const struct sockaddr *addr, socklen_t addrlen)
 
     glb_fdset.set_nht_ready(peer_id);
 
-    // 0.5 build mng channel
-    struct sockaddr_un uds_srcaddr = {.sun_family = AF_UNIX };
-    sprintf(uds_srcaddr.sun_path, "/ripc/emu-real-%d/%d", tls_selfid, peer_id);
-    int ret = unlink(uds_srcaddr.sun_path);
-    if (ret < 0 && errno != ENOENT) {
-        fprintf(stderr, "connect_impl(): unlink [%s] before bind failed: %s", uds_srcaddr.sun_path, strerror(errno));
-        assert(0);
-    }
-    ret = bind_orig(this->fd, (struct sockaddr *)&uds_srcaddr, sizeof(uds_srcaddr));
-    if (ret < 0) {
-        LOG("connect_impl(): bind(%d, addr=%s) for binding client to path failed: %s\n",
-            this->fd, uds_srcaddr.sun_path, strerror(errno));
-    }
+    // 0.5 build mng channel, or open the session on the mux, fd becomes its eventfd
+    if (shim_mux *mux = shim_mux::get()) {
+        msess = mux->connect(this->fd, peer_id);
+    } else {
+        struct sockaddr_un uds_srcaddr = {.sun_family = AF_UNIX };
+        sprintf(uds_srcaddr.sun_path, "/ripc/emu-real-%d/%d", tls_selfid, peer_id);
+        int ret = unlink(uds_srcaddr.sun_path);
+        if (ret < 0 && errno != ENOENT) {
+            fprintf(stderr, "connect_impl(): unlink [%s] before bind failed: %s", uds_srcaddr.sun_path, strerror(errno));
+            assert(0);
+        }
+        ret = bind_orig(this->fd, (struct sockaddr *)&uds_srcaddr, sizeof(uds_srcaddr));
+        if (ret < 0) {
+            LOG("connect_impl(): bind(%d, addr=%s) for binding client to path failed: %s\n",
+                this->fd, uds_srcaddr.sun_path, strerror(errno));
+        }
 
-    struct sockaddr_un mng_addr;
-    mng_addr.sun_family = AF_UNIX;
-    strncpy(mng_addr.sun_path, MNG_SOCKET_PATH, sizeof(mng_addr.sun_path) - 1);
-    int r = connect_orig(this->fd, (const sockaddr*)&mng_addr, sizeof(mng_addr));
-    if (r != 0) {
-        fprintf(stderr, "connect_orig(this->fd=%d)=%d, error: %s\n", this->fd, r, strerror(errno));
+        struct sockaddr_un mng_addr;
+        mng_addr.sun_family = AF_UNIX;
+        strncpy(mng_addr.sun_path, MNG_SOCKET_PATH, sizeof(mng_addr.sun_path) - 1);
+        int r = connect_orig(this->fd, (const sockaddr*)&mng_addr, sizeof(mng_addr));
+        if (r != 0) {
+            fprintf(stderr, "connect_orig(this->fd=%d)=%d, error: %s\n", this->fd, r, strerror(errno));
+        }
+        debug_assert(r == 0);
     }
-    debug_assert(r == 0);
 
     /* 1. construct SYN pakcet */
     real_syn_t syn = (real_syn_t) {
@@ -456,15 +708,20 @@ int tcp_fdesc::connect(const struct sockaddr *addr, socklen_t addrlen)
             .msg_len = synsiz
         },
         .cli_id = tls_selfid,
-        .svr_id = peer_id
+        .svr_id = peer_id,
+        .flags = SHM_CAPABLE
     };
 
     /* 2. send SYN packet */
-    WRITE_UNTIL(this->fd, &syn, synsiz);
+    ctrl_write(&syn, synsiz);
 
     /* 3. wait for SYNACK */
     real_synack_t synack;
-    READ_UNTIL(this->fd, &synack, synacksiz);
+    if (msess) {
+        glb_mux->read_until(*msess, &synack, synacksiz);
+    } else {
+        READ_UNTIL(this->fd, &synack, synacksiz);
+    }
     assert(synack.hdr.msg_type == REAL_SYNACK);
     assert(synack.hdr.msg_len == sizeof(real_synack_t));
 
@@ -482,6 +739,12 @@ int tcp_fdesc::connect(const struct sockaddr *addr, socklen_t addrlen)
         return -1;
     }
 
+    if (synack.flags & REAL_SYN_SHM) {
+        // the controller mapped the pipes before it answered
+        shm = std::make_unique<shm_session>(this->fd, tls_selfid, peer_id);
+    }
+    acks = synack.flags & REAL_SYN_ACKS;
+
     this->peer_id = peer_id;
     this->peer_addr = ((struct sockaddr_in *)addr)->sin_addr.s_addr;
     this->peer_port =((struct sockaddr_in *)addr)->sin_port; // 179
@@ -562,7 +825,18 @@ tcp_fdesc::accept4(struct sockaddr *addr, socklen_t *addrlen, int flags, fdesc_s
     }
     LOG("tcp::accept4(fd=%d)\n", this->fd);
     PRELOAD_ORIG(accept4)
-    int ret = accept4_orig(this->fd, nullptr, nullptr, flags);
+    std::shared_ptr<mux_session> s;
+    int ret;
+    if (mux_listener) {
+        // the session's eventfd is the new fd
+        s = glb_mux->accept();
+        ret = s ? s->efd : -1;
+        if (!s) {
+            errno = EAGAIN;
+        }
+    } else {
+        ret = accept4_orig(this->fd, nullptr, nullptr, flags);
+    }
     LOG("accept4_orig(fd=%d)=%d\n", this->fd, ret);
     if (ret <= 0) {
         LOG("Hijacked TCP accept(fd=%d)=%d, error=%s\n",
@@ -572,7 +846,11 @@ tcp_fdesc::accept4(struct sockaddr *addr, socklen_t *addrlen, int flags, fdesc_s
 
     /* receive the syn packet to know peer id */
     real_syn_t syn;
-    READ_UNTIL(ret, &syn, synsiz);
+    if (s) {
+        glb_mux->read_until(*s, &syn, synsiz);
+    } else {
+        READ_UNTIL(ret, &syn, synsiz);
+    }
     int peer_id = syn.cli_id;
     uint16_t port_no = htons(syn.cli_port); // network order
 
@@ -597,6 +875,24 @@ tcp_fdesc::accept4(struct sockaddr *addr, socklen_t *addrlen, int flags, fdesc_s
         ntohs(this->self_port) == BGP_PORT
     );
     fdesc_ptr->sock_state_ = REAL_TCP_ESTABLISHED;
+    fdesc_ptr->msess = std::move(s);
+    fdesc_ptr->acks = syn.flags & REAL_SYN_ACKS;
+    if (syn.flags & REAL_SYN_SHM) {
+        // the controller holds the session until we answer its offer, in
+        // the pipe if we take it
+        real_synack_t synack = (real_synack_t) {
+            .hdr = (real_hdr_t) {
+                .msg_type = REAL_SYNACK,
+                .msg_len = synacksiz
+            },
+            .cli_port = 0,
+            .flags = SHM_CAPABLE
+        };
+        if (SHM_CAPABLE) {
+            fdesc_ptr->shm = std::make_unique<shm_session>(ret, tls_selfid, peer_id);
+        }
+        fdesc_ptr->ctrl_write(&synack, synacksiz);
+    }
     int ufd = fdset.emplace(std::move(fdesc_ptr));
 
     /* just logging */
@@ -669,6 +965,11 @@ int tcp_fdesc::bind(const struct sockaddr * addr, socklen_t addrlen)
     this->self_port = ((struct sockaddr_in *)addr)->sin_port;
     this->is_bgp_ = ntohs(this->self_port) == BGP_PORT;
     // TODO: switch to inet socket and replay fd operations for normal sockets
+    if (this->is_bgp_ && shim_mux::get()) {
+        // the controller connects over the mux, which is open from now on
+        LOG("Hijacked TCP bind(%d) to the mux\n", this->fd);
+        return 0;
+    }
 
     int ret;
     struct sockaddr_un uds_addr = {.sun_family = AF_UNIX };
@@ -695,6 +996,11 @@ int tcp_fdesc::listen(int backlog)
 {
     PRELOAD_ORIG(listen);
     this->is_listener = true;
+    if (this->is_bgp_ && glb_mux) {
+        glb_mux->listen(this->fd);
+        mux_listener = true;
+        return 0;
+    }
     return listen_orig(this->fd, 1000);
 }
 
@@ -708,32 +1014,64 @@ bool tcp_fdesc::poll_fastpath(struct pollfd *ufd)
         ufd->revents = 0;
         return true;
     }
+    if (mux_listener && (ufd->events & POLLIN) && glb_mux->acceptable()) {
+        ufd->revents = POLLIN;
+        return true;
+    }
     if (sock_state_ == REAL_TCP_CONN_REJECTED) {
         ufd->revents = ufd->events | POLLERR | POLLHUP;
         return true;
     }
+    if (!is_bgp_conn() || sock_state_ != REAL_TCP_ESTABLISHED || !(ufd->events & POLLIN)) {
+        return false;
+    }
+    if (shm || msess) {
+        // no syscall, whatever the controller sent is in the pipe already
+        rcv_fill();
+    }
+    // the next message is buffered already, the kernel has nothing to tell
+    if (rcv_ready()) {
+        ufd->revents = POLLIN;
+        return true;
+    }
     // suppress known unordered POLLIN()
-    if (!is_listener && ufd->events == POLLIN && nxt_msghdr_seen && nxt_msghdr.hdr.seq != nxt_seq) {
+    real_pld_t hdr;
+    if (ufd->events == POLLIN && rcv_front(hdr)) {
         ufd->revents = 0;
         return true;
     }
+    // going to sleep on the socket, the controller rings it for the next bytes
+    if (shm && !shm->arm_rx()) {
+        rcv_fill();
+        if (rcv_ready()) {
+            ufd->revents = POLLIN;
+            return true;
+        }
+    }
     return false;
 }
 
 void tcp_fdesc::poll_slowpath(struct pollfd *ufd, const struct pollfd *kfd)
 {
     int revents = kfd->revents;
-    if (is_listener || (revents & (POLLIN | POLLOUT)) != revents) {
+    if (!is_bgp_conn() || sock_state_ != REAL_TCP_ESTABLISHED || (revents & (POLLIN | POLLOUT)) != revents) {
         ufd->revents = revents;
         return;
     }
     if (revents & POLLIN) {
-        if (!nxt_msghdr_seen) {
-            PEEK_UNTIL(this->fd, &this->nxt_msghdr, pldhdrsiz);
-            LOG("fd %d, revents %x, seq %ld, nxt_seq %ld\n", this->fd, revents, nxt_msghdr.hdr.seq, nxt_seq.load());
-            nxt_msghdr_seen = true;
+        if (shm) {
+            // doorbells or the end of the session, the bytes are in the pipe
+            shm->drain_doorbells();
         }
-        if (nxt_msghdr.hdr.seq != nxt_seq) {
+        rcv_fill();
+        real_pld_t hdr;
+        if (rcv_front(hdr)) {
+            LOG("fd %d, revents %x, seq %ld, nxt_seq %ld\n", this->fd, revents, hdr.hdr.seq, nxt_seq.load());
+        }
+        if (!rcv_ready()) {
+            if (rcv_front(hdr)) {
+                TRACE(SHIM_TR_HOLD, fd, nxt_seq, hdr.hdr.seq, 0);
+            }
             revents &= ~POLLIN;
         }
     }
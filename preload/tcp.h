@@ -5,7 +5,11 @@
 #include "netlink.h"
 #include "util.h"
 #include "fdesc.h"
+#include "rcv_ring.h"
+#include "shm_pipe.h"
+#include "mux.h"
 
+#include <mutex>
 #include <shared_mutex>
 #include <thread>
 #include <memory>
@@ -42,14 +46,18 @@ public:
         tos(192), ttl(255), mtu_discover(0),
         nodelay(0), maxseg(1500), fcntl_fd_flags(0),fcntl_st_flags(0),
         is_listener(false), is_bgp_(_is_bgp), sock_state_(REAL_TCP_CLOSED),
-        msg({nullptr, 0, 0}), nxt_msghdr_seen(false),
-        sk_err_(0), rcv_pending(false), rcv_offset(0)
+        msg({nullptr, 0, 0}),
+        sk_err_(0), rcv_pending(false), rcv_offset(0), rcv_eof(false), acks(false), mux_listener(false)
     {
         LOG("tcp_fdesc(fd=%d)\n", this->fd);
     }
     ~tcp_fdesc() override
     {
         LOG("tcp_fdesc %d deconstruction\n", this->fd);
+        free(msg.buf);
+        if (msess) {
+            glb_mux->close(*msess);
+        }
     }
     ssize_t write(const void *buf, size_t count) override;
     ssize_t writev(const struct iovec *iov, int iovcnt) override;
@@ -79,6 +87,11 @@ public:
     ) override;
     friend int tcp_fcntl_impl(int ufd, int cmd, va_list args);
     bool is_bgp_conn() const override;
+    bool report_idle(long timeout_ns) override;
+    bool on_mux() const override
+    {
+        return msess || mux_listener;
+    }
 
 protected:
     bool pollhup;
@@ -108,16 +121,26 @@ protected:
     int quickack;
     int fcntl_fd_flags;
     int fcntl_st_flags;
-    /* ongoing send message */
+    /* partial message of the last write, buf is kept across messages */
     BgpMessage msg;
     int bgp_len;
-    /* next message to read */
-    real_pld_t nxt_msghdr;
-    bool nxt_msghdr_seen;
-    /* read buffer */
+    /* read buffer, rcv_hdr is the message being read if rcv_pending */
+    std::unique_ptr<rcv_ring> rcv_buf;
     real_pld_t rcv_hdr;
     bool rcv_pending;
     ssize_t rcv_offset;
+    bool rcv_eof;
+    /* set if the controller asked for a REAL_ACK per message in the handshake */
+    bool acks;
+    /* held while a message is written to fd: acks and idle reports may
+       come from other threads than the payloads, as on shm and the mux */
+    std::mutex tx_mutex;
+    /* set if the handshake settled on shm pipes, the socket only rings then */
+    std::unique_ptr<shm_session> shm;
+    /* set if the session is on the mux, fd is its eventfd then */
+    std::shared_ptr<mux_session> msess;
+    /* a BGP listener on the mux, fd is the eventfd of its accept queue */
+    bool mux_listener;
 
     int
     getsockopt_tcp_socket_impl(
@@ -152,5 +175,12 @@ protected:
 private:
     int localhost_connect(const struct sockaddr *addr, socklen_t addrlen);
     int localhost_accept(struct sockaddr *addr, socklen_t *addrlen, int flags, fdesc_set &fdset);
-    ssize_t read_internal(char *buf, int buflen);
+    ssize_t read_internal(const struct iovec *iov, int iovcnt);
+    ssize_t rcv_fill();
+    bool rcv_need(size_t n);
+    bool rcv_front(real_pld_t &hdr) const;
+    bool rcv_ready() const;
+    ssize_t send_bgp(const struct iovec *iov, int iovcnt);
+    void ctrl_write(const void *buf, size_t len);
+    void send_ack(int64_t seq);
 };
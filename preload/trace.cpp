@@ -0,0 +1,91 @@
+#include "trace.h"
+#include "debug.h"
+#include "preload.h"
+
+extern "C" {
+#include <sys/mman.h>
+#include <fcntl.h>
+}
+
+#ifdef PRELOAD_TRACE
+
+static thread_local shim_trace_hdr *tls_trace_ring = nullptr;
+static thread_local bool tls_trace_failed = false;
+
+/**
+ * Maps the calling thread's ring, once the thread knows its node. open()
+ * and close() go straight to the kernel, the fd must not reach glb_fdset.
+ */
+static shim_trace_hdr *trace_ring()
+{
+    if (tls_trace_ring != nullptr || tls_trace_failed || tls_selfid < 0) {
+        return tls_trace_ring;
+    }
+    tls_trace_failed = true;
+    int pid = syscall(SYS_getpid);
+    struct timespec ts;
+    clock_gettime_orig(CLOCK_MONOTONIC, &ts);
+    uint64_t start = ts.tv_sec * 1'000'000'000UL + ts.tv_nsec;
+    char path[128];
+    snprintf(path, sizeof(path), "/ripc/emu-real-%d/trace_%d_%d_%lu.shm", tls_selfid, pid, thread_id, start);
+    // a file the drainer may have mapped is never truncated under it
+    int fd = syscall(SYS_openat, AT_FDCWD, path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        LOG("trace: open %s failed: %s\n", path, strerror(errno));
+        return nullptr;
+    }
+    void *addr = MAP_FAILED;
+    if (ftruncate(fd, SHIM_TRACE_MAPSIZ) == 0) {
+        addr = mmap(nullptr, SHIM_TRACE_MAPSIZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    syscall(SYS_close, fd);
+    if (addr == MAP_FAILED) {
+        LOG("trace: map %s failed: %s\n", path, strerror(errno));
+        return nullptr;
+    }
+    auto *ring = (shim_trace_hdr *)addr;
+    ring->capacity = SHIM_TRACE_RECORDS;
+    ring->node = tls_selfid;
+    ring->pid = pid;
+    ring->tid = thread_id;
+    ring->start = start;
+    // shim_trace skips files whose magic isn't set yet
+    __atomic_store_n(&ring->magic, SHIM_TRACE_MAGIC, __ATOMIC_RELEASE);
+    tls_trace_failed = false;
+    tls_trace_ring = ring;
+    return ring;
+}
+
+void shim_trace(uint16_t event, int fd, int64_t bytes, int64_t seq, uint16_t revents)
+{
+    shim_trace_hdr *ring = trace_ring();
+    if (ring == nullptr) {
+        return;
+    }
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= SHIM_TRACE_RECORDS) {
+        ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    struct timespec ts;
+    clock_gettime_orig(CLOCK_MONOTONIC, &ts);
+    shim_trace_rec &rec = shim_trace_recs(ring)[head & (SHIM_TRACE_RECORDS - 1)];
+    rec.ts = ts.tv_sec * 1'000'000'000UL + ts.tv_nsec;
+    rec.fd = fd;
+    rec.event = event;
+    rec.revents = revents;
+    rec.bytes = bytes;
+    rec.seq = seq;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+void shim_trace_atfork()
+{
+    if (tls_trace_ring != nullptr) {
+        munmap(tls_trace_ring, SHIM_TRACE_MAPSIZ);
+    }
+    tls_trace_ring = nullptr;
+    tls_trace_failed = false;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Binary trace of the intercepted calls when built with TRACE=1.
+ *
+ * Each daemon thread gets a ring of fixed size records in a file it maps
+ * from its node's ipc directory, /ripc/emu-real-<id>/trace_<pid>_<tid>_<start>.shm,
+ * i.e. /opt/lwc/volumes/ripc/emu-real-<id>/ on the controller host. start
+ * keeps a restarted daemon that got the same pid off its predecessor's
+ * file, which is only ever created, never truncated; the controller
+ * removes a node's rings when it starts the node's daemons again. The
+ * thread only stores a record and bumps head; shim_trace on the host maps
+ * the same file, copies what is between tail and head out and bumps tail.
+ * A full ring drops the record and counts it, the daemon never waits for
+ * the drainer.
+ *
+ * This header is shared by libpreload and shim_trace, keep it free of
+ * anything else from the shim.
+ */
+
+enum shim_trace_event : uint16_t {
+    SHIM_TR_READ = 1,     // fd, bytes = return value
+    SHIM_TR_WRITE,        // fd, bytes = return value
+    SHIM_TR_READV,        // fd, bytes = return value
+    SHIM_TR_WRITEV,       // fd, bytes = return value
+    SHIM_TR_PPOLL_ENTER,  // fd = nfds, bytes = timeout (ns), -1 blocks
+    SHIM_TR_PPOLL_FAST,   // fd = nfds, bytes = return value, answered by poll_fastpath
+    SHIM_TR_PPOLL,        // fd = nfds, bytes = return value
+    SHIM_TR_POLLFD,       // fd, revents handed to the daemon, bytes = kernel's, if either is set
+    SHIM_TR_HOLD,         // fd, seq = next message, bytes = nxt_seq: POLLIN masked
+    SHIM_TR_PLD_RECV,     // fd, seq, bytes = payload: a message fully read
+    SHIM_TR_PLD_SEND,     // fd, seq = messages sent so far, bytes = payload
+    SHIM_TR_ACK,          // fd, seq
+    SHIM_TR_IDLE,         // fd, seq = last consumed, bytes = messages sent
+    SHIM_TR_DROPPED,      // in drained files only: bytes = records dropped so far
+    SHIM_TR_BLOCK,        // fd, revents = io_wait_path_id, bytes = ns in poll(), seq = blocks of the path so far
+    SHIM_TR_MAX_EVENT
+};
+
+struct shim_trace_rec {
+    uint64_t ts;      // CLOCK_MONOTONIC, ns
+    int32_t fd;
+    uint16_t event;   // shim_trace_event
+    uint16_t revents;
+    int64_t bytes;
+    int64_t seq;
+};
+static_assert(sizeof(shim_trace_rec) == 32);
+
+constexpr uint64_t SHIM_TRACE_MAGIC = 0x314352544d494853; // "SHIMTRC1"
+constexpr uint32_t SHIM_TRACE_RECORDS = 1 << 16;          // per thread, a power of 2
+
+struct shim_trace_hdr {
+    uint64_t magic;
+    uint32_t capacity;
+    int32_t node;
+    int32_t pid;
+    int32_t tid;
+    uint64_t start;                            // CLOCK_MONOTONIC ns at creation, in the file name
+    alignas(64) std::atomic<uint64_t> head;    // written by the daemon thread
+    alignas(64) std::atomic<uint64_t> tail;    // written by shim_trace
+    alignas(64) std::atomic<uint64_t> dropped; // written by the daemon thread
+};
+
+constexpr size_t SHIM_TRACE_MAPSIZ = sizeof(shim_trace_hdr) + SHIM_TRACE_RECORDS * sizeof(shim_trace_rec);
+
+inline shim_trace_rec *shim_trace_recs(shim_trace_hdr *hdr)
+{
+    return (shim_trace_rec *)(hdr + 1);
+}
+
+#ifdef PRELOAD_TRACE
+
+void shim_trace(uint16_t event, int fd, int64_t bytes, int64_t seq, uint16_t revents);
+// a forked child must not write into its parent's ring
+void shim_trace_atfork();
+
+#define TRACE(event, fd, bytes, seq, revents) shim_trace((event), (fd), (bytes), (seq), (revents))
+#define TRACE_ATFORK() shim_trace_atfork()
+
+#else
+
+#define TRACE(event, fd, bytes, seq, revents) {}
+#define TRACE_ATFORK() {}
+
+#endif